@@ -5,221 +5,1288 @@
 #include <signal.h>
 #include <errno.h>
 #include <assert.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <netinet/in.h>    /* Internet domain header */
 #include <arpa/inet.h>     /* only needed on mac */
 
 #include "helpers.h"
 #include "client.h"
+#include "game.h"
+#include "loop.h"
+#include "matchmaking.h"
+#include "metrics.h"
+#include "timer.h"
+#include "proto.h"
+#include "journal.h"
+#include "spectate.h"
+#include "lobby.h"
+#include "stats.h"
+#include "worker.h"
+#include "upgrade.h"
+#include "tourney.h"
 
-int sigint_received = 0;
+#ifndef MAX_EVENTS
+    #define MAX_EVENTS 256
+#endif
+
+// Default deadlines, in seconds.
+#ifndef LOGIN_TIMEOUT
+    #define LOGIN_TIMEOUT 60    // to send a user name after connecting
+#endif
+
+#ifndef TURN_TIMEOUT
+    #define TURN_TIMEOUT 60     // to make a move
+#endif
+
+#ifndef IDLE_TIMEOUT
+    #define IDLE_TIMEOUT 1800   // to send anything at all while in the lobby
+#endif
+
+// Turns in a row a player may run out of time on before losing the match.
+#ifndef MAX_MISSED_TURNS
+    #define MAX_MISSED_TURNS 2
+#endif
+
+/*
+ * What a client's timer is counting down to.
+ */
+#define TIMER_LOGIN 0
+#define TIMER_IDLE 1
+#define TIMER_TURN 2
+
+/*
+ * Deadlines in milliseconds, the same for every worker. 0 turns a
+ * deadline off.
+ */
+struct timeouts {
+    unsigned long login;
+    unsigned long turn;
+    unsigned long idle;
+    int max_missed;
+};
+
+struct timeouts timeouts = {
+    LOGIN_TIMEOUT * 1000UL, TURN_TIMEOUT * 1000UL, IDLE_TIMEOUT * 1000UL, MAX_MISSED_TURNS
+};
+
+volatile sig_atomic_t sigint_received = 0;
+
+// Set while the workers stop to hand everything over to a new server.
+volatile sig_atomic_t handing_over = 0;
+
+// Written to on SIGINT to wake up every worker's event loop.
+int shutdown_pipe[2];
+
+// Written to when a new server takes over, to wake up every worker's
+// event loop without stopping the admin thread.
+int handover_pipe[2];
+
+// The tournament, if players may register for one, and the worker
+// hosting it. Players of other workers are moved to that one to join.
+struct tourney tourney;
+struct worker *tourney_home = NULL;
+
+// Every worker, for clients moving from one to another.
+struct worker *workers = NULL;
+int num_workers = 1;
+
+// Where a new server asks this one to hand over, and its connection
+// once it has. Watched by worker 0.
+int upgrade_fd = -1;
+int upgrade_conn = -1;
 
 void sigint_handler(int code) {
     sigint_received = 1;
+    int saved_errno = errno;
+    write(shutdown_pipe[1], "", 1);
+    errno = saved_errno;
 }
 
 /*
- * Close all sockets, free memory, and exit with specified exit status.
+ * Return 1 if the workers are to stop running their event loops.
  */
-void clean_exit(struct listen_sock s, struct client_sock *clients, int exit_status) {
-    struct client_sock *tmp;
-    while (clients) {
-        tmp = clients;
-        close(tmp->sock_fd);
-        clients = clients->next;
-        free(tmp->username);
-        free(tmp);
+int stopping() {
+    return sigint_received || handing_over;
+}
+
+/*
+ * Take the connection of a new server asking to take over, and stop the
+ * workers so it can be handed everything they own.
+ */
+void accept_upgrade() {
+    int fd = accept(upgrade_fd, NULL, NULL);
+    if (fd < 0) {
+        return;
     }
-    close(s.sock_fd);
-    free(s.addr);
-    exit(exit_status);
+    if (upgrade_conn >= 0) {
+        close(fd);
+        return;
+    }
+    printf("New server connected, handing over.\n");
+    upgrade_conn = fd;
+    handing_over = 1;
+    write(handover_pipe[1], "", 1);
 }
 
-int main() {
+/*
+ * Close all of the worker's sockets and free its memory.
+ */
+void clean_worker(struct worker *w) {
+    // called on the main thread for every worker, so buffers must go
+    // back to this worker's pool, not whichever one was attached last
+    buf_pool_attach(&w->clients.pool);
+    while (w->inbox != NULL) {
+        struct migrant *m = w->inbox;
+        w->inbox = m->next;
+        close(m->fd);
+        name_release(m->name);
+        line_buf_clear(&m->in);
+        free(m);
+    }
+    close(w->inbox_pipe[0]);
+    close(w->inbox_pipe[1]);
+    pthread_mutex_destroy(&w->inbox_lock);
+    lobby_free(&w->lobby);
+    // sends still in flight are cancelled before their buffers go
+    loop_destroy(w->loop);
+    free_clients(&w->clients);
+    buf_pool_attach(NULL);
+    close(w->s.sock_fd);
+    free(w->s.addr);
+}
 
-    // This line causes stdout not to be buffered.
-    // Don't change this! Necessary for autotesting.
-    setbuf(stdout, NULL);
+/*
+ * Start client c's deadline of the given kind, replacing any other.
+ */
+void arm_timer(struct worker *w, struct client_sock *c, int kind) {
+    unsigned long ms = kind == TIMER_LOGIN ? timeouts.login
+        : kind == TIMER_TURN ? timeouts.turn : timeouts.idle;
+    if (ms == 0) {
+        timer_cancel(&w->timers, &c->timer);
+    } else {
+        timer_arm(&w->timers, &c->timer, kind, ms);
+    }
+}
 
-    /*
-     * Turn off SIGPIPE: write() to a socket that is closed on the other
-     * end will return -1 with errno set to EPIPE, instead of generating
-     * a SIGPIPE signal that terminates the process.
-     */
-    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
-        perror("signal");
-        exit(1);
+/*
+ * Start the turn deadline of the player on turn in match m. The player
+ * waiting for them has no deadline.
+ */
+void arm_turn_timer(struct worker *w, struct match *m) {
+    timer_cancel(&w->timers, &m->players[1 - m->turn]->timer);
+    arm_timer(w, m->players[m->turn], TIMER_TURN);
+}
+
+/*
+ * Put player c, whose match has just ended, back in the queue for its
+ * next one, unless it has a tournament bout to wait for instead.
+ */
+void after_match(struct worker *w, struct client_sock *c) {
+    if (!tourney_playing(c)) {
+        mm_enqueue(&w->mm, c);
     }
+    arm_timer(w, c, TIMER_IDLE);
+}
 
-    // Linked list of clients
-    struct client_sock *clients = NULL;
+/*
+ * Register lobby client curr for the tournament. A client of another
+ * worker than the one hosting it is moved there first, and whatever it
+ * sent after asking is handled there.
+ */
+void join_tourney(struct worker *w, struct client_sock *curr) {
+    if (tourney_home == NULL || tourney_home == w) {
+        tourney_register(curr);
+    } else {
+        curr->migrating = MIGRATE_TOURNEY;
+        curr->migrate_to = tourney_home->id;
+    }
+}
 
-    struct listen_sock s;
-    setup_server_socket(&s);
+/*
+ * Make lobby client curr a spectator of match id on this worker, or of
+ * any match here if id is 0.
+ */
+void watch_here(struct client_sock *curr, unsigned long id) {
+    struct match *m = id != 0 ? game_find(id) : game_any();
+    if (m == NULL) {
+        // over, or moved on, since it was looked up
+        send_notice(curr, NOTICE_NO_MATCH, NULL);
+        return;
+    }
+    spectate_start(m, curr);
+}
 
-    // Set up SIGINT handler
-    struct sigaction sa_sigint;
-    memset (&sa_sigint, 0, sizeof (sa_sigint));
-    sa_sigint.sa_handler = sigint_handler;
-    sa_sigint.sa_flags = 0;
-    sigemptyset(&sa_sigint.sa_mask);
-    sigaction(SIGINT, &sa_sigint, NULL);
- 
-    int exit_status = 0;
-    int max_fd = s.sock_fd;
+/*
+ * Find the match player name is playing in, or any match if name is
+ * empty, preferring one on worker w.
+ * Return 1 and set *worker to the worker it is played on and *id to
+ * its id, or to 0 for any match there, if there is one. Return 0
+ * otherwise.
+ */
+int find_match(struct worker *w, char *name, int *worker, unsigned long *id) {
+    if (name[0] != '\0') {
+        return name_find(name, worker, id) && *id != 0;
+    }
+    *id = 0;
+    for (int i = 0; i < num_workers; i++) {
+        // this worker's own first
+        *worker = (w->id + i) % num_workers;
+        if (__atomic_load_n(&workers[*worker].matches.count, __ATOMIC_RELAXED) > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Make lobby client curr a spectator of the match player name is in,
+ * or of any match if name is empty. For a match on another worker,
+ * the client is moved there first, unless it is in the tournament,
+ * which is played out on this one.
+ */
+void watch_match(struct worker *w, struct client_sock *curr, char *name) {
+    int worker;
+    unsigned long id;
+    if (!find_match(w, name, &worker, &id)) {
+        send_notice(curr, NOTICE_NO_MATCH, NULL);
+        return;
+    }
+    if (worker != w->id) {
+        if (curr->entrant != NULL) {
+            send_notice(curr, NOTICE_IN_TOURNEY, NULL);
+            return;
+        }
+        curr->migrating = MIGRATE_WATCH;
+        curr->migrate_to = worker;
+        curr->watch_id = id;
+        return;
+    }
+    watch_here(curr, id);
+}
+
+/*
+ * Stop lobby client curr spectating.
+ */
+void unwatch_match(struct client_sock *curr) {
+    if (curr->watching == NULL) {
+        return;
+    }
+    spectate_stop(curr);
+    if (curr->proto == PROTO_BINARY) {
+        write_frame_to_client(curr, OP_UNWATCH, "", 0);
+    } else {
+        char msg[] = "Stopped watching.\n";
+        write_buf_to_client(curr, msg, strlen(msg));
+    }
+}
+
+/*
+ * Act on one complete line from client curr: a user name, a move, or
+ * a command or chat while waiting in the lobby.
+ */
+void handle_line(struct worker *w, struct client_sock *curr, char *line) {
+    if (curr->state == STATE_NAME) {
+        int status = set_username(curr, line);
+        if (status == 0) {
+            printf("Username set successfully: %s\n", curr->name->text);
+            name_place(curr->name, w->id, 0);
+            // returning players pick up their rating where they left it
+            curr->stats = stats_lookup(curr->name->text);
+            if (curr->stats != NULL) {
+                curr->rating = curr->stats->rating;
+            }
+            if (curr->proto == PROTO_BINARY) {
+                write_frame_to_client(curr, OP_LOGIN, "", 0);
+            } else {
+                char message[BUF_SIZE];
+                sprintf(message, "Welcome %s! Awaiting opponent...\n", curr->name->text);
+                write_buf_to_client(curr, message, strlen(message));
+            }
+            curr->state = STATE_WAITING;
+            mm_enqueue(&w->mm, curr);
+            arm_timer(w, curr, TIMER_IDLE);
+            lobby_enter(curr);
+            lobby_joined(curr);
+            metric_add(M_LOGINS, 1);
+        } else if (status == 2) {
+            send_notice(curr, NOTICE_NAME_TAKEN, NULL);
+        } else {
+            printf("Failed to set username.\n");
+            send_notice(curr, NOTICE_BAD_NAME, NULL);
+        }
+        return;
+    }
+
+    if (curr->state == STATE_PLAYING) {
+        struct match *m = curr->match;
+        struct client_sock *p1 = m->players[0];
+        struct client_sock *p2 = m->players[1];
+        int turn = m->turn;
+        unsigned long start = metrics_now();
+        int over = match_handle_input(m, curr, line);
+        hist_record(H_TURN, metrics_now() - start);
+        if (over == 1) {
+            // back in the queue; matchmaking keeps them from
+            // being paired with each other again straight away
+            after_match(w, p1);
+            after_match(w, p2);
+        } else if (m->turn != turn) {
+            arm_turn_timer(w, m);
+        }
+        return;
+    }
+
+    // lobby players may watch a match while they wait
+    if (strncmp(line, "/watch", 6) == 0 && (line[6] == '\0' || line[6] == ' ')) {
+        char *name = line + 6;
+        while (*name == ' ') {
+            name++;
+        }
+        watch_match(w, curr, name);
+    } else if (strcmp(line, "/unwatch") == 0) {
+        unwatch_match(curr);
+    } else if (strcmp(line, "/join") == 0) {
+        join_tourney(w, curr);
+    } else if (strcmp(line, "/leave") == 0) {
+        tourney_withdraw(curr);
+    } else if (line[0] != '/' && line[0] != '\0') {
+        lobby_say(curr, line);
+    }
+    arm_timer(w, curr, TIMER_IDLE);
+}
+
+/*
+ * Act on one frame from binary client curr, by handling the lines a
+ * text client would have sent to the same effect.
+ *
+ * Return 1 if the frame is malformed, 0 otherwise.
+ */
+int handle_frame(struct worker *w, struct client_sock *curr, int op, char *payload, int len) {
+    char line[BUF_SIZE];
+    if (memchr(payload, '\0', len) != NULL) {
+        return 1;
+    }
+    memcpy(line, payload, len);
+    line[len] = '\0';
+
+    switch (op) {
+    case OP_WATCH:
+        if (curr->state == STATE_WAITING) {
+            watch_match(w, curr, line);
+            arm_timer(w, curr, TIMER_IDLE);
+        }
+        return 0;
+
+    case OP_UNWATCH:
+        if (curr->state == STATE_WAITING) {
+            unwatch_match(curr);
+            arm_timer(w, curr, TIMER_IDLE);
+        }
+        return 0;
+    }
+
+    if (len == 0) {
+        return 1;
+    }
+    switch (op) {
+    case OP_LOGIN:
+        if (curr->state != STATE_NAME) {
+            return 1;
+        }
+        handle_line(w, curr, line);
+        return 0;
+
+    case OP_MOVE:
+        // moves only mean something in a match; a letter must never be
+        // taken for a name or for lobby chat
+        if (curr->state != STATE_PLAYING || len != 1 || line[0] == 's') {
+            return 1;
+        }
+        handle_line(w, curr, line);
+        return 0;
+
+    case OP_CHAT:
+        if (curr->state == STATE_WAITING) {
+            lobby_say(curr, line);
+            arm_timer(w, curr, TIMER_IDLE);
+            return 0;
+        }
+        // only players have anyone to talk to; chat never logs anyone in
+        if (curr->state != STATE_PLAYING) {
+            return 1;
+        }
+        // "s" and the message in one go; off turn, both are ignored
+        handle_line(w, curr, "s");
+        handle_line(w, curr, line);
+        return 0;
+
+    case OP_TOURNEY:
+        if (len != 1 || (line[0] != TOURNEY_JOIN && line[0] != TOURNEY_LEAVE)) {
+            return 1;
+        }
+        if (curr->state == STATE_WAITING) {
+            handle_line(w, curr, line[0] == TOURNEY_JOIN ? "/join" : "/leave");
+        }
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Register client c for the events it is waiting on: readability unless
+ * it is throttled, and writability while its output is backed up.
+ */
+void watch_client(struct worker *w, struct client_sock *c) {
+    int events = LOOP_STREAM | (c->throttled ? 0 : LOOP_READ) | (c->want_write ? LOOP_WRITE : 0);
+    loop_mod(w->loop, c->sock_fd, events, c);
+}
+
+/*
+ * Charge client curr for bytes and commands it has sent. If that puts
+ * it over its limits, it is not read from again until resume_clients()
+ * finds it back within them.
+ *
+ * Return 1 if it has gone over them too often and is to be dropped,
+ * 0 otherwise.
+ */
+int charge_client(struct worker *w, struct client_sock *curr, long bytes, long commands) {
+    int r = rate_charge(&curr->rate, timer_now_ms(), bytes, commands);
+    if (r == RATE_FLOODING) {
+        printf("Dropping client that is flooding.\n");
+        metric_add(M_FLOOD_DISCONNECTS, 1);
+        send_notice(curr, NOTICE_FLOODING, NULL);
+        loop_detach(w->loop, curr->sock_fd);
+        flush_client(curr);
+        return 1;
+    }
+    if (r == RATE_OVER) {
+        metric_add(M_THROTTLES, 1);
+        throttle(curr);
+        watch_client(w, curr);
+    }
+    return 0;
+}
+
+/*
+ * Act on each complete line or frame client curr has sent so far, then
+ * read more, until it has sent as much as it may for now or is to move
+ * to another worker.
+ *
+ * Return 1 if the client has disconnected, broken the protocol or been
+ * flooding, 0 otherwise.
+ */
+int handle_client(struct worker *w, struct client_sock *curr) {
+    int client_closed = 0;
+    // Readiness is edge-triggered, so keep reading until the socket is
+    // drained, unless the client is throttled first.
+    while (1) {
+        if (curr->proto == PROTO_BINARY) {
+            int op, len, r = 0;
+            char *payload;
+            while (!curr->throttled && !curr->migrating && (r = next_frame(curr, &op, &payload, &len)) == 0) {
+                if (handle_frame(w, curr, op, payload, len) || charge_client(w, curr, 0, 1)) {
+                    return 1;
+                }
+            }
+            if (r == -1) {
+                return 1;
+            }
+        } else {
+            // Handle every complete line the client has sent so far.
+            char *line;
+            while (!curr->throttled && !curr->migrating && next_line(curr, &line) == 0) {
+                handle_line(w, curr, line);
+                if (charge_client(w, curr, 0, 1)) {
+                    return 1;
+                }
+            }
+        }
+        if (client_closed == 3 || curr->throttled || curr->migrating) {
+            return 0;
+        }
+
+        int buffered = curr->in.tail - curr->in.head;
+        client_closed = read_from_client(curr);
+
+        // If error encountered when receiving data
+        if (client_closed == -1 || client_closed == 1) {
+            return 1; // Disconnect the client
+        }
+        int bytes = curr->in.tail - curr->in.head - buffered;
+        if (bytes > 0 && charge_client(w, curr, bytes, 0)) {
+            return 1;
+        }
+    }
+}
+
+/*
+ * Raise the open file limit as far as we are allowed, so the server is
+ * not capped well below MAX_CONNECTIONS by a small default.
+ */
+void raise_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+            perror("setrlimit");
+        }
+    }
+}
+
+/*
+ * Accept every pending connection on the worker's listening socket.
+ */
+void accept_clients(struct worker *w) {
+    int client_fd;
+    struct client_sock *c;
+    while ((client_fd = accept_connection(w->s.sock_fd, &w->clients, &c)) != -1) {
+        if (client_fd == -2) {
+            printf("Server full, turned away a connection.\n");
+            metric_add(M_CONNECTIONS_REJECTED, 1);
+            continue;
+        }
+        if (loop_add(w->loop, client_fd, LOOP_STREAM | LOOP_READ, c)) {
+            close(client_fd);
+            remove_client(&w->clients, c);
+            continue;
+        }
+        arm_timer(w, c, TIMER_LOGIN);
+        printf("Accepted connection\n");
+        metric_add(M_CONNECTIONS_ACCEPTED, 1);
+        metric_add(M_CONNECTIONS_ACTIVE, 1);
+
+        write_buf_to_client(c, PROTO_BANNER, PROTO_BANNER_LEN);
+    }
+}
+
+/*
+ * Close a disconnected client's socket and remove it from the worker.
+ */
+void drop_client(struct worker *w, struct client_sock *curr) {
+    loop_del(w->loop, curr->sock_fd);
+    close(curr->sock_fd);
+    timer_cancel(&w->timers, &curr->timer);
+    metric_add(M_CONNECTIONS_ACTIVE, -1);
+
+    if (curr->match != NULL) {
+        struct client_sock *winner = match_forfeit(curr->match, curr);
+        after_match(w, winner);
+    }
+    tourney_drop(curr);
+    spectate_stop(curr);
+    mm_remove(&w->mm, curr);
+
+    // alert the lobby that a player has left
+    lobby_leave(curr);
+    if (curr->name != NULL) {
+        lobby_left(curr);
+    }
+
+    remove_client(&w->clients, curr);
+}
+
+/*
+ * Send client c a last notice, as far as its socket takes it, and
+ * drop it.
+ */
+void kick_client(struct worker *w, struct client_sock *c, int notice) {
+    send_notice(c, notice, NULL);
+    loop_detach(w->loop, c->sock_fd);
+    flush_client(c);
+    drop_client(w, c);
+}
+
+/*
+ * Act on every client deadline that has passed.
+ */
+void expire_timers(struct worker *w) {
+    timer_advance(&w->timers, timer_now_ms());
+    struct timer *t;
+    while ((t = timer_next_expired(&w->timers)) != NULL) {
+        struct client_sock *c = t->data;
+        if (t->kind == TIMER_LOGIN) {
+            metric_add(M_LOGIN_TIMEOUTS, 1);
+            kick_client(w, c, NOTICE_LOGIN_TIMEOUT);
+
+        } else if (t->kind == TIMER_IDLE) {
+            metric_add(M_IDLE_TIMEOUTS, 1);
+            kick_client(w, c, NOTICE_IDLE_TIMEOUT);
 
-    //setup file descriptor sets
-    fd_set all_fds, listen_fds;
-    FD_ZERO(&all_fds);
-    FD_SET(s.sock_fd, &all_fds);
+        } else if (t->kind == TIMER_TURN) {
+            metric_add(M_TURN_TIMEOUTS, 1);
+            struct match *m = c->match;
+            struct client_sock *p1 = m->players[0];
+            struct client_sock *p2 = m->players[1];
+            if (match_turn_timeout(m, timeouts.max_missed) == 1) {
+                after_match(w, p1);
+                after_match(w, p2);
+            } else {
+                arm_turn_timer(w, m);
+            }
+        }
+    }
+}
 
-    //setup players
-    struct client_sock *p1 = NULL;
-    struct client_sock *p2 = NULL;
+/*
+ * Take client c's socket back from the worker's loop, to hand it over:
+ * the input the loop read ahead is moved into c's buffer, and whatever
+ * of its output the socket does not take now stays queued, to be copied,
+ * as shared buffers belong to this worker.
+ *
+ * Return 1 if the client has disconnected or sent more than its buffer
+ * holds, and is to be dropped, 0 otherwise.
+ */
+int take_back_client(struct worker *w, struct client_sock *c) {
+    loop_detach(w->loop, c->sock_fd);
+    while (loop_read_ahead(w->loop, c->sock_fd) > 0) {
+        int r = read_from_client(c);
+        if (r == -1 || r == 1) {
+            return 1;
+        }
+    }
+    int r = flush_client(c);
+    return r == 1 || r == 2;
+}
+
+/*
+ * Move client c to worker to, for the MIGRATE_ reason it was marked
+ * with. Its socket, unhandled input and unsent output go along with it;
+ * everything else it had on this worker is let go, as if it had left.
+ */
+void migrate_client(struct worker *w, struct worker *to, struct client_sock *c) {
+    int reason = c->migrating;
+    c->migrating = 0;
+    if (take_back_client(w, c)) {
+        drop_client(w, c);
+        return;
+    }
+    struct migrant *m = malloc(sizeof(struct migrant) + c->out.pending);
+    if (m == NULL) {
+        perror("malloc");
+        return;
+    }
+    m->out_len = 0;
+    for (struct out_chunk *ch = c->out.head; ch != NULL; ch = ch->next) {
+        const char *data = ch->shared != NULL ? ch->shared->data : ch->data;
+        memcpy(m->out + m->out_len, data + ch->off, ch->len - ch->off);
+        m->out_len += ch->len - ch->off;
+    }
+    m->reason = reason;
+    m->watch = c->watch_id;
+    m->fd = c->sock_fd;
+    m->id = c->id;
+    m->proto = c->proto;
+    m->name = c->name;
+    c->name = NULL;
+    m->in = c->in;
+    c->in.big = NULL;       // the migrant holds it now
+    m->rate = c->rate;
+    m->stats = c->stats;
+    m->rating = c->rating;
+    memcpy(m->recent, c->recent, sizeof(m->recent));
+    m->recent_next = c->recent_next;
+
+    loop_del(w->loop, c->sock_fd);
+    timer_cancel(&w->timers, &c->timer);
+    spectate_stop(c);
+    mm_remove(&w->mm, c);
+    lobby_leave(c);
+    remove_client(&w->clients, c);
+    metric_add(M_CONNECTIONS_ACTIVE, -1);
+    metric_add(M_CLIENTS_MIGRATED, 1);
+
+    pthread_mutex_lock(&to->inbox_lock);
+    m->next = to->inbox;
+    to->inbox = m;
+    pthread_mutex_unlock(&to->inbox_lock);
+    write(to->inbox_pipe[1], "", 1);
+}
+
+/*
+ * Take in every client other workers have handed over, in the order
+ * they were sent, register them for the tournament or start them
+ * watching their match, and act on what they sent on the way.
+ */
+void receive_migrants(struct worker *w) {
+    char drain[64];
+    while (read(w->inbox_pipe[0], drain, sizeof(drain)) > 0) {
+    }
+    pthread_mutex_lock(&w->inbox_lock);
+    struct migrant *list = w->inbox;
+    w->inbox = NULL;
+    pthread_mutex_unlock(&w->inbox_lock);
+
+    struct migrant *in_order = NULL;
+    while (list != NULL) {
+        struct migrant *m = list;
+        list = m->next;
+        m->next = in_order;
+        in_order = m;
+    }
+
+    while (in_order != NULL) {
+        struct migrant *m = in_order;
+        in_order = m->next;
+        struct client_sock *c = addclient(&w->clients, m->fd);
+        // added afresh, the socket is reported if it is readable already
+        if (loop_add(w->loop, m->fd, LOOP_STREAM | LOOP_READ, c)) {
+            remove_client(&w->clients, c);
+            close(m->fd);
+            name_release(m->name);
+            line_buf_clear(&m->in);
+            free(m);
+            continue;
+        }
+        metric_add(M_CONNECTIONS_ACTIVE, 1);
+        c->id = m->id;
+        c->state = STATE_WAITING;
+        c->proto = m->proto;
+        c->name = m->name;
+        c->in = m->in;
+        c->rate = m->rate;
+        c->stats = m->stats;
+        c->rating = m->rating;
+        memcpy(c->recent, m->recent, sizeof(c->recent));
+        c->recent_next = m->recent_next;
+        if (out_append(&c->out, m->out, m->out_len) == 0 && m->out_len > 0) {
+            mark_dirty(c);
+        }
+        int reason = m->reason;
+        unsigned long watch = m->watch;
+        free(m);
+        name_place(c->name, w->id, 0);
+
+        mm_enqueue(&w->mm, c);
+        lobby_enter(c);
+        arm_timer(w, c, TIMER_IDLE);
+        if (reason == MIGRATE_WATCH) {
+            watch_here(c, watch);
+        } else {
+            tourney_register(c);
+        }
+
+        // Lines it sent while on its way are only buffered, and the
+        // socket may not be reported again until it sends more. When
+        // stopping, they go to the new server with the rest of its input.
+        if (!stopping() && handle_client(w, c) == 1) {
+            drop_client(w, c);
+        }
+    }
+}
+
+/*
+ * Send every client the output queued for it since the last flush, in
+ * a single writev each where possible. A client whose socket is full
+ * is watched for writability, and dropped once it has more than the
+ * high-water mark of output unread.
+ */
+void flush_clients(struct worker *w) {
+    struct client_sock *c;
+    while ((c = next_dirty(&w->clients)) != NULL) {
+        int r = flush_client(c);
+        if (r == 1 || r == 2) {
+            drop_client(w, c);
+            continue;
+        }
+        if (r == 3 && c->out.pending > w->clients.high_water) {
+            printf("Dropping client that stopped reading.\n");
+            drop_client(w, c);
+            continue;
+        }
+
+        int want_write = (r == 3);
+        if (want_write != c->want_write) {
+            c->want_write = want_write;
+            watch_client(w, c);
+        }
+
+        if (r == 0 && c->watch_pending != NULL) {
+            // caught up; the latest update held back can go now, and is
+            // flushed when next_dirty() comes back round to c
+            spectate_catch_up(c);
+        }
+    }
+}
+
+/*
+ * Read again from every throttled client that is back within its
+ * limits, starting with what it sent before it was stopped.
+ *
+ * Return the milliseconds until the next of the others is, or -1 if
+ * there are none.
+ */
+int resume_clients(struct worker *w) {
+    unsigned long now = timer_now_ms();
+    struct client_sock *ready = NULL;
+    struct client_sock *c = w->clients.throttled;
+    while (c != NULL) {
+        struct client_sock *next = c->throttle_next;
+        if (rate_wait(&c->rate, now) == 0) {
+            unthrottle(c);
+            c->throttle_next = ready;
+            ready = c;
+        }
+        c = next;
+    }
+
+    while (ready != NULL) {
+        c = ready;
+        ready = c->throttle_next;
+        watch_client(w, c);
+        if (handle_client(w, c) == 1) {
+            drop_client(w, c);
+        } else if (c->migrating) {
+            migrate_client(w, &workers[c->migrate_to], c);
+        }
+    }
+
+    // those just resumed may have gone straight back over
+    int timeout = -1;
+    for (c = w->clients.throttled; c != NULL; c = c->throttle_next) {
+        int wait = rate_wait(&c->rate, now);
+        if (timeout < 0 || wait < timeout) {
+            timeout = wait;
+        }
+    }
+    return timeout;
+}
+
+/*
+ * Make w the worker the calling thread acts for.
+ */
+void attach_worker(struct worker *w) {
+    metrics_attach(w->id);
+    journal_attach(w->id);
+    lobby_attach(&w->lobby);
+    buf_pool_attach(&w->clients.pool);
+    game_attach(&w->matches, w->id);
+    tourney_attach(w == tourney_home ? &tourney : NULL, &w->mm);
+    loop_attach(w->loop);
+}
+
+/*
+ * Take every socket of worker w, which the calling thread is attached
+ * to, back from its loop before they are handed over: connections it
+ * accepted ahead are taken in, and each client's socket taken back.
+ * Clients that cannot be are dropped.
+ */
+void detach_worker(struct worker *w) {
+    loop_detach(w->loop, w->s.sock_fd);
+    accept_clients(w);
+    int i = 0;
+    while (i < w->clients.count) {
+        struct client_sock *c = w->clients.clients[i];
+        if (take_back_client(w, c)) {
+            // the last client takes its place in the array
+            drop_client(w, c);
+            continue;
+        }
+        i++;
+    }
+}
+
+/*
+ * Watch worker w's sockets again after detach_worker(), as the hand-over
+ * did not happen.
+ */
+void reattach_worker(struct worker *w) {
+    loop_mod(w->loop, w->s.sock_fd, LOOP_READ | LOOP_ACCEPT, &w->s);
+    for (int i = 0; i < w->clients.count; i++) {
+        watch_client(w, w->clients.clients[i]);
+    }
+}
+
+/*
+ * Event loop of a single worker thread. Runs until SIGINT.
+ */
+void *run_worker(void *arg) {
+    struct worker *w = arg;
+    struct loop_event events[MAX_EVENTS];
+    attach_worker(w);
+    int resume = -1;        // milliseconds until a throttled client may be read
 
     do {
-        listen_fds = all_fds;
-        int nready = select(max_fd + 1, &listen_fds, NULL, NULL, NULL);
-        if (sigint_received) break;
+        // sleep no longer than until the next deadline might be due, and
+        // not at all if the lobby has messages a late drop left behind
+        int timeout = lobby_pending() ? 0 : timer_next_timeout(&w->timers);
+        int registration = tourney_timeout(timer_now_ms());
+        if (registration >= 0 && (timeout < 0 || registration < timeout)) {
+            timeout = registration;
+        }
+        if (resume >= 0 && (timeout < 0 || resume < timeout)) {
+            timeout = resume;
+        }
+        int nready = loop_wait(w->loop, events, MAX_EVENTS, timeout);
+        unsigned long start = metrics_now();
+        if (stopping()) break;
         if (nready == -1) {
             if (errno == EINTR) continue;
-            perror("server: select");
-            exit_status = 1;
+            perror("server: loop_wait");
+            w->exit_status = 1;
+            // bring the other workers down too
+            sigint_received = 1;
+            write(shutdown_pipe[1], "", 1);
             break;
         }
 
-        /*
-         * If a new client is connecting, create new
-         * client_sock struct and add to clients linked list.
-         */
-        if (FD_ISSET(s.sock_fd, &listen_fds)) {
-            int client_fd = accept_connection(s.sock_fd, &clients);
-            if (client_fd < 0) {
-                printf("Failed to accept incoming connection.\n");
+        for (int i = 0; i < nready; i++) {
+            if (events[i].data == shutdown_pipe || events[i].data == handover_pipe) {
+                continue;
+            }
+            if (events[i].data == &upgrade_fd) {
+                accept_upgrade();
                 continue;
             }
-            if (client_fd > max_fd) {
-                max_fd = client_fd;
+            if (events[i].data == &w->inbox) {
+                receive_migrants(w);
+                lobby_receive();
+                continue;
             }
-            FD_SET(client_fd, &all_fds);
-            printf("Accepted connection\n");
 
-            char *question = "What is your name? ";
-            write(client_fd, question, strlen(question));
+            /*
+             * If new clients are connecting, create new client_sock
+             * structs and add them to the clients table.
+             */
+            if (events[i].data == &w->s) {
+                accept_clients(w);
+                continue;
+            }
 
+            struct client_sock *curr = events[i].data;
+            if (events[i].events & LOOP_WRITE) {
+                mark_dirty(curr);
+            }
+            if ((events[i].events & (LOOP_READ | LOOP_ERROR)) && handle_client(w, curr) == 1) {
+                drop_client(w, curr); // Client disconnected
+            } else if (curr->migrating) {
+                migrate_client(w, &workers[curr->migrate_to], curr);
+            }
         }
 
-        if (sigint_received) break;
+        if (stopping()) break;
 
-        struct client_sock *curr = clients;
+        resume = resume_clients(w);
+        expire_timers(w);
+        tourney_tick(timer_now_ms());
 
-        while (curr) {
+        // The lobby's messages go to whoever is in it before matchmaking
+        // takes players out, batched in with the rest of their output
+        lobby_flush();
 
-            if (!FD_ISSET(curr->sock_fd, &listen_fds)) {
-                curr = curr->next;
-                continue;
-            }
+        /*
+        * GAME LOGIC
+        */
 
-            int client_closed = 2;
-            while (client_closed == 2) {
-                client_closed = read_from_client(curr);
+        // Start a match for every pair of players waiting in the lobby.
+        // Matches then progress one move at a time as their players'
+        // input arrives, so no match ever holds up the rest of the server.
+        struct client_sock *p1, *p2;
+
+        // Tournament bouts come first, each started as soon as both of
+        // its players are known, so a whole round plays at once
+        while (tourney_next_pair(&p1, &p2)) {
+            struct match *m = start_match(p1, p2);
+            if (m == NULL) {
+                tourney_unpair(p1, p2);
+                break;
             }
+            arm_turn_timer(w, m);
+        }
 
-            // If error encountered when receiving data
-            if (client_closed == -1) {
-                client_closed = 1; // Disconnect the client
+        while (mm_next_pair(&w->mm, &p1, &p2)) {
+            struct match *m = start_match(p1, p2);
+            if (m == NULL) {
+                mm_enqueue(&w->mm, p1);
+                mm_enqueue(&w->mm, p2);
+                break;
             }
+            arm_turn_timer(w, m);
+        }
 
-            if (client_closed == 0  && curr->username == NULL) {
+        // Everything said this iteration goes out in one write per client
+        flush_clients(w);
 
-                char *newline_pos = strchr(curr->buf, '\n');
-                if (newline_pos != NULL) {
-                    // Found a newline, check if it's already part of a network newline
-                    if (newline_pos > curr->buf && *(newline_pos - 1) != '\r') {
-                        *newline_pos = '\r'; // Replace '\n' with '\r'
-                        // Ensure there's enough space to shift and insert '\n'
-                        memmove(newline_pos + 2, newline_pos + 1, strlen(newline_pos + 1) + 1);
-                        curr->inbuf += 1;
-                        *(newline_pos + 1) = '\n'; // Insert '\n' after '\r'
-                    }
-                }
+        metric_add(M_LOOP_ITERATIONS, 1);
+        hist_record(H_LOOP_ITERATION, metrics_now() - start);
 
-                // Here you should already have the complete username in curr->buf
-                if (!set_username(curr)) {
-                    printf("Username set successfully: %s\n", curr->username);
-                    char message[40];
-                    sprintf(message, "Welcome %s! Awaiting opponent...\n", curr->username);
-                    write(curr->sock_fd, message, sizeof(message));
-                    curr->state = 1;
-                } else {
-                    printf("Failed to set username.\n");
-                }
+    } while (!stopping());
 
-            }
+    // anything said to the lobby is queued for its members, in case they
+    // are handed over to a new server
+    lobby_flush();
+    return NULL;
+}
+
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-e epoll|select|uring] [-t threads] [-k skill_buckets] [-w high_water_bytes] [-b backlog]\n"
+        "       [-a admin_socket] [-l login_secs] [-T turn_secs] [-i idle_secs] [-m missed_turns] [-s seed]\n"
+        "       [-j journal_dir] [-P player_store] [-u upgrade_socket] [-x tournament_players] [-X single|double]\n"
+        "       [-r bytes_per_sec] [-R commands_per_sec]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+
+    // This line causes stdout not to be buffered.
+    // Don't change this! Necessary for autotesting.
+    setbuf(stdout, NULL);
+
+    int backend = LOOP_DEFAULT;
+    int skill_buckets = 1;
+    int high_water = OUT_HIGH_WATER;
+    int backlog = MAX_BACKLOG;
+    char *admin_path = NULL;
+    char *journal_path = NULL;
+    char *stats_path = NULL;
+    char *upgrade_path = NULL;
+    int tourney_players = 0;
+    int tourney_format = TOURNEY_SINGLE;
+    uint64_t seed = (uint64_t) time(NULL) ^ ((uint64_t) getpid() << 32);
+    int opt;
+    while ((opt = getopt(argc, argv, "e:t:k:w:b:a:l:T:i:m:s:j:P:u:x:X:r:R:")) != -1) {
+        if (opt == 'e' && strcmp(optarg, "epoll") == 0) {
+            backend = LOOP_EPOLL;
+        } else if (opt == 'e' && strcmp(optarg, "select") == 0) {
+            backend = LOOP_SELECT;
+        } else if (opt == 'e' && strcmp(optarg, "uring") == 0) {
+            backend = LOOP_URING;
+        } else if (opt == 't' && atoi(optarg) > 0) {
+            num_workers = atoi(optarg);
+        } else if (opt == 'k' && atoi(optarg) > 0 && atoi(optarg) <= MM_MAX_BUCKETS) {
+            skill_buckets = atoi(optarg);
+        } else if (opt == 'w' && atoi(optarg) > 0) {
+            high_water = atoi(optarg);
+        } else if (opt == 'b' && atoi(optarg) > 0) {
+            backlog = atoi(optarg);
+        } else if (opt == 'a') {
+            admin_path = optarg;
+        } else if (opt == 'l' && atoi(optarg) >= 0) {
+            timeouts.login = atoi(optarg) * 1000UL;
+        } else if (opt == 'T' && atoi(optarg) >= 0) {
+            timeouts.turn = atoi(optarg) * 1000UL;
+        } else if (opt == 'i' && atoi(optarg) >= 0) {
+            timeouts.idle = atoi(optarg) * 1000UL;
+        } else if (opt == 'm' && atoi(optarg) > 0) {
+            timeouts.max_missed = atoi(optarg);
+        } else if (opt == 's') {
+            seed = strtoull(optarg, NULL, 0);
+        } else if (opt == 'j') {
+            journal_path = optarg;
+        } else if (opt == 'P') {
+            stats_path = optarg;
+        } else if (opt == 'u') {
+            upgrade_path = optarg;
+        } else if (opt == 'x' && atoi(optarg) >= 2 && atoi(optarg) <= TOURNEY_MAX_PLAYERS) {
+            tourney_players = atoi(optarg);
+        } else if (opt == 'X' && strcmp(optarg, "single") == 0) {
+            tourney_format = TOURNEY_SINGLE;
+        } else if (opt == 'X' && strcmp(optarg, "double") == 0) {
+            tourney_format = TOURNEY_DOUBLE;
+        } else if (opt == 'r' && atoi(optarg) >= 0) {
+            rate_limits.bytes = atoi(optarg);
+        } else if (opt == 'R' && atoi(optarg) >= 0) {
+            rate_limits.commands = atoi(optarg);
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    /*
+     * Turn off SIGPIPE: write() to a socket that is closed on the other
+     * end will return -1 with errno set to EPIPE, instead of generating
+     * a SIGPIPE signal that terminates the process.
+     */
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        perror("signal");
+        exit(1);
+    }
+
+    raise_fd_limit();
+
+    // If a server is already running, take over from it: its workers,
+    // listening sockets, clients and matches become ours.
+    int upgrade_from = -1;
+    if (upgrade_path != NULL && (upgrade_from = upgrade_connect(upgrade_path)) >= 0) {
+        if (upgrade_receive_hello(upgrade_from, &num_workers, &seed)) {
+            exit(1);
+        }
+        printf("Taking over from the running server, with %d workers.\n", num_workers);
+    }
+
+    // Matches can be replayed from this and their id
+    printf("Server seed: %llu\n", (unsigned long long) seed);
+    game_seed(seed);
+
+    if (pipe(shutdown_pipe) < 0 || pipe(handover_pipe) < 0 || set_nonblocking(handover_pipe[0])) {
+        perror("pipe");
+        exit(1);
+    }
+
+    // Set up SIGINT handler
+    struct sigaction sa_sigint;
+    memset (&sa_sigint, 0, sizeof (sa_sigint));
+    sa_sigint.sa_handler = sigint_handler;
+    sa_sigint.sa_flags = 0;
+    sigemptyset(&sa_sigint.sa_mask);
+    sigaction(SIGINT, &sa_sigint, NULL);
 
-            if (client_closed == 1) { // Client disconnected
-                // Note: Never reduces max_fd when client disconnects
-                FD_CLR(curr->sock_fd, &all_fds);
-                close(curr->sock_fd);
+    if (metrics_init(num_workers)) {
+        exit(1);
+    }
+    if (stats_path != NULL && stats_open(stats_path)) {
+        exit(1);
+    }
 
-                // //alert all other clients that a player has left
-                // struct client_sock *rec2 = clients;
-                // while (rec2) {
-                //     if (rec2 != curr) {
-                //         char left_msg[BUF_SIZE];
-                //         sprintf(left_msg, "%s left the arena.\n", curr->username);
-                //         write_buf_to_client(rec2, left_msg, strlen(left_msg));
-                //     }
-                //     rec2 = rec2->next;
-                // }
+    workers = calloc(num_workers, sizeof(struct worker));
+    if (workers == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    // Worker 0 hosts the tournament
+    if (tourney_players > 0) {
+        if (tourney_init(&tourney, tourney_players, tourney_format)) {
+            exit(1);
+        }
+        tourney_home = &workers[0];
+    }
 
-                remove_client(&curr, &clients);
+    // Every registered fd carries a pointer to its client_sock, to the
+    // worker's listen_sock or inbox, to shutdown_pipe or handover_pipe,
+    // or to upgrade_fd.
+    for (int i = 0; i < num_workers; i++) {
+        struct worker *w = &workers[i];
+        w->id = i;
+        pthread_mutex_init(&w->inbox_lock, NULL);
+        if (pipe(w->inbox_pipe) < 0 || set_nonblocking(w->inbox_pipe[0])) {
+            perror("pipe");
+            exit(1);
+        }
+        init_clients(&w->clients);
+        w->clients.high_water = high_water;
+        lobby_init(&w->lobby, w->inbox_pipe[1]);
+        mm_init(&w->mm, skill_buckets);
+        timer_wheel_init(&w->timers, timer_now_ms());
+        w->loop = loop_create(backend);
+        if (w->loop == NULL || loop_add(w->loop, shutdown_pipe[0], LOOP_READ, shutdown_pipe)
+                || loop_add(w->loop, handover_pipe[0], LOOP_READ, handover_pipe)
+                || loop_add(w->loop, w->inbox_pipe[0], LOOP_READ, &w->inbox)) {
+            exit(1);
+        }
+        // a server taking over is handed its listening sockets instead
+        if (upgrade_from < 0) {
+            setup_server_socket(&w->s, num_workers > 1, backlog);
+            if (loop_add(w->loop, w->s.sock_fd, LOOP_READ | LOOP_ACCEPT, &w->s)) {
+                exit(1);
             }
-            else {
-                
-                curr = curr->next;
+        }
+    }
+    if (upgrade_from >= 0) {
+        if (upgrade_receive(upgrade_from, workers, num_workers)) {
+            exit(1);
+        }
+        // listening again on a listening socket just sets its backlog
+        for (int i = 0; i < num_workers; i++) {
+            if (listen(workers[i].s.sock_fd, backlog) < 0) {
+                perror("server: listen");
+                exit(1);
             }
         }
+        // the old server lets go of the admin socket and journal before
+        // it closes the connection, unless it gave up on us first
+        if (upgrade_ack(upgrade_from) || upgrade_finish(upgrade_from)) {
+            exit(1);
+        }
+    }
 
-        /*
-        * GAME LOGIC
-        */
+    if (admin_path != NULL && metrics_serve(admin_path, shutdown_pipe[0])) {
+        exit(1);
+    }
+    if (journal_path != NULL && journal_open(journal_path, num_workers, seed)) {
+        exit(1);
+    }
+    if (upgrade_path != NULL) {
+        upgrade_fd = upgrade_listen(upgrade_path);
+        if (upgrade_fd < 0 || loop_add(workers[0].loop, upgrade_fd, LOOP_READ, &upgrade_fd)) {
+            exit(1);
+        }
+    }
 
-        // printf("ALL PLAYERS\n");
-        // struct client_sock *printer = clients;
-        // while (printer) {
-        //     printf("%s %d\n", printer->username, printer->state);
-        //     printer = printer->next;
-        // }
-
-        find_players(clients, &p1, &p2);
-
-        //play the game
-        int game = 0;
-        if (p1 != NULL && p2 != NULL) {
-            game = play_game(clients, p1, p2, &all_fds);
-        }
-
-        //update states: these two just played together so they can't play again.
-        if (game == 1) {
-            //set every player except the two who just played state's to be 1
-            struct client_sock *i = clients;
-            while (i != NULL) {
-                i->state = 1;
-                i = i->next;
-            }
-            p1->state = 2;
-            p2->state = 2;
-            
-            p1 = NULL;
-            p2 = NULL;
-        } else {
-            p1 = NULL;
-            p2 = NULL;
+    int exit_status;
+    while (1) {
+        // The main thread runs worker 0 itself.
+        for (int i = 1; i < num_workers; i++) {
+            int err = pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+            if (err != 0) {
+                fprintf(stderr, "pthread_create: %s\n", strerror(err));
+                exit(1);
+            }
+        }
+        run_worker(&workers[0]);
+
+        exit_status = workers[0].exit_status;
+        for (int i = 1; i < num_workers; i++) {
+            pthread_join(workers[i].thread, NULL);
+            exit_status |= workers[i].exit_status;
+        }
+        // clients still on their way to another worker arrive, so they
+        // are not lost; the tournament itself is not handed over
+        for (int i = 0; i < num_workers; i++) {
+            attach_worker(&workers[i]);
+            receive_migrants(&workers[i]);
+        }
+        // what the loops hold for the sockets goes along with them
+        if (handing_over && !sigint_received) {
+            for (int i = 0; i < num_workers; i++) {
+                attach_worker(&workers[i]);
+                detach_worker(&workers[i]);
+            }
+        }
+        if (!handing_over || sigint_received
+                || upgrade_send(upgrade_conn, workers, num_workers, seed) == 0) {
+            break;
         }
 
-    } while (!sigint_received);
+        // the new server went away; carry on as if it never came
+        printf("Hand-over failed, carrying on.\n");
+        for (int i = 0; i < num_workers; i++) {
+            attach_worker(&workers[i]);
+            reattach_worker(&workers[i]);
+        }
+        close(upgrade_conn);
+        upgrade_conn = -1;
+        char drain[16];
+        while (read(handover_pipe[0], drain, sizeof(drain)) > 0) {
+        }
+        handing_over = 0;
+    }
+    if (handing_over) {
+        // stop the admin thread, which SIGINT would have
+        write(shutdown_pipe[1], "", 1);
+    }
 
-    clean_exit(s, clients, exit_status);
+    for (int i = 0; i < num_workers; i++) {
+        clean_worker(&workers[i]);
+    }
+    free(workers);
+    names_free();
+    tourney_free(&tourney);
+    journal_close();
+    stats_close();
+    metrics_shutdown();
+    upgrade_close();
+    // a new server taking over waits for this before it starts
+    if (upgrade_conn >= 0) {
+        close(upgrade_conn);
+    }
+    close(shutdown_pipe[0]);
+    close(shutdown_pipe[1]);
+    close(handover_pipe[0]);
+    close(handover_pipe[1]);
+    exit(exit_status);
 
 }
@@ -2,13 +2,20 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/socket.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <signal.h>
 #include <assert.h>
+#include <stdatomic.h>
 
 #include "client.h"
 #include "helpers.h"
+#include "game.h"
+#include "loop.h"
+#include "matchmaking.h"
+#include "metrics.h"
+#include "proto.h"
 
 int write_buf_to_client(struct client_sock *c, char *buf, int len) {
     if (len > 0 && buf[len-1] == '\0') { // Check if the last character is null terminator
@@ -21,441 +28,404 @@ int write_buf_to_client(struct client_sock *c, char *buf, int len) {
 
         buf[len] = '\n';
     }
-    return write_to_socket(c->sock_fd, buf, len);
+    if (out_append(&c->out, buf, len)) {
+        return 1;
+    }
+    mark_dirty(c);
+    return 0;
 }
 
-struct client_sock *addclient(struct client_sock **top, int fd) {
-    // Allocate memory for the new client
-    struct client_sock *new_client = malloc(sizeof(struct client_sock));
-    if (new_client == NULL) {
-        // Memory allocation failed
-        perror("Failed to allocate memory for new client");
-        exit(EXIT_FAILURE); // Or handle error as appropriate
+int write_frame_to_client(struct client_sock *c, int op, const void *payload, int len) {
+    char frame[PROTO_HEADER + PROTO_MAX_PAYLOAD];
+    if (out_append(&c->out, frame, encode_frame(frame, op, payload, len))) {
+        return 1;
     }
+    mark_dirty(c);
+    return 0;
+}
 
-    // Initialize the new client's fields
-    new_client->sock_fd = fd;       // Set file descriptor
-    new_client->state = 0;          // Initial state, adjust as necessary
-    new_client->username = NULL;    // Username not set yet
-    memset(new_client->buf, 0, BUF_SIZE); // Clear the buffer
-    new_client->inbuf = 0;          // No data in buffer yet
-    new_client->next = NULL;        // Next client not known yet
-
-    // Insert the new client at the start of the linked list
-    if (*top == NULL) {
-        // List is empty, new client is now the head
-        *top = new_client;
-    } else {
-        // List is not empty, insert new client at the end
-        struct client_sock *i = *top;
-        while (i != NULL && i->next != NULL) {
-            i = i->next;
+void send_notice(struct client_sock *c, int notice, struct client_sock *other) {
+    if (c->proto == PROTO_BINARY) {
+        if (notice != NOTICE_SAY) {
+            unsigned char code = notice;
+            write_frame_to_client(c, OP_NOTICE, &code, 1);
         }
-        i->next = new_client;
+        return;
     }
 
-    return new_client; // Return the address of the new client
+    char msg[BUF_SIZE + MAX_NAME];
+    switch (notice) {
+    case NOTICE_INVALID_MOVE:
+        strcpy(msg, "\nNot a valid move.\n");
+        break;
+    case NOTICE_FULL_HEALTH:
+        strcpy(msg, "You are at full health, you cannot use a heal\n");
+        break;
+    case NOTICE_TURN_TIMEOUT:
+        strcpy(msg, "\nYou ran out of time and lost your turn.\n");
+        break;
+    case NOTICE_OPPONENT_TIMEOUT:
+        snprintf(msg, sizeof(msg), "\n%s ran out of time.\n", other->name->text);
+        break;
+    case NOTICE_LOGIN_TIMEOUT:
+        strcpy(msg, "\nTimed out waiting for a name.\n");
+        break;
+    case NOTICE_IDLE_TIMEOUT:
+        strcpy(msg, "\nDisconnected for being idle.\n");
+        break;
+    case NOTICE_SAY:
+        strcpy(msg, "Type message: ");
+        break;
+    case NOTICE_NO_MATCH:
+        strcpy(msg, "No such match to watch.\n");
+        break;
+    case NOTICE_NAME_TAKEN:
+        strcpy(msg, "That name is taken, try another.\n");
+        break;
+    case NOTICE_FLOODING:
+        strcpy(msg, "\nDisconnected for sending too much.\n");
+        break;
+    case NOTICE_IN_TOURNEY:
+        strcpy(msg, "Cannot watch that match while in the tournament.\n");
+        break;
+    default:
+        // text clients are just asked again
+        return;
+    }
+    write_buf_to_client(c, msg, strlen(msg));
 }
 
-int accept_connection(int fd, struct client_sock **clients) {
-
-    // setting up connection
-    struct sockaddr_in peer;
-    unsigned int peer_len = sizeof(peer);
-    peer.sin_family = AF_INET;
-
-    //counting the num of clients. if too many, error. 
-    int num_clients = 0;
-    struct client_sock *curr = *clients;
-    while (curr != NULL && num_clients < MAX_CONNECTIONS && curr->next != NULL) {
-        curr = curr->next;
-        num_clients++;
+void mark_dirty(struct client_sock *c) {
+    if (c->dirty) {
+        return;
     }
-
-    if (num_clients < MAX_CONNECTIONS) { 
-        //accept connection
-        int client_fd = accept(fd, (struct sockaddr *)&peer, &peer_len);
-
-        if (client_fd < 0) {
-            perror("server: accept");
-            return -1;
-        }
-
-        //create client
-        addclient(clients, client_fd);
-        
-        return client_fd;
-
-    } else {
-        return -1;
+    struct client_table *t = c->table;
+    c->dirty = 1;
+    c->dirty_prev = NULL;
+    c->dirty_next = t->dirty;
+    if (t->dirty != NULL) {
+        t->dirty->dirty_prev = c;
     }
-
+    t->dirty = c;
 }
 
-int remove_client(struct client_sock **curr, struct client_sock **clients) {
-    if (curr == NULL || *curr == NULL || clients == NULL || *clients == NULL) {
-        // Invalid pointers or empty list, cannot proceed
-        return 1;
+/*
+ * Take client c off its table's dirty list, if it is on it.
+ */
+static void unmark_dirty(struct client_sock *c) {
+    if (!c->dirty) {
+        return;
     }
-
-    struct client_sock *temp = *clients;
-    struct client_sock *prev = NULL;
-
-    // If the client to remove is the head of the list
-    if (temp == *curr) {
-        *clients = temp->next; // Head now points to the next client
-        free(temp->username);  // Free dynamically allocated username
-        free(temp);            // Free the client struct itself
-        *curr = *clients;      // Update curr to point to the new head (or NULL if list is now empty)
-        return 0;              // Success
+    if (c->dirty_prev != NULL) {
+        c->dirty_prev->dirty_next = c->dirty_next;
+    } else {
+        c->table->dirty = c->dirty_next;
     }
-
-    // Find the client to remove, keeping track of the previous client
-    while (temp != NULL && temp != *curr) {
-        prev = temp;
-        temp = temp->next;
+    if (c->dirty_next != NULL) {
+        c->dirty_next->dirty_prev = c->dirty_prev;
     }
+    c->dirty = 0;
+}
 
-    // If the client was not found in the list
-    if (temp == NULL) {
-        return 1; // Client not found
+void throttle(struct client_sock *c) {
+    if (c->throttled) {
+        return;
     }
-
-    // Client found, remove it from the list
-    if (prev != NULL) {
-        prev->next = temp->next; // Bypass the client to be removed
+    struct client_table *t = c->table;
+    c->throttled = 1;
+    metric_add(M_THROTTLED, 1);
+    c->throttle_prev = NULL;
+    c->throttle_next = t->throttled;
+    if (t->throttled != NULL) {
+        t->throttled->throttle_prev = c;
     }
+    t->throttled = c;
+}
 
-    // Free the removed client's resources
-    free(temp->username);
-    free(temp);
-
-    // If there's a next client, update curr to point to it
-    if (prev != NULL && prev->next != NULL) {
-        *curr = prev->next;
+void unthrottle(struct client_sock *c) {
+    if (!c->throttled) {
+        return;
+    }
+    if (c->throttle_prev != NULL) {
+        c->throttle_prev->throttle_next = c->throttle_next;
     } else {
-        // Otherwise, we removed the last client, so update curr to NULL
-        *curr = NULL;
+        c->table->throttled = c->throttle_next;
     }
-
-    return 0; // Success
+    if (c->throttle_next != NULL) {
+        c->throttle_next->throttle_prev = c->throttle_prev;
+    }
+    c->throttled = 0;
+    metric_add(M_THROTTLED, -1);
 }
 
-/*
- * Return -1 if read error or maximum message size is exceeded.
- * Return 0 upon receipt of CRLF-terminated message.
- * Return 1 if client socket has been closed.
- * Return 2 upon receipt of partial (non-CRLF-terminated) message.
- */
-int read_from_client(struct client_sock *curr) {
-    return read_from_socket(curr->sock_fd, curr->buf, &(curr->inbuf));
+struct client_sock *next_dirty(struct client_table *t) {
+    struct client_sock *c = t->dirty;
+    if (c != NULL) {
+        unmark_dirty(c);
+    }
+    return c;
 }
 
-/* Set a client's user name.
- * Returns 0 on success.
- * Returns 1 on either get_message() failure or
- * if user name contains invalid character(s).
- */
-int set_username(struct client_sock *curr) {
+int flush_client(struct client_sock *c) {
+    int pending = c->out.pending;
+    int r = out_flush(c->sock_fd, &c->out);
+    metric_add(M_BYTES_OUT, pending - c->out.pending);
+    return r;
+}
 
-    int r = get_message(&(curr->username), curr->buf, &(curr->inbuf));
-    if (r == 1) {
-        return 1;
-    } 
+void init_clients(struct client_table *t) {
+    memset(t, 0, sizeof(struct client_table));
+    t->high_water = OUT_HIGH_WATER;
+}
 
-    for(int i = 0; i < strlen(curr->username); i++) {
-        if (strcmp(curr->username, " ")==0) { //username contains invalid characters
-            return 1;
+void free_clients(struct client_table *t) {
+    for (int i = 0; i < t->count; i++) {
+        struct client_sock *c = t->clients[i];
+        close(c->sock_fd);
+        name_release(c->name);
+        line_buf_clear(&c->in);
+        out_clear(&c->out);
+        if (c->watch_pending != NULL) {
+            shared_release(c->watch_pending);
+        }
+        if (c->match != NULL) {
+            // freed with whichever player comes first
+            struct match *m = c->match;
+            m->players[0]->match = NULL;
+            m->players[1]->match = NULL;
+            free(m);
         }
     }
-    return 0;
+    while (t->slabs != NULL) {
+        struct client_slab *slab = t->slabs;
+        t->slabs = slab->next;
+        free(slab);
+    }
+    free(t->by_fd);
+    free(t->clients);
+    buf_pool_free(&t->pool);
+    int high_water = t->high_water;
+    init_clients(t);
+    t->high_water = high_water;
+}
 
+/*
+ * Grow *array of *cap pointers to hold at least n, zeroing the new entries.
+ */
+static void grow_array(struct client_sock ***array, int *cap, int n) {
+    int new_cap = *cap ? *cap : CLIENT_SLAB;
+    while (new_cap < n) {
+        new_cap *= 2;
+    }
+    struct client_sock **grown = realloc(*array, new_cap * sizeof(struct client_sock *));
+    if (grown == NULL) {
+        perror("Failed to allocate memory for client table");
+        exit(EXIT_FAILURE);
+    }
+    memset(grown + *cap, 0, (new_cap - *cap) * sizeof(struct client_sock *));
+    *array = grown;
+    *cap = new_cap;
 }
 
-void find_players(struct client_sock *top, struct client_sock **p1, struct client_sock **p2) {
+// Ids start at 1 so that 0 never matches a real opponent.
+static atomic_ulong next_client_id = 1;
 
-    struct client_sock *i = top;
+unsigned long client_next_id() {
+    return atomic_load(&next_client_id);
+}
 
-    while (i != NULL) {
+void client_resume(unsigned long next_id) {
+    atomic_store(&next_client_id, next_id);
+}
 
-        if ((i->state == 1 || i->state == 2) && *p1 == NULL) {
-            *p1 = i;
+struct client_sock *addclient(struct client_table *t, int fd) {
+    // Take a struct from the pool, topping the pool up with a new slab if empty
+    if (t->free_list == NULL) {
+        struct client_slab *slab = malloc(sizeof(struct client_slab));
+        if (slab == NULL) {
+            // Memory allocation failed
+            perror("Failed to allocate memory for new client");
+            exit(EXIT_FAILURE); // Or handle error as appropriate
         }
-        else if ((i->state == 1 || i->state == 2) && *p2 == NULL && *p1 != i) {
-            if ( ((*p1)->state == 2 && i->state == 1) || ((*p1)->state == 1)) {
-                *p2 = i;
-            }
+        slab->next = t->slabs;
+        t->slabs = slab;
+        for (int i = CLIENT_SLAB - 1; i >= 0; i--) {
+            slab->clients[i].next = t->free_list;
+            t->free_list = &slab->clients[i];
         }
+    }
+    struct client_sock *new_client = t->free_list;
+    t->free_list = new_client->next;
 
-        i = i->next;
+    // Initialize the new client's fields
+    new_client->sock_fd = fd;       // Set file descriptor
+    new_client->state = STATE_NAME; // Waiting for a user name
+    new_client->proto = PROTO_UNKNOWN;
+    new_client->name = NULL;    // Username not set yet
+    new_client->in.big = NULL;      // No data in buffer yet
+    new_client->in.head = 0;
+    new_client->in.tail = 0;
+    new_client->in.scanned = 0;
+    new_client->out.head = NULL;    // Nothing to send yet
+    new_client->out.tail = NULL;
+    new_client->out.pending = 0;
+    new_client->want_write = 0;
+    new_client->dirty = 0;
+    new_client->table = t;
+    new_client->match = NULL;       // Not playing yet
+    new_client->watching = NULL;
+    new_client->watch_pending = NULL;
+    new_client->in_lobby = 0;
+    new_client->id = atomic_fetch_add(&next_client_id, 1);
+    new_client->stats = NULL;
+    new_client->rating = RATING_START;
+    memset(new_client->recent, 0, sizeof(new_client->recent));
+    new_client->recent_next = 0;
+    new_client->bucket = -1;        // Not queued for a match yet
+    new_client->queue_prev = NULL;
+    new_client->queue_next = NULL;
+    new_client->entrant = NULL;     // Not in a tournament
+    new_client->migrating = 0;
+    new_client->throttled = 0;
+    rate_init(&new_client->rate, timer_now_ms());
+    timer_init(&new_client->timer, new_client);
+    new_client->next = NULL;
+
+    if (fd >= t->fd_cap) {
+        grow_array(&t->by_fd, &t->fd_cap, fd + 1);
     }
+    if (t->count == t->cap) {
+        grow_array(&t->clients, &t->cap, t->count + 1);
+    }
+    t->by_fd[fd] = new_client;
+    new_client->index = t->count;
+    t->clients[t->count++] = new_client;
+    metric_add(M_CONNECTION_BYTES, sizeof(struct client_sock));
+
+    return new_client; // Return the address of the new client
 }
-/*Returns 0 on closed socket*/
-
-int play_game(struct client_sock *top, struct client_sock *p1, struct client_sock *p2, fd_set *all_fds) {
-
-    //so that the buffer is empty whenever we start a new game
-    memset(p1->buf, 0, BUF_SIZE);
-    memset(p2->buf, 0, BUF_SIZE);
-    p1->inbuf = 0;
-    p2->inbuf = 0;
-
-    //want the hitpoints of each player to be at least 20
-    int power1 = 20 + (rand() % 5);
-    int power2 = 20 + (rand() % 5);
-    //want each player to have at least 1 power move
-    int powermoves1 = 1 + (rand() % 4);
-    int powermoves2 = 1 + (rand() % 4);
-    // healing moves for both players. min 1, max 3
-    int healsp1 = 1 + (rand() % 3);
-    int healsp2 = 1 + (rand() % 3);
-
-    struct client_sock *player = p1;
-    struct client_sock *waiter = p2;
-    char *message = "(a) Regular move\n(p) Power move\n(s) Say something\n(h) Heal yourself\n";
-    int client_closed = 0;
-    
-    char *move;
-
-    //send welcome messages to players
-    char welcome_player1[BUF_SIZE];
-    sprintf(welcome_player1, "Welcome! You are playing %s.\nYour hitpoints: %d\nYour powermoves: %d\n", waiter->username, power1, powermoves1);
-    write_buf_to_client(player, welcome_player1, strlen(welcome_player1));
-
-    char welcome_player2[BUF_SIZE];
-    sprintf(welcome_player2, "Welcome! You are playing %s.\n", player->username);
-    write_buf_to_client(waiter, welcome_player2, strlen(welcome_player2));
-    
-    int max_health_p1 = power1;
-    int max_health_p2 = power2; 
-    //turn logic
-    while (power1 > 0 && power2 > 0) {
-
-        //reduces the number of if - else statements we have to use
-        int *player_power, *waiter_power;
-        int *waiter_moves, *player_moves;
-        int *player_heals, *waiter_heals;
-        int *player_max;
-        if (player == p1) {
-            player_power = &power1;
-            waiter_power = &power2;
-            waiter_moves = &powermoves2;
-            player_moves = &powermoves1;
-            player_heals = &healsp1;
-            waiter_heals = &healsp2;
-            player_max = &max_health_p1;
-        } else {
-            player_power = &power2;
-            waiter_power = &power1;
-            waiter_moves = &powermoves1;
-            player_moves = &powermoves2;
-            player_heals = &healsp2;
-            waiter_heals = &healsp2;
-            player_max = &max_health_p2;
-        }
 
-        //send information to the waiter
-        char waiter_msg[BUF_SIZE];
-        sprintf(waiter_msg, "\nYour hitpoints: %d\nYour powermoves: %d\nYour healing moves: %d\n\n%s's hitpoints: %d\n",*waiter_power, *waiter_moves,*waiter_heals,player->username, *player_power);
-        write_buf_to_client(waiter, waiter_msg, strlen(waiter_msg));
+struct client_sock *find_client(struct client_table *t, int fd) {
+    if (fd < 0 || fd >= t->fd_cap) {
+        return NULL;
+    }
+    return t->by_fd[fd];
+}
 
-        //send prompt to the player
-        write_buf_to_client(player, message, strlen(message));
+int accept_connection(int fd, struct client_table *t, struct client_sock **new_client) {
 
-        //check if available for reading
-        client_closed = read_from_client(player);
-        // printf("Read from client returned %d\n",client_closed);
+    //accept connection, non-blocking from the start
+    int client_fd = loop_accept(fd);
+    if (client_fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("server: accept");
+        }
+        return -1;
+    }
 
-        // waiter_closed = check_socket_closed(waiter);
-        // if (waiter_closed == 0){
-        //     FD_CLR(waiter->sock_fd, all_fds);
-        //     close(waiter->sock_fd);
+    // Turn the client away now rather than leaving it in the backlog,
+    // where an edge-triggered listener would never report it again. A new
+    // socket's send buffer is empty, so the reply cannot block.
+    if (t->count >= MAX_CONNECTIONS) {
+        send(client_fd, PROTO_FULL, PROTO_FULL_LEN, MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(client_fd);
+        return -2;
+    }
 
+    //create client
+    *new_client = addclient(t, client_fd);
 
-        //     char disconnect_msg[BUF_SIZE];
-        //     sprintf(disconnect_msg, "--%s dropped. You win!", waiter->username);
-        //     write_buf_to_client(player, disconnect_msg, strlen(disconnect_msg));
+    return client_fd;
+}
 
-        //     remove_client(&waiter, &top);
+int remove_client(struct client_table *t, struct client_sock *c) {
+    if (c == NULL || find_client(t, c->sock_fd) != c) {
+        return 1; // Client not found
+    }
 
-        //     return 0;
-        // }
-        //check message 
-        //handle case where we can't read
-        if (client_closed == -1 || client_closed == 1) {
+    // Fill the hole with the last client so the array stays dense
+    struct client_sock *last = t->clients[--t->count];
+    t->clients[c->index] = last;
+    last->index = c->index;
+    t->by_fd[c->sock_fd] = NULL;
+
+    // Free the removed client's resources and return it to the pool
+    unmark_dirty(c);
+    unthrottle(c);
+    line_buf_clear(&c->in);
+    out_clear(&c->out);
+    if (c->watch_pending != NULL) {
+        shared_release(c->watch_pending);
+        c->watch_pending = NULL;
+    }
+    if (c->name != NULL) {
+        name_release(c->name);
+        c->name = NULL;
+        metric_add(M_CONNECTION_BYTES, -(long) sizeof(struct name));
+    }
+    metric_add(M_CONNECTION_BYTES, -(long) sizeof(struct client_sock));
+    c->next = t->free_list;
+    t->free_list = c;
 
-            FD_CLR(player->sock_fd, all_fds);
-            close(player->sock_fd);
-            
-            char close_msg[BUF_SIZE];
-            sprintf(close_msg, "--%s dropped. You win!\nAwaiting next player...", player->username);
-            
-            write_buf_to_client(waiter, close_msg, strlen(close_msg));
+    return 0; // Success
+}
 
-            remove_client(&player, &top);
+/*
+ * Return -1 if read error or maximum message size is exceeded.
+ * Return 0 if a complete line is buffered.
+ * Return 1 if client socket has been closed.
+ * Return 2 upon receipt of partial (non-newline-terminated) message.
+ * Return 3 if there is nothing more to read for now.
+ */
+int read_from_client(struct client_sock *curr) {
+    struct line_buf *b = &curr->in;
+    int buffered = b->tail - b->head;
+    int r;
+    if (curr->proto == PROTO_BINARY) {
+        // frames carry their length, so there is nothing to scan for
+        r = read_to_buf(curr->sock_fd, b);
+    } else {
+        r = read_to_line_buf(curr->sock_fd, b);
+    }
+    if (r != 0 && r != 2) {
+        return r;
+    }
+    metric_add(M_BYTES_IN, b->tail - b->head - buffered);
 
+    if (curr->proto == PROTO_UNKNOWN) {
+        if ((unsigned char) line_buf_bytes(b)[b->head] == PROTO_MAGIC) {
+            curr->proto = PROTO_BINARY;
+            b->head++;
+            b->scanned = 0;
             return 0;
-
-        } else if (client_closed == 2 || client_closed == 0) {
-
-            //we add a network newline
-            if (strlen(player->buf) == 1) {
-                player->buf[1] = '\r';
-                player->buf[2] = '\n';
-                player->inbuf += 2;
-            }
-            else {
-                memset(player->buf, 0, BUF_SIZE);
-                player->inbuf = 0;
-                continue;
-            }
-            
-            //read the message
-            int err = get_message(&move, player->buf, &(player->inbuf));
-
-            if (err == 1) { //can't read the message
-                char *msg_error = "Could not get message.\n";
-                write_buf_to_client(player, msg_error, strlen(msg_error));
-
-                break;
-            } else { 
-                if (strcmp(move, "a") == 0) {
-
-                    int deduc = rand() % 6;
-                    *waiter_power -= deduc;
-                    char hit_msg[BUF_SIZE];
-                    sprintf(hit_msg, "You hit %s for %d points.\n",waiter->username, deduc);
-                    write_buf_to_client(player, hit_msg, strlen(hit_msg));
-
-                } else if(strcmp(move, "p") == 0) {
-
-                    int hit_or_not = rand() % 3;
-                    int deduc = 10 + (rand() % 10);
-
-                    if ((*player_moves) <= 0) {
-                        if ((*player_heals)<= 0){
-                            message = "(a) Regular move\n(s) Say something\n";
-                            continue;
-                        }
-                        else{
-                            message = "(a) Regular move\n(s) Say something\n(h) Heal yourself\n";
-                            continue;
-                        }   
-                    } else {
-                        if (hit_or_not == 1) { //powermove hits
-                            *waiter_power -= deduc;
-                            char hit_msg2[BUF_SIZE];
-                            sprintf(hit_msg2, "You hit %s for %d points.\n",waiter->username, deduc);
-                            write_buf_to_client(player, hit_msg2, strlen(hit_msg2));
-                        } else {
-                            char *missed_msg = "You missed.\n";
-                            write_buf_to_client(player, missed_msg, strlen(missed_msg));
-                        }
-                        
-                        *player_moves -= 1;
-                    }
-
-                } else if(strcmp(move, "s") == 0) {
-
-                    char *prompt = "Type message: ";
-                    write_buf_to_client(player, prompt, strlen(prompt));
-
-                    int msg_okay = 2;
-                    while (msg_okay == 2) {
-                        msg_okay = read_from_client(player);
-                    }
-
-                    char *newline_pos = strchr(player->buf, '\n');
-                    if (newline_pos != NULL) {
-                        // Found a newline, check if it's already part of a network newline
-                        if (newline_pos > player->buf && *(newline_pos - 1) != '\r') {
-                            *newline_pos = '\r'; // Replace '\n' with '\r'
-                            // Ensure there's enough space to shift and insert '\n'
-                            memmove(newline_pos + 2, newline_pos + 1, strlen(newline_pos + 1) + 1);
-                            player->inbuf += 1;
-                            *(newline_pos + 1) = '\n'; // Insert '\n' after '\r'
-                        }
-                    }
-
-                    char *msg_to_send;
-                    get_message(&msg_to_send, player->buf, &(player->inbuf));
-                    write_to_socket(waiter->sock_fd, msg_to_send, strlen(msg_to_send));
-
-
-                }
-                else if(strcmp(move , "h") == 0){ // if the player selects a healing move.
-                    int value =1+ (rand() % 10); // I just choose the first number off the top of my head.
-                    if((*player_power) == (*player_max)){ // Will not allow them to heal at full health 
-                        char *out = "You are at full health, you cannot use a heal\n"; 
-                        write_buf_to_client(player,out,strlen(out));
-                        continue;
-                    } 
-                    else if ((*player_heals)  <= 0){
-                       if ((*player_moves) <= 0){ 
-                           message = "(a) Regular move\n(s) Say something\n";
-                           continue;
-                       } else{
-                           message = "(a) Regular move\n(p) Power move \n(s) Say something\n";
-                           continue;
-                       }
-                    }
-                    else{
-                        int check = (*player_power) + value; 
-                        while(check > (*player_max)){
-                            value = 1 + (rand() % 10); //reroll the number.
-                            check = (*player_power) + value; 
-                        }
-                        *player_power += value;
-                        char healing_msg[16]; 
-                        sprintf(healing_msg, "You healed %d HP", value);
-                        write_buf_to_client(player, healing_msg, strlen(healing_msg));
-                        *player_heals -= 1;
-                    }
-                }
-                else if (strcmp(move, "a") != 0 && strcmp(move, "p") != 0 && strcmp(move, "s") != 0 && strcmp(move, "h") != 0)
-                {
-
-                    char *inp_error = "\nNot a valid move.\n";
-                    write_buf_to_client(player, inp_error, strlen(inp_error));
-                }
-            }
-        }
-
-        if ((*player_heals > 0) && (*player_power <=0)){
-            message = "(a) Regular move\n(s) Say something\n(h) Heal yourself\n"; 
-        }
-        else if ((*player_heals <= 0) && (*player_power > 0)){
-            message = "(a) Regular move\n(p) Power move \n(s) Say something\n"; 
-
-        }
-        else if ((*player_heals <= 0) && (*player_power <= 0)){
-            message = "(a) Regular move\n(p) Power move \n(s) Say something\n";
         }
+        curr->proto = PROTO_TEXT;
+    }
+    return r;
+}
 
-        //check who is winning / losing
-        char *winner = "You won!\n";
-        char *loser = "You lost.\n";
-        if (power1 <= 0) {
-            write_buf_to_client(p1, loser, strlen(loser));
-            write_buf_to_client(p2, winner, strlen(winner));
+int next_line(struct client_sock *curr, char **line) {
+    int len;
+    return next_line_view(&curr->in, line, &len);
+}
 
-            return 1;
-        } else if (power2 <= 0) {
-            write_buf_to_client(p1, winner, strlen(winner));
-            write_buf_to_client(p2, loser, strlen(loser));
+int next_frame(struct client_sock *curr, int *op, char **payload, int *len) {
+    return next_frame_view(&curr->in, op, payload, len);
+}
 
-            return 1;
-        }
-        
-        if ( (strcmp(move, "a") == 0 || strcmp(move, "p") == 0 || strcmp(move, "h") == 0) && player == p1) {
-            waiter = p1;
-            player = p2;
-        } else if ( (strcmp(move, "a") == 0 || strcmp(move, "p") == 0 || strcmp(move, "h") == 0) && player == p2 ){
-            waiter = p2;
-            player = p1;
-        }
+/* Set a client's user name.
+ * Returns 0 on success.
+ * Returns 1 if user name contains invalid character(s).
+ * Returns 2 if another client online already has it.
+ */
+int set_username(struct client_sock *curr, const char *name) {
+    switch (name_claim(name, &curr->name)) {
+        case NAME_OK:
+            metric_add(M_CONNECTION_BYTES, sizeof(struct name));
+            return 0;
+        case NAME_TAKEN:
+            return 2;
+        default:
+            return 1; //username is empty, too long or contains invalid characters
     }
-
-    return 0; 
-
 }
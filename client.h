@@ -1,12 +1,13 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
-#ifndef MAX_CONNECTIONS
-    #define MAX_CONNECTIONS 12
-#endif
+#include "helpers.h"
+#include "timer.h"
+#include "names.h"
+#include "ratelimit.h"
 
-#ifndef MAX_NAME
-    #define MAX_NAME 20
+#ifndef MAX_CONNECTIONS
+    #define MAX_CONNECTIONS 30000
 #endif
 
 #ifndef MAX_USER_MSG
@@ -17,69 +18,246 @@
     #define BUF_SIZE MAX_USER_MSG+1
 #endif
 
+/*
+ * Client states.
+ */
+#define STATE_NAME 0        // connected, waiting for a user name
+#define STATE_WAITING 1     // in the lobby, queued for an opponent
+#define STATE_PLAYING 2     // in a match
+
+/*
+ * Why a client is moving to another worker.
+ */
+#define MIGRATE_TOURNEY 1   // to register for the tournament hosted there
+#define MIGRATE_WATCH 2     // to watch a match played there
+
+// Number of past opponents remembered to avoid rematches.
+#ifndef RECENT_OPPONENTS
+    #define RECENT_OPPONENTS 4
+#endif
+
+struct match;
+struct player_stats;
+struct entrant;
+
+/*
+ * A connected client. What every read, write and deadline touches comes
+ * first, so serving an idle client stays within its first cache lines;
+ * its place in matches, the lobby and the tournament follows.
+ */
 struct client_sock {
     int sock_fd;
-    int state;
-    char *username;
-    char buf[BUF_SIZE];
-    int inbuf;
-    struct client_sock *next;
+    unsigned char state;
+    unsigned char proto;        // PROTO_TEXT or PROTO_BINARY, once known
+    unsigned char want_write;   // registered for writability while out is backed up
+    unsigned char dirty;        // on its table's dirty list
+    struct line_buf in;     // bytes read but not yet handled
+    struct out_queue out;   // bytes waiting to be sent
+    struct client_table *table;     // table the client belongs to
+    struct match *match;    // match this client is playing in, or NULL
+    struct timer timer;     // login, idle or turn deadline
+    struct client_sock *dirty_prev;
+    struct client_sock *dirty_next;
+    int index;              // position in its table's clients array
+    unsigned char in_lobby;     // on its worker's lobby member list
+    unsigned char migrating;    // MIGRATE_ reason to move to another worker, or 0
+    unsigned char throttled;    // not read from until back within its limits
+    struct rate_limit rate;     // what it may still send
+    struct client_sock *throttle_prev;
+    struct client_sock *throttle_next;
+    struct name *name;      // NULL until logged in
+    unsigned long id;       // unique for the lifetime of the server
+    struct match *watching; // match this client is spectating, or NULL
+    struct client_sock *watch_prev;
+    struct client_sock *watch_next;
+    struct shared_buf *watch_pending;   // latest update held back while backed up
+    struct client_sock *lobby_prev;
+    struct client_sock *lobby_next;
+    struct player_stats *stats;     // slot in the player store, or NULL
+    int rating;
+    int bucket;             // matchmaking queue the client is in, or -1
+    struct client_sock *queue_prev;
+    struct client_sock *queue_next;
+    unsigned long recent[RECENT_OPPONENTS];     // ids of recent opponents
+    int recent_next;        // where the next opponent goes in recent
+    int migrate_to;         // worker it is to move to, while migrating
+    unsigned long watch_id; // match to watch there, or 0 for any
+    struct entrant *entrant;    // place in the tournament, or NULL
+    struct client_sock *next;   // next free struct while pooled
 };
 
+#ifndef CLIENT_SLAB
+    #define CLIENT_SLAB 64
+#endif
+
 /*
- * Add client to list. Return address to new client.
+ * A block of CLIENT_SLAB client_sock structs, allocated at once.
  */
-struct client_sock *addclient(struct client_sock **top, int fd);
+struct client_slab {
+    struct client_slab *next;
+    struct client_sock clients[CLIENT_SLAB];
+};
 
 /*
-* Accept connection of new client
-*/
-int accept_connection(int fd, struct client_sock **clients);
+ * Registry of connected clients. Clients are indexed by fd for lookup
+ * and kept in a dense array for iteration; their structs come from a
+ * pool of slabs, so once it has warmed up, adding and removing clients
+ * is O(1) and allocation-free. So is queueing output and reading long
+ * messages, once the buffer pool of the thread serving the table has
+ * warmed up too.
+ */
+struct client_table {
+    struct client_sock **by_fd;     // client using each fd, or NULL
+    int fd_cap;
+    struct client_sock **clients;   // every connected client, in no order
+    int count;
+    int cap;
+    struct client_sock *free_list;  // pooled structs ready for reuse
+    struct client_slab *slabs;
+    struct client_sock *dirty;      // clients with output to flush
+    struct client_sock *throttled;  // clients not being read from
+    int high_water;     // most bytes a client may leave unread
+    struct buf_pool pool;   // for the thread serving the table to attach
+};
+
+// Default limit on output a client may leave unread before it is dropped.
+#ifndef OUT_HIGH_WATER
+    #define OUT_HIGH_WATER 65536
+#endif
+
+/*
+ * Initialize an empty client table.
+ */
+void init_clients(struct client_table *t);
+
+/*
+ * Remove every client from the table, closing their sockets, and free
+ * all of the table's memory, its buffer pool included.
+ */
+void free_clients(struct client_table *t);
 
 /*
- * Remove client from list. Return 0 on success, 1 on failure.
- * Update curr pointer to the new node at the index of the removed node.
- * Update clients pointer if head node was removed.
+ * Add client with socket fd to the table. Return address to new client.
  */
-int remove_client(struct client_sock **curr, struct client_sock **top);
+struct client_sock *addclient(struct client_table *t, int fd);
+
+/*
+ * Return the id the next client will be given.
+ */
+unsigned long client_next_id();
+
+/*
+ * Give the next client id next_id, carrying on from the ids of a server
+ * this one has taken over from.
+ */
+void client_resume(unsigned long next_id);
+
+/*
+ * Return the client using socket fd, or NULL if there is none.
+ */
+struct client_sock *find_client(struct client_table *t, int fd);
+
+/*
+ * Accept connection of new client on listening socket fd, and add it to
+ * the table in non-blocking mode. *new_client is set to the new
+ * client's struct.
+ *
+ * Return the new client's fd.
+ * Return -1 if there is no pending connection left or accept failed.
+ * Return -2 if the connection was closed because the server is full,
+ * after telling the client so.
+ */
+int accept_connection(int fd, struct client_table *t, struct client_sock **new_client);
+
+/*
+ * Remove client from the table and return its struct to the pool.
+ * The client's socket is not closed. Return 0 on success, 1 on failure.
+ */
+int remove_client(struct client_table *t, struct client_sock *c);
 
 /*
  * Send a string to a client.
  *
- * Input buffer must contain a NULL-terminated string. The NULL
- * terminator is replaced with a network-newline (CRLF) before
- * being sent to the client.
+ * If the input buffer ends in a NULL terminator, it is replaced with a
+ * network-newline (CRLF). The message is queued, and goes out with
+ * everything else queued for the client when the table is flushed.
  *
  * On success, return 0.
  * On error, return 1.
- * On client disconnect, return 2.
  */
 int write_buf_to_client(struct client_sock *c, char *buf, int len);
 
 /*
- * Read incoming bytes from client.
+ * Send client c a binary frame with the given opcode and payload.
+ * Return 0 on success, 1 on error.
+ */
+int write_frame_to_client(struct client_sock *c, int op, const void *payload, int len);
+
+/*
+ * Tell client c one of the NOTICE_ codes, in its protocol. Some
+ * notices name another player, who is then given as other.
+ */
+void send_notice(struct client_sock *c, int notice, struct client_sock *other);
+
+/*
+ * Take the next client with queued output off the table's dirty list.
+ * Return NULL if there is none.
+ */
+struct client_sock *next_dirty(struct client_table *t);
+
+/*
+ * Mark client c as having output to flush.
+ */
+void mark_dirty(struct client_sock *c);
+
+/*
+ * Put client c on its table's list of clients over their rate limits,
+ * or take it off.
+ */
+void throttle(struct client_sock *c);
+void unthrottle(struct client_sock *c);
+
+/*
+ * Write out as much of the client's queued output as the socket takes.
+ * Return values are those of out_flush().
+ */
+int flush_client(struct client_sock *c);
+
+/*
+ * Read incoming bytes from client. The first byte a client ever sends
+ * decides which protocol it speaks.
  *
  * Return -1 if read error or maximum message size is exceeded.
- * Return 0 upon receipt of CRLF-terminated message.
+ * Return 0 if a complete line is buffered, or any bytes were read
+ * from a binary client.
  * Return 1 if client socket has been closed.
- * Return 2 upon receipt of partial (non-CRLF-terminated) message.
+ * Return 2 upon receipt of partial (non-newline-terminated) message.
+ * Return 3 if there is nothing more to read for now.
  */
 int read_from_client(struct client_sock *curr);
 
-/* Set a client's user name.
- * Returns 0 on success.
- * Returns 1 on either get_message() failure or
- * if user name contains invalid character(s).
+/*
+ * Take the next complete line out of the client's buffer, without
+ * copying it; see next_line_view().
+ *
+ * Return 0 on success, 1 if no complete line is buffered.
  */
-int set_username(struct client_sock *curr);
+int next_line(struct client_sock *curr, char **line);
 
-/* Find the current 2 players that should be playing the game
-*/
-void find_players(struct client_sock *top, struct client_sock **p1, struct client_sock **p2);
+/*
+ * Take the next complete frame out of a binary client's buffer, without
+ * copying it; see next_frame_view().
+ *
+ * Return 0 on success, 1 if no complete frame is buffered, -1 if the
+ * client sent a frame too large to ever be buffered.
+ */
+int next_frame(struct client_sock *curr, int *op, char **payload, int *len);
 
-/* Play the game
-* Return 0 if the game does not work and 1 if the game works
-*/
-int play_game(struct client_sock *top, struct client_sock *p1, struct client_sock *p2, fd_set *all_fds);
+/* Set a client's user name to name, claiming it from the names online.
+ * Returns 0 on success.
+ * Returns 1 if user name contains invalid character(s).
+ * Returns 2 if another client online already has it.
+ */
+int set_username(struct client_sock *curr, const char *name);
 
 #endif
@@ -0,0 +1,404 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+#include "client.h"
+#include "game.h"
+#include "matchmaking.h"
+#include "metrics.h"
+#include "proto.h"
+#include "journal.h"
+#include "spectate.h"
+#include "lobby.h"
+#include "stats.h"
+#include "tourney.h"
+
+static uint64_t server_seed = 0;
+static atomic_ulong next_match_id = 1;
+
+static __thread struct match_index *thread_matches = NULL;
+
+void game_seed(uint64_t seed) {
+    server_seed = seed;
+}
+
+unsigned long game_next_id() {
+    return atomic_load(&next_match_id);
+}
+
+void game_resume(unsigned long next_id) {
+    atomic_store(&next_match_id, next_id);
+}
+
+void game_attach(struct match_index *idx, int worker) {
+    idx->worker = worker;
+    thread_matches = idx;
+}
+
+void game_add(struct match *m) {
+    struct match_index *idx = thread_matches;
+    if (idx == NULL) {
+        return;
+    }
+    struct match **bucket = &idx->buckets[m->id & (MATCH_BUCKETS - 1)];
+    m->bucket_next = *bucket;
+    *bucket = m;
+    m->prev = NULL;
+    m->next = idx->all;
+    if (idx->all != NULL) {
+        idx->all->prev = m;
+    }
+    idx->all = m;
+    __atomic_store_n(&idx->count, idx->count + 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < 2; i++) {
+        name_place(m->players[i]->name, idx->worker, m->id);
+    }
+}
+
+/*
+ * Take match m out of the calling thread's index, and note that its
+ * players are no longer in it.
+ */
+static void game_remove(struct match *m) {
+    struct match_index *idx = thread_matches;
+    if (idx == NULL) {
+        return;
+    }
+    struct match **p = &idx->buckets[m->id & (MATCH_BUCKETS - 1)];
+    while (*p != m) {
+        p = &(*p)->bucket_next;
+    }
+    *p = m->bucket_next;
+    if (m->prev != NULL) {
+        m->prev->next = m->next;
+    } else {
+        idx->all = m->next;
+    }
+    if (m->next != NULL) {
+        m->next->prev = m->prev;
+    }
+    __atomic_store_n(&idx->count, idx->count - 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < 2; i++) {
+        name_place(m->players[i]->name, idx->worker, 0);
+    }
+}
+
+struct match *game_find(unsigned long id) {
+    struct match_index *idx = thread_matches;
+    if (idx == NULL) {
+        return NULL;
+    }
+    struct match *m = idx->buckets[id & (MATCH_BUCKETS - 1)];
+    while (m != NULL && m->id != id) {
+        m = m->bucket_next;
+    }
+    return m;
+}
+
+struct match *game_any() {
+    return thread_matches != NULL ? thread_matches->all : NULL;
+}
+
+/*
+ * Send a string to a client. Write errors are ignored here; a client
+ * that has gone away will be seen as closed on its next read.
+ */
+static void send_str(struct client_sock *c, char *msg) {
+    write_buf_to_client(c, msg, strlen(msg));
+}
+
+/*
+ * Count a move of the player on turn that used up their turn, and the
+ * damage it did, and journal it.
+ */
+static void record_move(struct match *m, char move, int amount) {
+    if (move == 'a' || move == 'p') {
+        m->damage[m->turn] += amount;
+    }
+    journal_move(m, move, amount);
+    m->moves++;
+}
+
+/*
+ * Send player i of match m the state of the match at the start of a turn.
+ */
+static void send_state(struct match *m, int i) {
+    struct client_sock *c = m->players[i];
+    struct proto_state state = {
+        i == m->turn, m->fighters[i].hitpoints, m->fighters[i].powermoves, m->fighters[i].heals,
+        m->fighters[1 - i].hitpoints
+    };
+    write_frame_to_client(c, OP_STATE, &state, sizeof(state));
+}
+
+/*
+ * Tell player c what their move did: the damage a hit did, with 0 for
+ * a miss, or the hitpoints a heal gave back.
+ */
+static void send_move(struct client_sock *c, struct client_sock *target, char move, int amount) {
+    if (c->proto == PROTO_BINARY) {
+        unsigned char payload[2] = { move, amount };
+        write_frame_to_client(c, OP_MOVE, payload, sizeof(payload));
+        return;
+    }
+    char msg[BUF_SIZE + MAX_NAME];
+    if (move == 'h') {
+        snprintf(msg, sizeof(msg), "You healed %d HP\n", amount);
+    } else if (amount == 0 && move == 'p') {
+        snprintf(msg, sizeof(msg), "You missed.\n");
+    } else {
+        snprintf(msg, sizeof(msg), "You hit %s for %d points.\n", target->name->text, amount);
+    }
+    send_str(c, msg);
+}
+
+/*
+ * Tell player c the match is over, and whether they won.
+ */
+static void send_result(struct client_sock *c, struct client_sock *opponent, int won, int by) {
+    if (c->proto == PROTO_BINARY) {
+        unsigned char payload[2] = { won, by };
+        write_frame_to_client(c, OP_RESULT, payload, sizeof(payload));
+        return;
+    }
+    char msg[BUF_SIZE + MAX_NAME];
+    if (by == PROTO_BY_DISCONNECT) {
+        snprintf(msg, sizeof(msg), "--%s dropped. You win!\nAwaiting next player...\n", opponent->name->text);
+    } else if (by == PROTO_BY_TIMEOUT && won) {
+        snprintf(msg, sizeof(msg), "\n%s ran out of time. You won!\n", opponent->name->text);
+    } else if (by == PROTO_BY_TIMEOUT) {
+        snprintf(msg, sizeof(msg), "\nYou ran out of time. You lost.\n");
+    } else {
+        snprintf(msg, sizeof(msg), won ? "You won!\n" : "You lost.\n");
+    }
+    send_str(c, msg);
+}
+
+/*
+ * Send the player on turn their menu, and the waiting player the
+ * current state of the match.
+ */
+static void prompt_turn(struct match *m) {
+    int p = m->turn;
+    int w = 1 - p;
+    struct client_sock *player = m->players[p];
+    struct client_sock *waiter = m->players[w];
+
+    // binary clients get the same state whichever side they are on
+    if (waiter->proto == PROTO_BINARY) {
+        send_state(m, w);
+    } else {
+        char waiter_msg[BUF_SIZE + MAX_NAME];
+        snprintf(waiter_msg, sizeof(waiter_msg),
+            "\nYour hitpoints: %d\nYour powermoves: %d\nYour healing moves: %d\n\n%s's hitpoints: %d\n",
+            m->fighters[w].hitpoints, m->fighters[w].powermoves, m->fighters[w].heals,
+            player->name->text, m->fighters[p].hitpoints);
+        send_str(waiter, waiter_msg);
+    }
+
+    if (player->proto == PROTO_BINARY) {
+        send_state(m, p);
+    } else {
+        // only offer the moves the player still has left
+        char menu[BUF_SIZE];
+        snprintf(menu, sizeof(menu), "(a) Regular move\n%s(s) Say something\n%s",
+            m->fighters[p].powermoves > 0 ? "(p) Power move\n" : "",
+            m->fighters[p].heals > 0 ? "(h) Heal yourself\n" : "");
+        send_str(player, menu);
+    }
+
+    spectate_update(m);
+}
+
+/*
+ * Record that player winner has won m by the given PROTO_BY_ reason,
+ * in the journal and the players' stats, tell the spectators and the
+ * lobby, advance the players if it was a tournament bout, return both
+ * players to the lobby and free m.
+ */
+static void end_match(struct match *m, int winner, int by) {
+    journal_result(m, winner, by);
+    stats_record(m, winner, by);
+    spectate_end(m, winner, by);
+    lobby_result(m, winner, by);
+    tourney_result(m, winner);
+    game_remove(m);
+    for (int i = 0; i < 2; i++) {
+        m->players[i]->match = NULL;
+        m->players[i]->state = STATE_WAITING;
+        lobby_enter(m->players[i]);
+    }
+    free(m);
+    metric_add(M_MATCHES_FINISHED, 1);
+    metric_add(M_MATCHES_ACTIVE, -1);
+}
+
+struct match *start_match(struct client_sock *p1, struct client_sock *p2) {
+    struct match *m = malloc(sizeof(struct match));
+    if (m == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+
+    m->id = atomic_fetch_add_explicit(&next_match_id, 1, memory_order_relaxed);
+    m->seed = rng_derive(server_seed, m->id);
+    rng_seed(&m->rng, m->seed);
+    printf("Match %lu: %s vs %s, seed %016llx\n", m->id, p1->name->text, p2->name->text,
+        (unsigned long long) m->seed);
+
+    m->players[0] = p1;
+    m->players[1] = p2;
+    for (int i = 0; i < 2; i++) {
+        rules_roll_fighter(&m->rng, &m->fighters[i]);
+        m->missed[i] = 0;
+        m->damage[i] = 0;
+
+        m->players[i]->match = m;
+        m->players[i]->state = STATE_PLAYING;
+        spectate_stop(m->players[i]);
+        lobby_leave(m->players[i]);
+    }
+    m->spectators = NULL;
+    m->num_spectators = 0;
+    m->moves = 0;
+    m->turn = 0;
+    m->menu = MENU_MOVE;
+    game_add(m);
+    journal_start(m);
+
+    //send welcome messages to players
+    char welcome[BUF_SIZE + MAX_NAME];
+    if (p1->proto == PROTO_BINARY) {
+        write_frame_to_client(p1, OP_START, p2->name->text, p2->name->len);
+    } else {
+        snprintf(welcome, sizeof(welcome), "Welcome! You are playing %s.\nYour hitpoints: %d\nYour powermoves: %d\n",
+            p2->name->text, m->fighters[0].hitpoints, m->fighters[0].powermoves);
+        send_str(p1, welcome);
+    }
+    if (p2->proto == PROTO_BINARY) {
+        write_frame_to_client(p2, OP_START, p1->name->text, p1->name->len);
+    } else {
+        snprintf(welcome, sizeof(welcome), "Welcome! You are playing %s.\n", p1->name->text);
+        send_str(p2, welcome);
+    }
+
+    metric_add(M_MATCHES_STARTED, 1);
+    metric_add(M_MATCHES_ACTIVE, 1);
+    prompt_turn(m);
+    return m;
+}
+
+/*
+ * Apply move to the player on turn.
+ * Return 1 if the move used up the player's turn, 0 otherwise.
+ */
+static int apply_move(struct match *m, char *move) {
+    int p = m->turn;
+    struct client_sock *player = m->players[p];
+    struct client_sock *waiter = m->players[1 - p];
+
+    if (strcmp(move, "s") == 0) {
+        send_notice(player, NOTICE_SAY, NULL);
+        m->menu = MENU_SAY;
+        return 0;
+    }
+
+    int amount;
+    int r = RULES_INVALID;
+    if (move[0] != '\0' && move[1] == '\0') {
+        r = rules_move(&m->rng, &m->fighters[p], &m->fighters[1 - p], move[0], &amount);
+    }
+    if (r == RULES_DONE) {
+        record_move(m, move[0], amount);
+        send_move(player, waiter, move[0], amount);
+        return 1;
+    }
+
+    // a move that is not on the menu just prompts again
+    if (r == RULES_FULL_HEALTH) {
+        send_notice(player, NOTICE_FULL_HEALTH, NULL);
+    } else if (r == RULES_INVALID) {
+        send_notice(player, NOTICE_INVALID_MOVE, NULL);
+    }
+    return 0;
+}
+
+int match_handle_input(struct match *m, struct client_sock *c, char *line) {
+    struct client_sock *player = m->players[m->turn];
+    struct client_sock *waiter = m->players[1 - m->turn];
+    if (c != player) {
+        return 0;
+    }
+
+    if (m->menu == MENU_SAY) {
+        if (waiter->proto == PROTO_BINARY) {
+            write_frame_to_client(waiter, OP_CHAT, line, strlen(line));
+        } else {
+            char msg[MAX_USER_MSG + 2];
+            snprintf(msg, sizeof(msg), "%s\n", line);
+            send_str(waiter, msg);
+        }
+        m->menu = MENU_MOVE;
+        prompt_turn(m);
+        return 0;
+    }
+
+    int took_turn = apply_move(m, line);
+    if (m->menu == MENU_SAY) {
+        return 0;
+    }
+
+    //check who is winning / losing
+    if (m->fighters[1 - m->turn].hitpoints <= 0) {
+        send_result(player, waiter, PROTO_WON, PROTO_BY_HITPOINTS);
+        send_result(waiter, player, PROTO_LOST, PROTO_BY_HITPOINTS);
+        mm_record_result(player, waiter);
+        metric_add(M_TURNS, 1);
+        end_match(m, m->turn, PROTO_BY_HITPOINTS);
+        return 1;
+    }
+
+    if (took_turn) {
+        m->missed[m->turn] = 0;
+        m->turn = 1 - m->turn;
+        metric_add(M_TURNS, 1);
+    }
+    prompt_turn(m);
+    return 0;
+}
+
+struct client_sock *match_forfeit(struct match *m, struct client_sock *leaver) {
+    struct client_sock *winner = m->players[0] == leaver ? m->players[1] : m->players[0];
+
+    send_result(winner, leaver, PROTO_WON, PROTO_BY_DISCONNECT);
+
+    mm_record_result(winner, leaver);
+    end_match(m, m->players[0] == winner ? 0 : 1, PROTO_BY_DISCONNECT);
+    return winner;
+}
+
+int match_turn_timeout(struct match *m, int max_missed) {
+    int p = m->turn;
+    struct client_sock *player = m->players[p];
+    struct client_sock *waiter = m->players[1 - p];
+
+    m->missed[p]++;
+    record_move(m, 't', 0);
+    if (m->missed[p] >= max_missed) {
+        send_result(player, waiter, PROTO_LOST, PROTO_BY_TIMEOUT);
+        send_result(waiter, player, PROTO_WON, PROTO_BY_TIMEOUT);
+        mm_record_result(waiter, player);
+        end_match(m, 1 - p, PROTO_BY_TIMEOUT);
+        return 1;
+    }
+
+    send_notice(player, NOTICE_TURN_TIMEOUT, NULL);
+    send_notice(waiter, NOTICE_OPPONENT_TIMEOUT, player);
+    m->menu = MENU_MOVE;
+    m->turn = 1 - p;
+    metric_add(M_TURNS, 1);
+    prompt_turn(m);
+    return 0;
+}
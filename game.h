@@ -0,0 +1,132 @@
+#ifndef GAME_H
+#define GAME_H
+
+#include <stdint.h>
+
+#include "client.h"
+#include "rng.h"
+#include "rules.h"
+
+/*
+ * What the player whose turn it is is expected to send next.
+ */
+#define MENU_MOVE 0     // one of the move letters
+#define MENU_SAY 1      // a line of text for the opponent
+
+// Buckets of a worker's index of its matches by id; a power of two.
+#ifndef MATCH_BUCKETS
+    #define MATCH_BUCKETS 4096
+#endif
+
+/*
+ * State of one match in progress. Matches never block: each line a
+ * player sends is fed to match_handle_input() by the event loop.
+ */
+struct match {
+    unsigned long id;   // unique for the lifetime of the server
+    uint64_t seed;      // seed of rng, from the server seed and id
+    struct rng rng;     // every random roll of the match comes from here
+    struct client_sock *players[2];
+    struct fighter fighters[2];     // in the order of players
+    int missed[2];  // turns in a row each player has run out of time on
+    int damage[2];  // damage dealt so far by each player
+    int moves;      // moves made so far, by both players
+    int turn;       // index into players of whose move it is
+    int menu;       // MENU_MOVE or MENU_SAY
+    struct client_sock *spectators;     // clients watching, linked by watch_next
+    int num_spectators;
+    struct match *bucket_next;  // next in its bucket of the index
+    struct match *prev;         // in the index's list of every match
+    struct match *next;
+};
+
+/*
+ * The matches in progress on one worker, found by id in O(1). Only the
+ * worker changes it; others only read count.
+ */
+struct match_index {
+    struct match *buckets[MATCH_BUCKETS];   // chained by bucket_next
+    struct match *all;      // linked by prev and next
+    int count;
+    int worker;             // id of the worker whose matches these are
+};
+
+/*
+ * Set the server-wide seed every match's generator is derived from.
+ * Call before the first match starts.
+ */
+void game_seed(uint64_t seed);
+
+/*
+ * Return the id the next match will be given.
+ */
+unsigned long game_next_id();
+
+/*
+ * Give the next match id next_id, carrying on from the ids of a server
+ * this one has taken over from.
+ */
+void game_resume(unsigned long next_id);
+
+/*
+ * Make idx the index of the calling thread's matches, for worker id
+ * worker. Matches started or restored from then on go in it.
+ */
+void game_attach(struct match_index *idx, int worker);
+
+/*
+ * Add match m to the calling thread's index, and note where its players
+ * are. start_match() does so itself; only matches restored from another
+ * server need it.
+ */
+void game_add(struct match *m);
+
+/*
+ * Return the match with the given id on the calling thread's worker,
+ * or NULL if there is none.
+ */
+struct match *game_find(unsigned long id);
+
+/*
+ * Return a match in progress on the calling thread's worker, or NULL
+ * if there is none.
+ */
+struct match *game_any();
+
+/*
+ * Pair p1 and p2 in a new match, send the welcome messages and
+ * prompt p1 for the first move.
+ *
+ * Return the new match, or NULL if it could not be allocated.
+ */
+struct match *start_match(struct client_sock *p1, struct client_sock *p2);
+
+/*
+ * Handle one line of input from client c, a player in match m.
+ * Input from the player who is not on turn is ignored.
+ *
+ * Return 0 if the match continues.
+ * Return 1 if the match is over; both players have been sent the
+ * result, their ratings updated and their state set back to
+ * STATE_WAITING, and m has been freed.
+ */
+int match_handle_input(struct match *m, struct client_sock *c, char *line);
+
+/*
+ * Player leaver has disconnected from match m. Tell the opponent they
+ * won, set their state back to STATE_WAITING and free m.
+ *
+ * Return the opponent.
+ */
+struct client_sock *match_forfeit(struct match *m, struct client_sock *leaver);
+
+/*
+ * The player on turn in match m has run out of time. The turn passes to
+ * the opponent, unless this makes max_missed turns in a row the player
+ * has missed, in which case they lose the match.
+ *
+ * Return values are those of match_handle_input().
+ */
+int match_turn_timeout(struct match *m, int max_missed);
+
+#endif
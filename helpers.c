@@ -2,15 +2,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <arpa/inet.h>     /* inet_ntoa */
 #include <netdb.h>         /* gethostname */
 #include <netinet/in.h>    /* struct sockaddr_in */
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "helpers.h"
+#include "loop.h"
+#include "metrics.h"
 
-void setup_server_socket(struct listen_sock *s) {
+void setup_server_socket(struct listen_sock *s, int shared, int backlog) {
     if(!(s->addr = malloc(sizeof(struct sockaddr_in)))) {
         perror("malloc");
         exit(1);
@@ -40,6 +47,21 @@ void setup_server_socket(struct listen_sock *s) {
         exit(1);
     }
 
+    // Let each worker thread bind its own listening socket to the port.
+    if (shared) {
+#ifdef SO_REUSEPORT
+        status = setsockopt(s->sock_fd, SOL_SOCKET, SO_REUSEPORT,
+            (const char *) &on, sizeof(on));
+        if (status < 0) {
+            perror("setsockopt");
+            exit(1);
+        }
+#else
+        fprintf(stderr, "SO_REUSEPORT is not supported\n");
+        exit(1);
+#endif
+    }
+
     // Bind the selected port to the socket.
     if (bind(s->sock_fd, (struct sockaddr *)s->addr, sizeof(*(s->addr))) < 0) {
         perror("server: bind");
@@ -47,19 +69,93 @@ void setup_server_socket(struct listen_sock *s) {
         exit(1);
     }
 
+    // Accepts are drained until they would block, see accept_connection().
+    if (set_nonblocking(s->sock_fd)) {
+        close(s->sock_fd);
+        exit(1);
+    }
+
     // Announce willingness to accept connections on this socket.
-    if (listen(s->sock_fd, MAX_BACKLOG) < 0) {
+    if (listen(s->sock_fd, backlog) < 0) {
         perror("server: listen");
         close(s->sock_fd);
         exit(1);
     }
 }
 
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        return 1;
+    }
+    return 0;
+}
+
+static const char *find_newline_scalar(const char *p, const char *end) {
+    for (; p < end; p++) {
+        if (*p == '\n') {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static const char *find_newline_sse2(const char *p, const char *end) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) p);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, nl));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    return find_newline_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char *find_newline_avx2(const char *p, const char *end) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    for (; end - p >= 32; p += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) p);
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, nl));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    return find_newline_sse2(p, end);
+}
+#endif
+
+// Widest scanner this CPU supports, picked once at startup.
+static const char *(*find_newline_impl)(const char *, const char *) = find_newline_scalar;
+
+__attribute__((constructor))
+static void pick_find_newline() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        find_newline_impl = find_newline_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        find_newline_impl = find_newline_sse2;
+    }
+#endif
+}
+
+const char *find_newline(const char *buf, int n) {
+    return find_newline_impl(buf, buf + n);
+}
+
 int find_network_newline(const char *buf, int inbuf) {
-    for (int i = 0; i < inbuf - 1; i++) {
-        if (buf[i] == '\r' && buf[i+1] == '\n') {
-            return i + 2;
+    const char *p = buf;
+    const char *end = buf + inbuf;
+    while ((p = find_newline(p, end - p)) != NULL) {
+        if (p > buf && p[-1] == '\r') {
+            return p - buf + 1;
         }
+        p++;
     }
     return -1; 
 }
@@ -70,8 +166,14 @@ int read_from_socket(int sock_fd, char *buf, int *inbuf) {
     second param: use pointer arithmetic for starting point
     third param: only put amount that can fit into the buffer
     */
+    if (*inbuf >= BUF_SIZE - 1) { // no room left for the rest of the message
+        return -1;
+    }
     int next_bytes = read(sock_fd, buf + *inbuf, BUF_SIZE - *inbuf - 1);
     if (next_bytes < 0) { // error reading from socket
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 3; // nothing more to read for now
+        }
         perror("read");
         return -1;
     } else if (next_bytes == 0) { //socket is closed
@@ -83,7 +185,7 @@ int read_from_socket(int sock_fd, char *buf, int *inbuf) {
     buf[*inbuf] = '\0';
 
     // Check if we have a full message (look for "\r\n")
-    if (strchr(buf, '\n') != NULL) {
+    if (find_newline(buf, *inbuf) != NULL) {
         return 0; // Full message ready
     } else {
         return 2; // Partial message; need more data
@@ -91,6 +193,180 @@ int read_from_socket(int sock_fd, char *buf, int *inbuf) {
 }
 
 
+static __thread struct buf_pool *thread_pool = NULL;
+
+static const int pool_sizes[POOL_KINDS] = {
+    [POOL_CHUNK] = sizeof(struct out_chunk) + OUT_CHUNK_SIZE,
+    [POOL_LINK] = sizeof(struct out_chunk),
+    [POOL_LINE] = BUF_SIZE,
+};
+
+void buf_pool_attach(struct buf_pool *p) {
+    thread_pool = p;
+}
+
+void buf_pool_free(struct buf_pool *p) {
+    for (int kind = 0; kind < POOL_KINDS; kind++) {
+        while (p->free[kind] != NULL) {
+            void *buf = p->free[kind];
+            p->free[kind] = *(void **) buf;
+            free(buf);
+        }
+        p->count[kind] = 0;
+    }
+}
+
+/*
+ * Borrow a buffer of the given kind for a connection, from the calling
+ * thread's pool if it has one spare. Return NULL if it could not be
+ * allocated.
+ */
+static void *pool_get(int kind) {
+    struct buf_pool *p = thread_pool;
+    void *buf;
+    if (p != NULL && p->free[kind] != NULL) {
+        buf = p->free[kind];
+        p->free[kind] = *(void **) buf;
+        p->count[kind]--;
+        metric_add(M_POOL_BYTES, -pool_sizes[kind]);
+    } else {
+        buf = malloc(pool_sizes[kind]);
+        if (buf == NULL) {
+            perror("malloc");
+            return NULL;
+        }
+    }
+    metric_add(M_CONNECTION_BYTES, pool_sizes[kind]);
+    return buf;
+}
+
+/*
+ * Give back buf, of the given kind, to the calling thread's pool, or
+ * free it if the pool is full or there is none.
+ */
+static void pool_put(int kind, void *buf) {
+    struct buf_pool *p = thread_pool;
+    metric_add(M_CONNECTION_BYTES, -pool_sizes[kind]);
+    if (p == NULL || p->count[kind] == BUF_POOL_MAX) {
+        free(buf);
+        return;
+    }
+    *(void **) buf = p->free[kind];
+    p->free[kind] = buf;
+    p->count[kind]++;
+    metric_add(M_POOL_BYTES, pool_sizes[kind]);
+}
+
+int line_buf_set(struct line_buf *b, const char *buf, int len) {
+    line_buf_clear(b);
+    if (len > LINE_INLINE) {
+        b->big = pool_get(POOL_LINE);
+        if (b->big == NULL) {
+            return 1;
+        }
+    }
+    memcpy(line_buf_bytes(b), buf, len);
+    b->tail = len;
+    return 0;
+}
+
+void line_buf_clear(struct line_buf *b) {
+    if (b->big != NULL) {
+        pool_put(POOL_LINE, b->big);
+        b->big = NULL;
+    }
+    b->head = 0;
+    b->tail = 0;
+    b->scanned = 0;
+}
+
+int read_to_buf(int sock_fd, struct line_buf *b) {
+    if (b->big != NULL && b->tail == 0) {
+        // everything read into the borrowed buffer has been handled
+        pool_put(POOL_LINE, b->big);
+        b->big = NULL;
+    }
+    int size = b->big != NULL ? BUF_SIZE : LINE_INLINE;
+    if (b->tail == size) {
+        if (b->head == 0 && b->big != NULL) { // no room left for the rest of the message
+            return -1;
+        }
+        // Only part of one message is left; move it back to the front.
+        // A client that fills data is sending more than it holds, so
+        // the rest of its burst is read into a borrowed buffer.
+        char *from = line_buf_bytes(b);
+        if (b->big == NULL) {
+            b->big = pool_get(POOL_LINE);
+            if (b->big == NULL) {
+                return -1;
+            }
+            size = BUF_SIZE;
+        }
+        memmove(line_buf_bytes(b), from + b->head, b->tail - b->head);
+        b->tail -= b->head;
+        b->head = 0;
+    }
+
+    int next_bytes = loop_read(sock_fd, line_buf_bytes(b) + b->tail, size - b->tail);
+    if (next_bytes < 0) { // error reading from socket
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 3; // nothing more to read for now
+        }
+        perror("read");
+        return -1;
+    } else if (next_bytes == 0) { //socket is closed
+        return 1;
+    }
+    b->tail += next_bytes;
+    return 0;
+}
+
+int read_to_line_buf(int sock_fd, struct line_buf *b) {
+    int r = read_to_buf(sock_fd, b);
+    if (r != 0) {
+        return r;
+    }
+
+    // Pick the search up where the last one stopped. On a hit, scanned
+    // is left at the newline so next_line_view() finds it straight away.
+    char *start = line_buf_bytes(b) + b->head;
+    const char *newline = find_newline(start + b->scanned, b->tail - b->head - b->scanned);
+    if (newline == NULL) {
+        b->scanned = b->tail - b->head;
+        return 2; // Partial message; need more data
+    }
+    b->scanned = newline - start;
+    return 0;
+}
+
+int next_line_view(struct line_buf *b, char **line, int *len) {
+    char *start = line_buf_bytes(b) + b->head;
+    const char *newline = find_newline(start + b->scanned, b->tail - b->head - b->scanned);
+    if (newline == NULL) {
+        b->scanned = b->tail - b->head;
+        return 1;
+    }
+
+    int location = newline - start;
+    int n = location;
+    if (n > 0 && start[n - 1] == '\r') {
+        n--;
+    }
+    start[n] = '\0';
+    *line = start;
+    *len = n;
+
+    b->head += location + 1;
+    b->scanned = 0;
+    if (b->head == b->tail) {
+        // Empty; the next read can start at the front again. The bytes
+        // of *line are not touched until then.
+        b->head = 0;
+        b->tail = 0;
+    }
+    return 0;
+}
+
 int get_message(char **dst, char *src, int *inbuf) {
     int location = find_network_newline(src, *inbuf);
     if (location == -1) {
@@ -123,3 +399,167 @@ int write_to_socket(int sock_fd, char *buf, int len) {
     }
     return 0; // Success
 }
+
+/*
+ * Return a new empty chunk with room for cap bytes, or for none if it
+ * is to link to a shared buffer. Return NULL if it could not be
+ * allocated.
+ */
+static struct out_chunk *new_chunk(int cap) {
+    struct out_chunk *c;
+    if (cap == OUT_CHUNK_SIZE || cap == 0) {
+        c = pool_get(cap == 0 ? POOL_LINK : POOL_CHUNK);
+    } else {
+        // too big to pool; a single message that long is rare
+        c = malloc(sizeof(struct out_chunk) + cap);
+        if (c == NULL) {
+            perror("malloc");
+        } else {
+            metric_add(M_CONNECTION_BYTES, sizeof(struct out_chunk) + cap);
+        }
+    }
+    if (c == NULL) {
+        return NULL;
+    }
+    c->next = NULL;
+    c->len = 0;
+    c->off = 0;
+    c->cap = cap;
+    c->shared = NULL;
+    return c;
+}
+
+int out_append(struct out_queue *q, const char *buf, int len) {
+    if (len <= 0) {
+        return 0;
+    }
+    struct out_chunk *tail = q->tail;
+    if (tail == NULL || tail->cap - tail->len < len) {
+        struct out_chunk *c = new_chunk(len > OUT_CHUNK_SIZE ? len : OUT_CHUNK_SIZE);
+        if (c == NULL) {
+            return 1;
+        }
+        if (tail != NULL) {
+            tail->next = c;
+        } else {
+            q->head = c;
+        }
+        q->tail = c;
+        tail = c;
+    }
+    memcpy(tail->data + tail->len, buf, len);
+    tail->len += len;
+    q->pending += len;
+    return 0;
+}
+
+struct shared_buf *shared_new(const char *buf, int len) {
+    struct shared_buf *b = malloc(sizeof(struct shared_buf) + len);
+    if (b == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    b->refs = 1;
+    b->len = len;
+    memcpy(b->data, buf, len);
+    return b;
+}
+
+void shared_retain(struct shared_buf *b) {
+    b->refs++;
+}
+
+void shared_release(struct shared_buf *b) {
+    if (--b->refs == 0) {
+        free(b);
+    }
+}
+
+int out_append_shared(struct out_queue *q, struct shared_buf *b) {
+    // Just a link to the shared bytes; cap 0 keeps anything else from
+    // being appended to it.
+    struct out_chunk *c = new_chunk(0);
+    if (c == NULL) {
+        return 1;
+    }
+    c->len = b->len;
+    c->shared = b;
+    shared_retain(b);
+    if (q->tail != NULL) {
+        q->tail->next = c;
+    } else {
+        q->head = c;
+    }
+    q->tail = c;
+    q->pending += b->len;
+    return 0;
+}
+
+/*
+ * Free a chunk that has been sent or dropped.
+ */
+static void free_chunk(struct out_chunk *c) {
+    if (c->shared != NULL) {
+        shared_release(c->shared);
+        pool_put(POOL_LINK, c);
+    } else if (c->cap == OUT_CHUNK_SIZE) {
+        pool_put(POOL_CHUNK, c);
+    } else {
+        metric_add(M_CONNECTION_BYTES, -(long) (sizeof(struct out_chunk) + c->cap));
+        free(c);
+    }
+}
+
+int out_flush(int sock_fd, struct out_queue *q) {
+    while (q->head != NULL) {
+        struct iovec iov[OUT_MAX_IOV];
+        int n = 0;
+        for (struct out_chunk *c = q->head; c != NULL && n < OUT_MAX_IOV; c = c->next) {
+            iov[n].iov_base = (c->shared != NULL ? c->shared->data : c->data) + c->off;
+            iov[n].iov_len = c->len - c->off;
+            n++;
+        }
+
+        ssize_t written = loop_writev(sock_fd, iov, n);
+        if (written == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 3; // try again once the socket is writable
+            }
+            perror("write to socket"); // Print error message
+            if (errno == EPIPE || errno == ECONNRESET) {
+                // The socket is closed by the peer before all data could be sent
+                return 2; // Indicate disconnect
+            }
+            return 1; // Indicate error
+        }
+
+        // Free every chunk that has now been sent in full
+        q->pending -= written;
+        while (written > 0) {
+            struct out_chunk *c = q->head;
+            int left = c->len - c->off;
+            if (written < left) {
+                c->off += written;
+                break;
+            }
+            written -= left;
+            q->head = c->next;
+            free_chunk(c);
+        }
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+    }
+    return 0;
+}
+
+void out_clear(struct out_queue *q) {
+    while (q->head != NULL) {
+        struct out_chunk *c = q->head;
+        q->head = c->next;
+        free_chunk(c);
+    }
+    q->tail = NULL;
+    q->pending = 0;
+}
+
@@ -6,11 +6,13 @@
 #endif
 
 #ifndef MAX_CONNECTIONS
-    #define MAX_CONNECTIONS 12
+    #define MAX_CONNECTIONS 30000
 #endif
 
+// Default length of the queue of connections waiting to be accepted; the
+// kernel caps it at net.core.somaxconn.
 #ifndef MAX_BACKLOG
-    #define MAX_BACKLOG 5
+    #define MAX_BACKLOG 4096
 #endif
 
 #ifndef MAX_NAME
@@ -25,16 +27,126 @@
     #define BUF_SIZE MAX_USER_MSG+1
 #endif
 
+// Size of the blocks outgoing data is queued in.
+#ifndef OUT_CHUNK_SIZE
+    #define OUT_CHUNK_SIZE 1024
+#endif
+
+// Most iovecs handed to a single writev.
+#ifndef OUT_MAX_IOV
+    #define OUT_MAX_IOV 64
+#endif
+
+// Bytes of input a connection holds in place. A message that outgrows
+// them is read into a BUF_SIZE buffer borrowed from the pool instead.
+#ifndef LINE_INLINE
+    #define LINE_INLINE 32
+#endif
+
+// Most free buffers of each kind a pool keeps; more are freed.
+#ifndef BUF_POOL_MAX
+    #define BUF_POOL_MAX 1024
+#endif
+
 struct listen_sock {
     struct sockaddr_in *addr;
     int sock_fd;
 };
 
+/*
+ * Input buffer of a connection. Bytes are appended at tail and complete
+ * lines are handed out in place from head, so taking a line out of the
+ * buffer copies nothing. The unconsumed bytes only move back to the
+ * front when tail reaches the end of the buffer, by which point all
+ * that is left is part of one line.
+ *
+ * Most of what clients send is short, and fits in data. Only while a
+ * longer message is coming in is a BUF_SIZE buffer borrowed from the
+ * pool; it goes back once everything in it has been handled.
+ */
+struct line_buf {
+    char *big;      // borrowed buffer in use instead of data, or NULL
+    int head;       // first unconsumed byte
+    int tail;       // one past the last byte read
+    int scanned;    // bytes from head already searched for a newline
+    char data[LINE_INLINE];
+};
+
+/*
+ * Return the bytes of line buffer b, wherever they are held.
+ */
+static inline char *line_buf_bytes(struct line_buf *b) {
+    return b->big != NULL ? b->big : b->data;
+}
+
+/*
+ * Free buffers for connections to borrow while data is in flight:
+ * output chunks of OUT_CHUNK_SIZE, links to shared buffers and big
+ * input buffers. A pool belongs to the thread it is attached to.
+ */
+#define POOL_CHUNK 0
+#define POOL_LINK 1
+#define POOL_LINE 2
+#define POOL_KINDS 3
+
+struct buf_pool {
+    void *free[POOL_KINDS];     // each free buffer starts with the next one
+    int count[POOL_KINDS];
+};
+
+/*
+ * Reference-counted message, queued to many connections without being
+ * copied for each. Only ever used by one thread.
+ */
+struct shared_buf {
+    int refs;
+    int len;
+    char data[];
+};
+
+/*
+ * Block of queued outgoing data. Bytes off to len are still to be sent.
+ * The bytes are either the chunk's own, or those of a shared buffer.
+ */
+struct out_chunk {
+    struct out_chunk *next;
+    int len;
+    int off;
+    int cap;
+    struct shared_buf *shared;  // NULL if the data is the chunk's own
+    char data[];
+};
+
+/*
+ * Output queue of a connection. Messages are appended to the last chunk
+ * while they fit, so a burst of small messages goes out in one write.
+ */
+struct out_queue {
+    struct out_chunk *head;
+    struct out_chunk *tail;
+    int pending;    // bytes queued and not yet written
+};
+
 /*
  * Initialize a server address associated with the required port.
- * Create and setup a socket for a server to listen on.
+ * Create and setup a non-blocking socket for a server to listen on.
+ * If shared is set, the port may be bound by several such sockets at
+ * once (SO_REUSEPORT) and the kernel spreads new connections across them.
+ * Up to backlog connections wait to be accepted.
  */
-void setup_server_socket(struct listen_sock *s);
+void setup_server_socket(struct listen_sock *s, int shared, int backlog);
+
+/*
+ * Put fd into non-blocking mode.
+ * Return 0 on success, 1 on error.
+ */
+int set_nonblocking(int fd);
+
+/*
+ * Return a pointer to the first '\n' in the n bytes at buf, or NULL if
+ * there is none. Uses AVX2 or SSE2 where the CPU has them.
+ */
+const char *find_newline(const char *buf, int n);
 
 /*
  * Search the first n characters of buf for a network newline (\r\n).
@@ -44,6 +156,62 @@ void setup_server_socket(struct listen_sock *s);
  */
 int find_network_newline(const char *buf, int n);
 
+/*
+ * Make p the pool the calling thread borrows buffers from and gives
+ * them back to, or stop pooling if p is NULL; buffers are then just
+ * allocated and freed.
+ */
+void buf_pool_attach(struct buf_pool *p);
+
+/*
+ * Free every buffer in pool p, which no thread may be attached to.
+ */
+void buf_pool_free(struct buf_pool *p);
+
+/*
+ * Replace the contents of line buffer b with the len bytes at buf, no
+ * more than BUF_SIZE.
+ *
+ * Return 0 on success, 1 if memory could not be allocated.
+ */
+int line_buf_set(struct line_buf *b, const char *buf, int len);
+
+/*
+ * Empty line buffer b, giving back the buffer it borrowed, if any.
+ */
+void line_buf_clear(struct line_buf *b);
+
+/*
+ * Reads from socket sock_fd into buffer b, without looking for lines.
+ *
+ * Return -1 if read error or the buffer is full.
+ * Return 0 if some bytes were read.
+ * Return 1 if socket has been closed.
+ * Return 3 if sock_fd is non-blocking and has no data to read.
+ */
+int read_to_buf(int sock_fd, struct line_buf *b);
+
+/*
+ * Reads from socket sock_fd into line buffer b.
+ *
+ * Return -1 if read error or maximum message size is exceeded.
+ * Return 0 if a complete line is buffered.
+ * Return 1 if socket has been closed.
+ * Return 2 upon receipt of partial (non-newline-terminated) message.
+ * Return 3 if sock_fd is non-blocking and has no data to read.
+ */
+int read_to_line_buf(int sock_fd, struct line_buf *b);
+
+/*
+ * Take the next complete line out of b. Lines may end in either a
+ * network newline or a bare '\n'. The terminator is replaced with a
+ * NULL in place and *line is pointed at the line, which stays valid
+ * until the next read into b. *len is set to its length.
+ *
+ * Return 0 on success, 1 if no complete line is buffered.
+ */
+int next_line_view(struct line_buf *b, char **line, int *len);
+
 /*
  * Reads from socket sock_fd into buffer *buf containing *inbuf bytes
  * of data. Updates *inbuf after reading from socket.
@@ -52,6 +220,7 @@ int find_network_newline(const char *buf, int n);
  * Return 0 upon receipt of CRLF-terminated message.
  * Return 1 if socket has been closed.
  * Return 2 upon receipt of partial (non-CRLF-terminated) message.
+ * Return 3 if sock_fd is non-blocking and has no data to read.
  */
 int read_from_socket(int sock_fd, char *buf, int *inbuf);
 
@@ -77,7 +246,50 @@ int get_message(char **dst, char *src, int *inbuf);
 int write_to_socket(int sock_fd, char *buf, int len);
 
 /*
-* Play the actual game.
-*/
+ * Append len bytes of buf to output queue q.
+ *
+ * Return 0 on success, 1 if memory could not be allocated.
+ */
+int out_append(struct out_queue *q, const char *buf, int len);
+
+/*
+ * Return a new shared buffer holding a copy of the len bytes at buf,
+ * with one reference, or NULL if it could not be allocated.
+ */
+struct shared_buf *shared_new(const char *buf, int len);
+
+/*
+ * Take another reference to shared buffer b.
+ */
+void shared_retain(struct shared_buf *b);
+
+/*
+ * Drop a reference to shared buffer b, freeing it with the last one.
+ */
+void shared_release(struct shared_buf *b);
+
+/*
+ * Append shared buffer b to output queue q, without copying it; q
+ * holds a reference until it has been sent.
+ *
+ * Return 0 on success, 1 if memory could not be allocated.
+ */
+int out_append_shared(struct out_queue *q, struct shared_buf *b);
+
+/*
+ * Write as much of output queue q to socket sock_fd as it will take,
+ * gathering up to OUT_MAX_IOV chunks into each writev.
+ *
+ * Return 0 when q has been emptied.
+ * Return 1 on error.
+ * Return 2 on disconnect.
+ * Return 3 if sock_fd is non-blocking and full, with data still queued.
+ */
+int out_flush(int sock_fd, struct out_queue *q);
+
+/*
+ * Drop everything in output queue q and free its memory.
+ */
+void out_clear(struct out_queue *q);
 
 #endif
@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "journal.h"
+#include "game.h"
+#include "metrics.h"
+
+/*
+ * Records of one worker waiting to be written. The worker appends to
+ * data; the journal thread swaps in spare and writes out what it took.
+ */
+struct journal_buf {
+    pthread_mutex_t lock;
+    char *data;
+    int len;
+    char *spare;
+};
+
+static struct journal_buf *bufs = NULL;
+static int num_bufs = 0;
+static __thread struct journal_buf *thread_buf = NULL;
+
+static char journal_dir[4096];
+static uint64_t journal_seed;
+static int segment_fd = -1;
+static long segment_size = 0;
+static unsigned long segment_seq = 0;
+
+static pthread_t journal_thread;
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static int stopping = 0;
+
+static uint64_t wall_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Write all len bytes of buf to the current segment.
+ * Return 0 on success, 1 on error.
+ */
+static int write_all(const char *buf, int len) {
+    while (len > 0) {
+        ssize_t n = write(segment_fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("journal: write");
+            return 1;
+        }
+        buf += n;
+        len -= n;
+        segment_size += n;
+    }
+    return 0;
+}
+
+/*
+ * Close the current segment, if any, and start the next one.
+ * Return 0 on success, 1 on error.
+ */
+static int open_segment() {
+    if (segment_fd >= 0) {
+        fsync(segment_fd);
+        close(segment_fd);
+    }
+    char path[sizeof(journal_dir) + 32];
+    snprintf(path, sizeof(path), "%s/%08lu.jrnl", journal_dir, segment_seq++);
+    segment_fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+    if (segment_fd < 0) {
+        perror("journal: open");
+        return 1;
+    }
+    segment_size = 0;
+    struct journal_segment seg = { JOURNAL_MAGIC, JOURNAL_VERSION, journal_seed, wall_ms() };
+    return write_all((char *) &seg, sizeof(seg));
+}
+
+/*
+ * Take every worker's records, write them to the segment and make them
+ * durable with a single fdatasync, however many records there are.
+ */
+static void commit() {
+    int wrote = 0;
+    for (int i = 0; i < num_bufs; i++) {
+        struct journal_buf *b = &bufs[i];
+        pthread_mutex_lock(&b->lock);
+        char *full = b->data;
+        int len = b->len;
+        b->data = b->spare;
+        b->len = 0;
+        pthread_mutex_unlock(&b->lock);
+        b->spare = full;
+
+        if (len > 0 && segment_fd >= 0) {
+            write_all(full, len);
+            wrote = 1;
+        }
+    }
+    if (wrote) {
+        fdatasync(segment_fd);
+        if (segment_size >= JOURNAL_SEGMENT_SIZE) {
+            open_segment();
+        }
+    }
+}
+
+static void *run_journal(void *arg) {
+    pthread_mutex_lock(&wake_lock);
+    while (!stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += JOURNAL_COMMIT_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&wake, &wake_lock, &deadline);
+
+        pthread_mutex_unlock(&wake_lock);
+        commit();
+        pthread_mutex_lock(&wake_lock);
+    }
+    pthread_mutex_unlock(&wake_lock);
+    commit();
+    return NULL;
+}
+
+/*
+ * Find the number after the highest segment already in dir, so a
+ * restarted server appends new segments instead of overwriting.
+ */
+static unsigned long next_segment_seq(const char *dir) {
+    unsigned long next = 0;
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return 0;
+    }
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        unsigned long seq;
+        char ext[8];
+        if (sscanf(e->d_name, "%lu.%7s", &seq, ext) == 2 && strcmp(ext, "jrnl") == 0 && seq >= next) {
+            next = seq + 1;
+        }
+    }
+    closedir(d);
+    return next;
+}
+
+int journal_open(const char *dir, int num_workers, uint64_t server_seed) {
+    if (strlen(dir) >= sizeof(journal_dir)) {
+        fprintf(stderr, "journal directory path too long: %s\n", dir);
+        return 1;
+    }
+    strcpy(journal_dir, dir);
+    journal_seed = server_seed;
+    segment_seq = next_segment_seq(dir);
+    if (open_segment()) {
+        return 1;
+    }
+
+    bufs = calloc(num_workers, sizeof(struct journal_buf));
+    if (bufs == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    num_bufs = num_workers;
+    for (int i = 0; i < num_workers; i++) {
+        pthread_mutex_init(&bufs[i].lock, NULL);
+        bufs[i].data = malloc(JOURNAL_BUF_SIZE);
+        bufs[i].spare = malloc(JOURNAL_BUF_SIZE);
+        if (bufs[i].data == NULL || bufs[i].spare == NULL) {
+            perror("malloc");
+            return 1;
+        }
+    }
+
+    int err = pthread_create(&journal_thread, NULL, run_journal, NULL);
+    if (err != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        return 1;
+    }
+    return 0;
+}
+
+void journal_attach(int worker) {
+    if (bufs != NULL) {
+        thread_buf = &bufs[worker];
+    }
+}
+
+/*
+ * Append a record to the calling worker's buffer. If the journal thread
+ * has fallen so far behind that the buffer is full, the record is
+ * dropped rather than holding up the match.
+ */
+static void append(void *rec, int size) {
+    struct journal_buf *b = thread_buf;
+    pthread_mutex_lock(&b->lock);
+    if (b->len + size > JOURNAL_BUF_SIZE) {
+        pthread_mutex_unlock(&b->lock);
+        metric_add(M_JOURNAL_DROPPED, 1);
+        pthread_cond_signal(&wake);
+        return;
+    }
+    memcpy(b->data + b->len, rec, size);
+    b->len += size;
+    int half_full = b->len >= JOURNAL_BUF_SIZE / 2;
+    pthread_mutex_unlock(&b->lock);
+
+    metric_add(M_JOURNAL_BYTES, size);
+    if (half_full) {
+        pthread_cond_signal(&wake);
+    }
+}
+
+static void fill_header(struct jr_header *h, int size, int type, int player, struct match *m) {
+    h->size = size;
+    h->type = type;
+    h->player = player;
+    h->turn = m->moves;
+    h->match_id = m->id;
+}
+
+void journal_start(struct match *m) {
+    if (thread_buf == NULL) {
+        return;
+    }
+    struct jr_start rec;
+    memset(&rec, 0, sizeof(rec));
+    fill_header(&rec.h, sizeof(rec), JR_START, 0, m);
+    rec.seed = m->seed;
+    rec.time_ms = wall_ms();
+    for (int i = 0; i < 2; i++) {
+        rec.hitpoints[i] = m->fighters[i].hitpoints;
+        rec.powermoves[i] = m->fighters[i].powermoves;
+        rec.heals[i] = m->fighters[i].heals;
+        struct name *name = m->players[i]->name;
+        rec.name_len[i] = name->len < JR_NAME ? name->len : JR_NAME;
+        memcpy(rec.names[i], name->text, rec.name_len[i]);
+    }
+    append(&rec, sizeof(rec));
+}
+
+void journal_move(struct match *m, char move, int amount) {
+    if (thread_buf == NULL) {
+        return;
+    }
+    struct jr_move rec;
+    memset(&rec, 0, sizeof(rec));
+    fill_header(&rec.h, sizeof(rec), JR_MOVE, m->turn, m);
+    rec.move = move;
+    rec.amount = amount;
+    rec.hitpoints[0] = m->fighters[0].hitpoints;
+    rec.hitpoints[1] = m->fighters[1].hitpoints;
+    append(&rec, sizeof(rec));
+}
+
+void journal_result(struct match *m, int winner, int by) {
+    if (thread_buf == NULL) {
+        return;
+    }
+    struct jr_result rec;
+    memset(&rec, 0, sizeof(rec));
+    fill_header(&rec.h, sizeof(rec), JR_RESULT, winner, m);
+    rec.winner = winner;
+    rec.by = by;
+    append(&rec, sizeof(rec));
+}
+
+void journal_close() {
+    if (bufs == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&wake_lock);
+    stopping = 1;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&wake_lock);
+    pthread_join(journal_thread, NULL);
+
+    fsync(segment_fd);
+    close(segment_fd);
+    segment_fd = -1;
+    for (int i = 0; i < num_bufs; i++) {
+        pthread_mutex_destroy(&bufs[i].lock);
+        free(bufs[i].data);
+        free(bufs[i].spare);
+    }
+    free(bufs);
+    bufs = NULL;
+    thread_buf = NULL;
+    num_bufs = 0;
+}
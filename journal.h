@@ -0,0 +1,126 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+/*
+ * Match journal: an append-only log of every match played, kept as a
+ * series of segment files in one directory. A segment is a
+ * journal_segment header followed by records, in the byte order of the
+ * machine that wrote it. Records of different matches interleave; each
+ * carries its match id.
+ */
+#define JOURNAL_MAGIC 0x4c4e524a    // "JRNL"
+#define JOURNAL_VERSION 1
+
+// A new segment is started once the current one reaches this size.
+#ifndef JOURNAL_SEGMENT_SIZE
+    #define JOURNAL_SEGMENT_SIZE (64 * 1024 * 1024)
+#endif
+
+// Records each worker may have waiting to be written out.
+#ifndef JOURNAL_BUF_SIZE
+    #define JOURNAL_BUF_SIZE (1024 * 1024)
+#endif
+
+// Longest the journal thread waits before committing what it has.
+#ifndef JOURNAL_COMMIT_MS
+    #define JOURNAL_COMMIT_MS 50
+#endif
+
+struct journal_segment {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t server_seed;
+    uint64_t created_ms;    // wall clock, in milliseconds since the epoch
+};
+
+/*
+ * Record types.
+ */
+#define JR_START 1      // struct jr_start
+#define JR_MOVE 2       // struct jr_move
+#define JR_RESULT 3     // struct jr_result
+
+/*
+ * Start of every record. Records are padded to a multiple of 8 bytes,
+ * so a mapped segment can be read in place.
+ */
+struct jr_header {
+    uint16_t size;      // of the whole record
+    uint8_t type;
+    uint8_t player;     // player the record is about, 0 or 1
+    uint32_t turn;      // moves made in the match before this record
+    uint64_t match_id;
+};
+
+#define JR_NAME 20
+
+struct jr_start {
+    struct jr_header h;
+    uint64_t seed;
+    uint64_t time_ms;   // wall clock, in milliseconds since the epoch
+    uint8_t hitpoints[2];
+    uint8_t powermoves[2];
+    uint8_t heals[2];
+    uint8_t name_len[2];
+    char names[2][JR_NAME];
+};
+
+/*
+ * A move that used up a player's turn. amount is the damage done or
+ * the hitpoints healed, 0 for a missed power move. A turn lost to the
+ * clock is move 't'.
+ */
+struct jr_move {
+    struct jr_header h;
+    char move;
+    int8_t amount;
+    int8_t hitpoints[2];    // of both players after the move
+    uint8_t pad[4];
+};
+
+struct jr_result {
+    struct jr_header h;
+    uint8_t winner;     // 0 or 1
+    uint8_t by;         // a PROTO_BY_ reason
+    uint8_t pad[6];
+};
+
+struct match;
+
+/*
+ * Start journaling to segment files in directory dir, for num_workers
+ * workers, and the thread that commits their records.
+ * Return 0 on success, 1 on error.
+ */
+int journal_open(const char *dir, int num_workers, uint64_t server_seed);
+
+/*
+ * Make worker's buffer the one the calling thread's records go to.
+ * Without it, or without journal_open(), records are not kept.
+ */
+void journal_attach(int worker);
+
+/*
+ * Record the start of match m.
+ */
+void journal_start(struct match *m);
+
+/*
+ * Record a move of the player on turn in match m, after it is applied.
+ */
+void journal_move(struct match *m, char move, int amount);
+
+/*
+ * Record that player winner has won match m.
+ */
+void journal_result(struct match *m, int winner, int by);
+
+/*
+ * Commit everything recorded, stop the journal thread and close the
+ * segment.
+ */
+void journal_close();
+
+#endif
@@ -0,0 +1,637 @@
+/*
+ * Load generator for the battle server.
+ *
+ * Opens many simulated players over loopback (or to any host). Each one
+ * sends a user name, waits to be matched and plays random moves from
+ * the menu it is offered until the run is over. At the end it reports
+ * connection and match rates, time to match and per-turn round trip
+ * latency percentiles. With -b the players speak the binary protocol.
+ * With -j they register for the server's tournament as they log in, and
+ * the time from its start to its champion is reported.
+ *
+ * Players move as soon as it is their turn, far faster than people do,
+ * so run the server with -r 0 -R 0 to lift its per-client rate limits.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "proto.h"
+
+#ifndef SERVER_PORT
+    #define SERVER_PORT 30000
+#endif
+
+#define BOT_BUF 4096
+#define MAX_EVENTS 256
+
+/*
+ * Bot states.
+ */
+#define BOT_CONNECTING 0    // TCP handshake in progress
+#define BOT_NAMING 1        // waiting for the name prompt
+#define BOT_WAITING 2       // logged in, waiting for a match
+#define BOT_PLAYING 3       // in a match
+#define BOT_DONE 4          // closed
+
+struct bot {
+    int fd;
+    int id;
+    int state;
+    char buf[BOT_BUF];      // partial line carried over between reads
+    int inbuf;
+    long long connect_start;
+    long long wait_start;   // when the bot started waiting for a match
+    long long match_start;
+    long long move_sent;    // when the last move was sent, 0 if none pending
+    int menu_seen;          // a move menu arrived in the current read
+    int can_power;
+    int can_heal;
+    int saying;             // sent 's', expecting "Type message: "
+};
+
+/*
+ * Growable array of latency samples, in nanoseconds.
+ */
+struct samples {
+    long long *v;
+    long n;
+    long cap;
+};
+
+/*
+ * Per-thread results, merged when the run is over.
+ */
+struct stats {
+    long connects;          // TCP connections established
+    long connect_errors;
+    long accepts;           // name prompts received
+    long logins;
+    long matches_started;
+    long matches_finished;
+    long turns;
+    long disconnects;
+    long bouts;             // tournament matches, counted by each player
+    long long tourney_start;    // when the first player heard it began
+    long long tourney_end;      // when the last player heard who won
+    long long last_accept;  // when the last name prompt arrived
+    struct samples accept_lat;
+    struct samples match_wait;
+    struct samples turn_rtt;
+    struct samples match_len;
+};
+
+struct gen_thread {
+    pthread_t thread;
+    int id;
+    int num_bots;
+    int first_bot;
+    struct bot *bots;
+    struct stats st;
+    unsigned int seed;
+};
+
+struct sockaddr_in server_addr;
+int binary = 0;             // speak the binary protocol
+int join_tourney = 0;       // register for the tournament after logging in
+int connect_rate = 0;       // new connections per second per thread, 0 for no limit
+long long run_until;
+volatile sig_atomic_t stop = 0;
+
+void sigint_handler(int code) {
+    stop = 1;
+}
+
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void add_sample(struct samples *s, long long v) {
+    if (s->n == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 1024;
+        s->v = realloc(s->v, s->cap * sizeof(long long));
+        if (s->v == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    s->v[s->n++] = v;
+}
+
+int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *) a;
+    long long y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Return the q-th quantile (0 to 1) of sorted samples s, in microseconds.
+ */
+double quantile_us(struct samples *s, double q) {
+    if (s->n == 0) {
+        return 0;
+    }
+    long i = (long) (q * (s->n - 1) + 0.5);
+    return s->v[i] / 1000.0;
+}
+
+void print_latency(char *name, struct samples *s) {
+    qsort(s->v, s->n, sizeof(long long), cmp_ll);
+    printf("%-16s n=%-8ld p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n", name, s->n,
+        quantile_us(s, 0.5), quantile_us(s, 0.99), quantile_us(s, 0.999),
+        s->n ? s->v[s->n - 1] / 1000.0 : 0);
+}
+
+void send_bytes(struct gen_thread *t, struct bot *b, const void *buf, int len) {
+    // Messages are tiny, so a short write means the server has stopped
+    // reading; treat that like a disconnect.
+    if (write(b->fd, buf, len) != len) {
+        close(b->fd);
+        b->state = BOT_DONE;
+        t->st.disconnects++;
+    }
+}
+
+void send_line(struct gen_thread *t, struct bot *b, char *line) {
+    send_bytes(t, b, line, strlen(line));
+}
+
+void send_frame(struct gen_thread *t, struct bot *b, int op, const char *payload, int len) {
+    char frame[PROTO_HEADER + PROTO_MAX_PAYLOAD];
+    send_bytes(t, b, frame, encode_frame(frame, op, payload, len));
+}
+
+void start_connect(struct gen_thread *t, int epfd, struct bot *b) {
+    b->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (b->fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    int on = 1;
+    setsockopt(b->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    b->state = BOT_CONNECTING;
+    b->inbuf = 0;
+    b->move_sent = 0;
+    b->saying = 0;
+    b->connect_start = now_ns();
+    if (connect(b->fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS) {
+        t->st.connect_errors++;
+        close(b->fd);
+        b->state = BOT_DONE;
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = b;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, b->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+/*
+ * Pick a random move from the menu last offered and send it.
+ */
+void play_move(struct gen_thread *t, struct bot *b) {
+    char moves[4];
+    int n = 0;
+    moves[n++] = 'a';
+    moves[n++] = 's';
+    if (b->can_power) {
+        moves[n++] = 'p';
+    }
+    if (b->can_heal) {
+        moves[n++] = 'h';
+    }
+    char move = moves[rand_r(&t->seed) % n];
+    // keep chat rare so matches actually end
+    if (move == 's' && rand_r(&t->seed) % 4 != 0) {
+        move = 'a';
+    }
+    b->move_sent = now_ns();
+    t->st.turns++;
+    if (binary) {
+        if (move == 's') {
+            send_frame(t, b, OP_CHAT, "gg", 2);
+        } else {
+            send_frame(t, b, OP_MOVE, &move, 1);
+        }
+        return;
+    }
+    char line[4] = { move, '\r', '\n', '\0' };
+    b->saying = (move == 's');
+    send_line(t, b, line);
+}
+
+void match_started(struct gen_thread *t, struct bot *b, long long now) {
+    t->st.matches_started++;
+    add_sample(&t->st.match_wait, now - b->wait_start);
+    b->state = BOT_PLAYING;
+    b->match_start = now;
+}
+
+void match_finished(struct gen_thread *t, struct bot *b, long long now) {
+    t->st.matches_finished++;
+    add_sample(&t->st.match_len, now - b->match_start);
+    b->state = BOT_WAITING;
+    b->wait_start = now;
+}
+
+void logged_in(struct gen_thread *t, struct bot *b, long long now) {
+    t->st.logins++;
+    b->state = BOT_WAITING;
+    b->wait_start = now;
+}
+
+void tourney_started(struct gen_thread *t, long long now) {
+    if (t->st.tourney_start == 0 || now < t->st.tourney_start) {
+        t->st.tourney_start = now;
+    }
+}
+
+void tourney_won(struct gen_thread *t, long long now) {
+    if (now > t->st.tourney_end) {
+        t->st.tourney_end = now;
+    }
+}
+
+/*
+ * React to one complete line from the server.
+ */
+void handle_line(struct gen_thread *t, struct bot *b, char *line, long long now) {
+    if (strncmp(line, "Welcome! You are playing", 24) == 0) {
+        match_started(t, b, now);
+    } else if (strncmp(line, "You won!", 8) == 0 || strncmp(line, "You lost.", 9) == 0
+            || (line[0] == '-' && line[1] == '-' && strstr(line, "dropped") != NULL)) {
+        match_finished(t, b, now);
+    } else if (strncmp(line, "Welcome ", 8) == 0) {
+        logged_in(t, b, now);
+    } else if (strncmp(line, "[tournament] The tournament has begun", 37) == 0) {
+        tourney_started(t, now);
+    } else if (strncmp(line, "[tournament] ", 13) == 0 && strstr(line, ": you play ") != NULL) {
+        t->st.bouts++;
+    } else if (strncmp(line, "[tournament] ", 13) == 0 && strstr(line, " wins the tournament!") != NULL) {
+        tourney_won(t, now);
+    } else if (strcmp(line, "(a) Regular move") == 0) {
+        b->menu_seen = 1;
+        b->can_power = 0;
+        b->can_heal = 0;
+    } else if (strcmp(line, "(p) Power move") == 0) {
+        b->can_power = 1;
+    } else if (strcmp(line, "(h) Heal yourself") == 0) {
+        b->can_heal = 1;
+    }
+}
+
+/*
+ * React to one frame from the server.
+ */
+void handle_frame(struct gen_thread *t, struct bot *b, int op, unsigned char *payload, int len, long long now) {
+    if (op == OP_LOGIN) {
+        logged_in(t, b, now);
+    } else if (op == OP_START) {
+        match_started(t, b, now);
+    } else if (op == OP_RESULT) {
+        match_finished(t, b, now);
+    } else if (op == OP_TOURNEY && len >= (int) sizeof(struct proto_tourney)) {
+        if (payload[0] == TOURNEY_STARTED) {
+            tourney_started(t, now);
+        } else if (payload[0] == TOURNEY_BOUT) {
+            t->st.bouts++;
+        } else if (payload[0] == TOURNEY_CHAMPION) {
+            tourney_won(t, now);
+        }
+    } else if (op == OP_STATE && len == sizeof(struct proto_state)) {
+        struct proto_state *state = (struct proto_state *) payload;
+        if (state->your_turn && b->state == BOT_PLAYING) {
+            b->can_power = state->powermoves > 0;
+            b->can_heal = state->heals > 0;
+            b->menu_seen = 1;
+        }
+    }
+}
+
+/*
+ * Handle every complete frame in the bot's buffer.
+ */
+void handle_frames(struct gen_thread *t, struct bot *b, long long now) {
+    unsigned char *start = (unsigned char *) b->buf;
+    unsigned char *end = start + b->inbuf;
+    while (end - start >= PROTO_HEADER && end - start >= PROTO_HEADER + start[0]) {
+        handle_frame(t, b, start[1], start + PROTO_HEADER, start[0], now);
+        start += PROTO_HEADER + start[0];
+    }
+    b->inbuf = end - start;
+    memmove(b->buf, start, b->inbuf);
+}
+
+void handle_readable(struct gen_thread *t, struct bot *b) {
+    while (b->state != BOT_DONE) {
+        int n = read(b->fd, b->buf + b->inbuf, BOT_BUF - b->inbuf - 1);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n <= 0) {
+            close(b->fd);
+            b->state = BOT_DONE;
+            t->st.disconnects++;
+            return;
+        }
+        long long now = now_ns();
+        if (b->move_sent) {
+            add_sample(&t->st.turn_rtt, now - b->move_sent);
+            b->move_sent = 0;
+        }
+        b->inbuf += n;
+        b->buf[b->inbuf] = '\0';
+
+        if (b->state == BOT_NAMING) {
+            if (b->inbuf < PROTO_BANNER_LEN) {
+                continue;
+            }
+            t->st.accepts++;
+            t->st.last_accept = now;
+            add_sample(&t->st.accept_lat, now - b->connect_start);
+            char name[32];
+            b->state = BOT_WAITING;
+            b->wait_start = now;
+            if (binary) {
+                char hello[1 + PROTO_HEADER + sizeof(name) + PROTO_HEADER + 1];
+                int len = snprintf(name, sizeof(name), "bot%d", b->id);
+                hello[0] = PROTO_MAGIC;
+                len = 1 + encode_frame(hello + 1, OP_LOGIN, name, len);
+                // registering along with the name, so the bot is not
+                // paired for an ordinary match first
+                if (join_tourney) {
+                    char join = TOURNEY_JOIN;
+                    len += encode_frame(hello + len, OP_TOURNEY, &join, 1);
+                }
+                send_bytes(t, b, hello, len);
+                // the prompt is the last text the server sends
+                b->inbuf -= PROTO_BANNER_LEN;
+                memmove(b->buf, b->buf + PROTO_BANNER_LEN, b->inbuf);
+            } else {
+                snprintf(name, sizeof(name), join_tourney ? "bot%d\r\n/join\r\n" : "bot%d\r\n", b->id);
+                b->inbuf = 0;
+                send_line(t, b, name);
+                continue;
+            }
+        }
+
+        if (binary) {
+            b->menu_seen = 0;
+            handle_frames(t, b, now);
+            if (b->menu_seen && b->state == BOT_PLAYING) {
+                play_move(t, b);
+            }
+            continue;
+        }
+
+        b->menu_seen = 0;
+        char *start = b->buf;
+        char *nl;
+        while ((nl = memchr(start, '\n', b->buf + b->inbuf - start)) != NULL) {
+            // lobby and tournament news may follow the chat prompt
+            // without a break
+            if (b->saying && strncmp(start, "Type message: ", 14) == 0) {
+                b->saying = 0;
+                b->move_sent = now_ns();
+                send_line(t, b, "gg\r\n");
+                start += 14;
+                continue;
+            }
+            *nl = '\0';
+            if (nl > start && nl[-1] == '\r') {
+                nl[-1] = '\0';
+            }
+            handle_line(t, b, start, now);
+            start = nl + 1;
+        }
+        b->inbuf -= start - b->buf;
+        memmove(b->buf, start, b->inbuf);
+        b->buf[b->inbuf] = '\0';
+
+        if (b->saying && strstr(b->buf, "Type message: ") != NULL) {
+            b->saying = 0;
+            b->inbuf = 0;
+            b->move_sent = now_ns();
+            send_line(t, b, "gg\r\n");
+        } else if (b->menu_seen && b->state == BOT_PLAYING) {
+            play_move(t, b);
+        }
+        // drop a runaway partial line rather than overflow
+        if (b->inbuf >= BOT_BUF - 1) {
+            b->inbuf = 0;
+        }
+    }
+}
+
+void *run_thread(void *arg) {
+    struct gen_thread *t = arg;
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    int started = 0;
+    long long start = now_ns();
+    struct epoll_event events[MAX_EVENTS];
+    while (!stop && now_ns() < run_until) {
+        // Open connections, paced by the connect rate if there is one
+        int due = t->num_bots;
+        if (connect_rate > 0) {
+            due = (now_ns() - start) / 1000000000.0 * connect_rate + 1;
+            if (due > t->num_bots) {
+                due = t->num_bots;
+            }
+        }
+        for (; started < due; started++) {
+            struct bot *b = &t->bots[started];
+            b->id = t->first_bot + started;
+            start_connect(t, epfd, b);
+        }
+
+        int n = epoll_wait(epfd, events, MAX_EVENTS, 10);
+        for (int i = 0; i < n; i++) {
+            struct bot *b = events[i].data.ptr;
+            if (b->state == BOT_CONNECTING && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(b->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0 || (events[i].events & EPOLLERR)) {
+                    t->st.connect_errors++;
+                    close(b->fd);
+                    b->state = BOT_DONE;
+                    continue;
+                }
+                t->st.connects++;
+                b->state = BOT_NAMING;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+                handle_readable(t, b);
+            }
+        }
+    }
+
+    for (int i = 0; i < started; i++) {
+        if (t->bots[i].state != BOT_DONE) {
+            close(t->bots[i].fd);
+        }
+    }
+    close(epfd);
+    return NULL;
+}
+
+void merge_samples(struct samples *dst, struct samples *src) {
+    for (long i = 0; i < src->n; i++) {
+        add_sample(dst, src->v[i]);
+    }
+    free(src->v);
+}
+
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-h host] [-p port] [-c connections] [-d seconds] [-r connects_per_sec] [-t threads] [-b] [-j]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    char *host = "127.0.0.1";
+    int port = SERVER_PORT;
+    int connections = 1000;
+    int duration = 10;
+    int num_threads = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:d:r:t:bj")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'c': connections = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'r': connect_rate = atoi(optarg); break;
+        case 't': num_threads = atoi(optarg); break;
+        case 'b': binary = 1; break;
+        case 'j': join_tourney = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (connections < 1 || duration < 1 || num_threads < 1 || num_threads > connections) {
+        usage(argv[0]);
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server_addr.sin_addr) != 1) {
+        fprintf(stderr, "bad address: %s\n", host);
+        exit(1);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, sigint_handler);
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (connect_rate > 0) {
+        connect_rate = (connect_rate + num_threads - 1) / num_threads;
+    }
+
+    struct gen_thread *threads = calloc(num_threads, sizeof(struct gen_thread));
+    struct bot *bots = calloc(connections, sizeof(struct bot));
+    if (threads == NULL || bots == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    long long start = now_ns();
+    run_until = start + duration * 1000000000LL;
+    int first = 0;
+    for (int i = 0; i < num_threads; i++) {
+        struct gen_thread *t = &threads[i];
+        t->id = i;
+        t->num_bots = connections / num_threads + (i < connections % num_threads);
+        t->first_bot = first;
+        t->bots = bots + first;
+        t->seed = start + i;
+        first += t->num_bots;
+        if (pthread_create(&t->thread, NULL, run_thread, t) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    struct stats total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < num_threads; i++) {
+        struct stats *st = &threads[i].st;
+        pthread_join(threads[i].thread, NULL);
+        total.connects += st->connects;
+        total.connect_errors += st->connect_errors;
+        total.accepts += st->accepts;
+        total.logins += st->logins;
+        total.matches_started += st->matches_started;
+        total.matches_finished += st->matches_finished;
+        total.turns += st->turns;
+        total.disconnects += st->disconnects;
+        total.bouts += st->bouts;
+        if (st->tourney_start != 0 && (total.tourney_start == 0 || st->tourney_start < total.tourney_start)) {
+            total.tourney_start = st->tourney_start;
+        }
+        if (st->tourney_end > total.tourney_end) {
+            total.tourney_end = st->tourney_end;
+        }
+        if (st->last_accept > total.last_accept) {
+            total.last_accept = st->last_accept;
+        }
+        merge_samples(&total.accept_lat, &st->accept_lat);
+        merge_samples(&total.match_wait, &st->match_wait);
+        merge_samples(&total.turn_rtt, &st->turn_rtt);
+        merge_samples(&total.match_len, &st->match_len);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    printf("duration         %.2fs, %d connections, %d threads\n", elapsed, connections, num_threads);
+    printf("connects         %ld (%ld errors, %ld disconnects)\n", total.connects, total.connect_errors, total.disconnects);
+    // rate over the time it took to get every connection accepted
+    double accept_window = total.last_accept > start ? (total.last_accept - start) / 1e9 : elapsed;
+    printf("accepts/sec      %.1f (%ld in %.3fs)\n", total.accepts / accept_window, total.accepts, accept_window);
+    printf("logins           %ld\n", total.logins);
+    printf("matches/sec      %.1f (%ld started, %ld finished)\n", total.matches_finished / 2 / elapsed,
+        total.matches_started / 2, total.matches_finished / 2);
+    printf("turns/sec        %.1f\n", total.turns / elapsed);
+    print_latency("accept", &total.accept_lat);
+    print_latency("time-to-match", &total.match_wait);
+    print_latency("turn-rtt", &total.turn_rtt);
+    print_latency("match-length", &total.match_len);
+    if (join_tourney && total.tourney_end > total.tourney_start && total.tourney_start != 0) {
+        // how many match lengths back to back the whole event took
+        double took = (total.tourney_end - total.tourney_start) / 1e3;
+        printf("tournament       %ld bouts in %.3fs, %.1f median match lengths\n", total.bouts / 2,
+            took / 1e6, total.match_len.n ? took / quantile_us(&total.match_len, 0.5) : 0);
+    }
+
+    free(total.accept_lat.v);
+    free(total.match_wait.v);
+    free(total.turn_rtt.v);
+    free(total.match_len.v);
+    free(bots);
+    free(threads);
+    return 0;
+}
@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lobby.h"
+#include "game.h"
+#include "metrics.h"
+#include "proto.h"
+
+static __thread struct lobby *thread_lobby = NULL;
+
+// Every lobby, linked by next_lobby; only changed before workers run.
+static struct lobby *lobbies = NULL;
+
+// Members of every lobby together, so a worker knows whether anyone
+// anywhere is listening.
+static int members_online = 0;
+
+void lobby_init(struct lobby *l, int wake_fd) {
+    pthread_mutex_init(&l->posts_lock, NULL);
+    l->posts = NULL;
+    l->wake_fd = wake_fd;
+    l->next_lobby = lobbies;
+    lobbies = l;
+}
+
+void lobby_free(struct lobby *l) {
+    while (l->posts != NULL) {
+        struct lobby_post *p = l->posts;
+        l->posts = p->next;
+        free(p);
+    }
+    pthread_mutex_destroy(&l->posts_lock);
+}
+
+void lobby_attach(struct lobby *l) {
+    thread_lobby = l;
+}
+
+void lobby_enter(struct client_sock *c) {
+    struct lobby *l = thread_lobby;
+    if (l == NULL || c->in_lobby) {
+        return;
+    }
+    c->lobby_prev = NULL;
+    c->lobby_next = l->members;
+    if (l->members != NULL) {
+        l->members->lobby_prev = c;
+    }
+    l->members = c;
+    l->count++;
+    c->in_lobby = 1;
+    __atomic_fetch_add(&members_online, 1, __ATOMIC_RELAXED);
+    metric_add(M_LOBBY_MEMBERS, 1);
+}
+
+void lobby_leave(struct client_sock *c) {
+    struct lobby *l = thread_lobby;
+    if (l == NULL || !c->in_lobby) {
+        return;
+    }
+    if (c->lobby_prev != NULL) {
+        c->lobby_prev->lobby_next = c->lobby_next;
+    } else {
+        l->members = c->lobby_next;
+    }
+    if (c->lobby_next != NULL) {
+        c->lobby_next->lobby_prev = c->lobby_prev;
+    }
+    l->count--;
+    c->in_lobby = 0;
+    __atomic_fetch_add(&members_online, -1, __ATOMIC_RELAXED);
+    metric_add(M_LOBBY_MEMBERS, -1);
+}
+
+/*
+ * Add one message to the batch, as text_len bytes of text for text
+ * clients and an OP_LOBBY frame with the given payload for binary ones.
+ * If either does not fit, the message is dropped.
+ */
+static void batch(const char *text, int text_len, const char *payload, int payload_len) {
+    struct lobby *l = thread_lobby;
+    if (l == NULL || __atomic_load_n(&members_online, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+    if (l->text_len + text_len > LOBBY_BATCH_SIZE
+            || l->frames_len + PROTO_HEADER + payload_len > LOBBY_BATCH_SIZE) {
+        metric_add(M_LOBBY_DROPPED, 1);
+        return;
+    }
+    memcpy(l->text + l->text_len, text, text_len);
+    l->text_len += text_len;
+    l->frames_len += encode_frame(l->frames + l->frames_len, OP_LOBBY, payload, payload_len);
+    metric_add(M_LOBBY_MESSAGES, 1);
+}
+
+/*
+ * Append user name field, NULL-terminated, to the OP_LOBBY payload of
+ * *len bytes at payload, as far as it fits.
+ */
+static void add_field(char *payload, int *len, const struct name *field) {
+    int n = field->len + 1;
+    if (*len + n > PROTO_MAX_PAYLOAD) {
+        n = PROTO_MAX_PAYLOAD - *len;
+    }
+    memcpy(payload + *len, field->text, n);
+    *len += n;
+}
+
+/*
+ * Batch an event about one user name, worded as name followed by what.
+ */
+static void announce(int event, const struct name *name, const char *what) {
+    char text[BUF_SIZE + MAX_NAME];
+    int text_len = snprintf(text, sizeof(text), "[lobby] %s %s\n", name->text, what);
+    char payload[PROTO_MAX_PAYLOAD];
+    int len = 1;
+    payload[0] = event;
+    add_field(payload, &len, name);
+    batch(text, text_len, payload, len);
+}
+
+void lobby_say(struct client_sock *c, const char *text) {
+    char line[BUF_SIZE + MAX_NAME];
+    int line_len = snprintf(line, sizeof(line), "[lobby] %s: %s\n", c->name->text, text);
+    if (line_len >= (int) sizeof(line)) {
+        line_len = sizeof(line) - 1;
+        line[line_len - 1] = '\n';
+    }
+    char payload[PROTO_MAX_PAYLOAD];
+    int len = 1;
+    payload[0] = LOBBY_CHAT;
+    add_field(payload, &len, c->name);
+    // the text goes without a terminator, and loses its end if need be
+    int n = strlen(text);
+    if (len + n > PROTO_MAX_PAYLOAD) {
+        n = PROTO_MAX_PAYLOAD - len;
+    }
+    memcpy(payload + len, text, n);
+    batch(line, line_len, payload, len + n);
+}
+
+void lobby_joined(struct client_sock *c) {
+    announce(LOBBY_JOIN, c->name, "joined.");
+}
+
+void lobby_left(struct client_sock *c) {
+    announce(LOBBY_LEAVE, c->name, "left the arena.");
+}
+
+void lobby_result(struct match *m, int winner, int by) {
+    struct name *won = m->players[winner]->name;
+    struct name *lost = m->players[1 - winner]->name;
+    char text[BUF_SIZE + 2 * MAX_NAME];
+    int text_len;
+    if (by == PROTO_BY_DISCONNECT) {
+        text_len = snprintf(text, sizeof(text), "[lobby] %s dropped; %s wins.\n", lost->text, won->text);
+    } else if (by == PROTO_BY_TIMEOUT) {
+        text_len = snprintf(text, sizeof(text), "[lobby] %s ran out of time; %s wins.\n", lost->text, won->text);
+    } else {
+        text_len = snprintf(text, sizeof(text), "[lobby] %s beat %s.\n", won->text, lost->text);
+    }
+    char payload[PROTO_MAX_PAYLOAD];
+    int len = 1;
+    payload[0] = LOBBY_RESULT;
+    add_field(payload, &len, won);
+    add_field(payload, &len, lost);
+    payload[len++] = by;
+    batch(text, text_len, payload, len);
+}
+
+int lobby_pending() {
+    struct lobby *l = thread_lobby;
+    return l != NULL && l->text_len > 0;
+}
+
+/*
+ * Queue text_len bytes of text to the text clients of lobby l and
+ * frames_len bytes of frames to the binary ones, each as one shared
+ * buffer.
+ */
+static void deliver(struct lobby *l, const char *text, int text_len, const char *frames, int frames_len) {
+    struct shared_buf *text_buf = NULL;
+    struct shared_buf *frame_buf = NULL;
+    for (struct client_sock *c = l->members; c != NULL; c = c->lobby_next) {
+        struct shared_buf **b = c->proto == PROTO_BINARY ? &frame_buf : &text_buf;
+        if (*b == NULL) {
+            *b = c->proto == PROTO_BINARY ? shared_new(frames, frames_len)
+                : shared_new(text, text_len);
+            if (*b == NULL) {
+                continue;
+            }
+        }
+        if (out_append_shared(&c->out, *b) == 0) {
+            mark_dirty(c);
+        }
+    }
+    if (text_buf != NULL) {
+        shared_release(text_buf);
+    }
+    if (frame_buf != NULL) {
+        shared_release(frame_buf);
+    }
+}
+
+/*
+ * Post the batch of lobby l to every other lobby, as a copy each, as
+ * shared buffers belong to the worker that made them.
+ */
+static void post(struct lobby *l) {
+    for (struct lobby *to = lobbies; to != NULL; to = to->next_lobby) {
+        if (to == l) {
+            continue;
+        }
+        struct lobby_post *p = malloc(sizeof(struct lobby_post) + l->text_len + l->frames_len);
+        if (p == NULL) {
+            perror("malloc");
+            return;
+        }
+        p->text_len = l->text_len;
+        p->frames_len = l->frames_len;
+        memcpy(p->data, l->text, l->text_len);
+        memcpy(p->data + l->text_len, l->frames, l->frames_len);
+
+        pthread_mutex_lock(&to->posts_lock);
+        p->next = to->posts;
+        to->posts = p;
+        pthread_mutex_unlock(&to->posts_lock);
+        write(to->wake_fd, "", 1);
+    }
+}
+
+void lobby_flush() {
+    struct lobby *l = thread_lobby;
+    if (l == NULL || l->text_len == 0) {
+        return;
+    }
+    deliver(l, l->text, l->text_len, l->frames, l->frames_len);
+    // only worth copying if someone elsewhere is listening
+    if (__atomic_load_n(&members_online, __ATOMIC_RELAXED) > l->count) {
+        post(l);
+    }
+    l->text_len = 0;
+    l->frames_len = 0;
+}
+
+void lobby_receive() {
+    struct lobby *l = thread_lobby;
+    if (l == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&l->posts_lock);
+    struct lobby_post *list = l->posts;
+    l->posts = NULL;
+    pthread_mutex_unlock(&l->posts_lock);
+
+    struct lobby_post *in_order = NULL;
+    while (list != NULL) {
+        struct lobby_post *p = list;
+        list = p->next;
+        p->next = in_order;
+        in_order = p;
+    }
+    while (in_order != NULL) {
+        struct lobby_post *p = in_order;
+        in_order = p->next;
+        deliver(l, p->data, p->text_len, p->data + p->text_len, p->frames_len);
+        free(p);
+    }
+}
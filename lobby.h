@@ -0,0 +1,115 @@
+#ifndef LOBBY_H
+#define LOBBY_H
+
+#include <pthread.h>
+
+#include "client.h"
+
+// Bytes of lobby messages, per protocol, a worker may batch up between
+// two flushes. Messages beyond that are dropped.
+#ifndef LOBBY_BATCH_SIZE
+    #define LOBBY_BATCH_SIZE 16384
+#endif
+
+/*
+ * A batch of lobby messages one worker has posted to another's lobby.
+ */
+struct lobby_post {
+    struct lobby_post *next;
+    int text_len;
+    int frames_len;
+    char data[];        // the text, then the frames
+};
+
+/*
+ * Lobby channel of one worker: every logged in client of the worker
+ * that is not in a match. Chat and announcements are batched as they
+ * happen, and the whole batch is queued to every member at once, so
+ * each member gets one write per loop iteration however busy the lobby
+ * is. The batch is also posted to every other worker's lobby, so the
+ * lobbies together make one channel for the whole server.
+ */
+struct lobby {
+    struct client_sock *members;    // linked by lobby_next
+    int count;
+    char text[LOBBY_BATCH_SIZE];    // batched messages for text clients
+    int text_len;
+    char frames[LOBBY_BATCH_SIZE];  // the same messages as OP_LOBBY frames
+    int frames_len;
+    struct lobby *next_lobby;       // every lobby of the server
+    // Batches other workers have posted here, and the pipe written to
+    // wake this lobby's worker up for them.
+    pthread_mutex_t posts_lock;
+    struct lobby_post *posts;
+    int wake_fd;
+};
+
+struct match;
+
+/*
+ * Set up l as one of the server's lobbies, whose worker is woken by
+ * writing to wake_fd when others post to it. Every lobby is set up
+ * before any worker runs.
+ */
+void lobby_init(struct lobby *l, int wake_fd);
+
+/*
+ * Free the batches posted to lobby l and not yet received.
+ */
+void lobby_free(struct lobby *l);
+
+/*
+ * Make l the lobby the calling thread's clients meet in. Lobby
+ * functions do nothing until it is set.
+ */
+void lobby_attach(struct lobby *l);
+
+/*
+ * Add client c to the lobby, if it is not in it already.
+ */
+void lobby_enter(struct client_sock *c);
+
+/*
+ * Take client c out of the lobby, if it is in it.
+ */
+void lobby_leave(struct client_sock *c);
+
+/*
+ * Say text to the lobby on behalf of member c.
+ */
+void lobby_say(struct client_sock *c, const char *text);
+
+/*
+ * Announce that client c has logged in.
+ */
+void lobby_joined(struct client_sock *c);
+
+/*
+ * Announce that client c has disconnected.
+ */
+void lobby_left(struct client_sock *c);
+
+/*
+ * Announce that player winner has won match m.
+ */
+void lobby_result(struct match *m, int winner, int by);
+
+/*
+ * Return 1 if messages are batched up waiting for lobby_flush().
+ */
+int lobby_pending();
+
+/*
+ * Queue everything batched since the last flush to every member, in
+ * its protocol, without copying it for each, and post it to the other
+ * lobbies.
+ */
+void lobby_flush();
+
+/*
+ * Queue the batches other workers have posted to this thread's lobby
+ * to its members, in the order they were posted.
+ */
+void lobby_receive();
+
+#endif
@@ -0,0 +1,1306 @@
+#define _GNU_SOURCE    // accept4
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+// Multishot recv and synchronous cancellation came in the same release;
+// older headers build without the io_uring backend.
+#ifdef IORING_RECV_MULTISHOT
+#define LOOP_HAVE_URING
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "loop.h"
+#include "metrics.h"
+
+#ifdef LOOP_HAVE_URING
+/*
+ * Kinds of request an io_uring loop makes, kept in their tags.
+ */
+#define URING_POLL 1        // multishot poll of a descriptor the loop does not read
+#define URING_RECV 2        // multishot recv into provided buffers
+#define URING_SEND 3        // send or sendmsg, maybe linked to the next
+#define URING_ACCEPT 4      // multishot accept
+
+// A tag is the generation, then the kind, then the fd.
+#define URING_FD_BITS 28
+#define URING_FD_MASK ((1u << URING_FD_BITS) - 1)
+
+// Buffer group of the provided buffers.
+#define URING_BGID 0
+
+/*
+ * What an io_uring loop knows of a descriptor. Its requests are tagged
+ * with the fd, their kind and a generation, bumped whenever the fd is
+ * registered afresh or its poll replaced, so completions of requests
+ * since removed are told apart from those of the current ones.
+ */
+struct uring_fd {
+    void *data;
+    int events;         // as registered, 0 if not watched
+    uint32_t gen;
+    int ready;          // events completed but not reported yet
+    unsigned char queued;   // on the loop's ready list
+    unsigned char starved;  // on the loop's starved list
+    unsigned char detached; // by loop_detach(), with what it holds
+    unsigned char recving;  // a recv or accept is in flight
+
+    // sockets the loop writes: sends in flight, what they sent that
+    // loop_writev() has not returned yet, and how they failed
+    int sending;
+    int sent;
+    int send_err;
+
+    // sockets the loop reads: the buffers read ahead, linked by next,
+    // and how the input ended, once it has
+    int in_head;
+    int in_tail;
+    int in_bytes;
+    int in_err;
+    unsigned char in_eof;
+
+    // listening sockets: connections accepted ahead
+    int *accepted;
+    int accepted_head;
+    int accepted_count;
+    int accepted_cap;
+};
+
+/*
+ * A provided buffer that holds input read ahead.
+ */
+struct uring_buf {
+    int next;       // next buffer read ahead from the same fd, or -1
+    int off;        // bytes of it already read
+    int len;
+};
+
+/*
+ * The header and iovecs of a sendmsg, one per submission queue entry.
+ * The kernel is done with them once the entry is submitted.
+ */
+struct uring_msg {
+    struct msghdr hdr;
+    struct iovec iov[LOOP_URING_IOV];
+};
+#endif
+
+struct event_loop {
+    int backend;
+
+    // epoll backend
+    int epoll_fd;
+
+    // select backend: interest and data are indexed by fd
+    fd_set read_fds;
+    fd_set write_fds;
+    int max_fd;
+    int interest[FD_SETSIZE];
+    void *data[FD_SETSIZE];
+
+#ifdef LOOP_HAVE_URING
+    // io_uring backend: the rings shared with the kernel, and the
+    // watched descriptors indexed by fd
+    int ring_fd;
+    unsigned features;
+    void *ring;             // both queues, mapped together
+    size_t ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_queued;     // our tail: entries up to here are filled in
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct uring_msg *msgs; // by submission queue entry
+    struct uring_fd *fds;
+    int num_fds;
+
+    // Descriptors with events to report, oldest first, and those whose
+    // recv or accept ended for want of buffers or descriptors. Each is
+    // on a list at most once, so they need no more room than fds.
+    int *ready_fds;
+    int num_ready;
+    int *starved_fds;
+    int num_starved;
+    int fd_freed;           // a descriptor was let go of since the last wait
+
+    // the provided buffers and the ring they are handed back through
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    char *buf_mem;
+    size_t buf_mem_size;
+    struct uring_buf *bufs;
+    unsigned short buf_tail;
+    int bufs_held;          // taken by the kernel and not handed back yet
+#endif
+};
+
+// Loop of the calling thread, set by loop_attach().
+static __thread struct event_loop *attached = NULL;
+
+#ifdef LOOP_HAVE_URING
+static int uring_create(struct event_loop *l);
+static void uring_destroy(struct event_loop *l);
+#endif
+
+struct event_loop *loop_create(int backend) {
+    struct event_loop *l = malloc(sizeof(struct event_loop));
+    if (l == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    l->backend = backend;
+    l->epoll_fd = -1;
+    FD_ZERO(&l->read_fds);
+    FD_ZERO(&l->write_fds);
+    l->max_fd = -1;
+    memset(l->interest, 0, sizeof(l->interest));
+#ifdef LOOP_HAVE_URING
+    l->ring_fd = -1;
+    l->ring = NULL;
+    l->sqes = NULL;
+    l->msgs = NULL;
+    l->fds = NULL;
+    l->num_fds = 0;
+    l->ready_fds = NULL;
+    l->num_ready = 0;
+    l->starved_fds = NULL;
+    l->num_starved = 0;
+    l->fd_freed = 0;
+    l->buf_ring = NULL;
+    l->buf_mem = NULL;
+    l->bufs = NULL;
+#endif
+
+#ifdef __linux__
+    if (backend == LOOP_URING) {
+#ifdef LOOP_HAVE_URING
+        if (uring_create(l) == 0) {
+            return l;
+        }
+#endif
+        fprintf(stderr, "io_uring not available, using epoll\n");
+        l->backend = backend = LOOP_EPOLL;
+    }
+    if (backend == LOOP_EPOLL) {
+        l->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (l->epoll_fd < 0) {
+            perror("epoll_create1");
+            free(l);
+            return NULL;
+        }
+        return l;
+    }
+#endif
+    if (backend != LOOP_SELECT) {
+        fprintf(stderr, "event loop backend %d not supported\n", backend);
+        free(l);
+        return NULL;
+    }
+    return l;
+}
+
+void loop_destroy(struct event_loop *l) {
+    if (attached == l) {
+        attached = NULL;
+    }
+#ifdef LOOP_HAVE_URING
+    if (l->ring_fd >= 0) {
+        uring_destroy(l);
+    }
+#endif
+    if (l->epoll_fd >= 0) {
+        close(l->epoll_fd);
+    }
+    free(l);
+}
+
+#ifdef __linux__
+static int epoll_ctl_events(struct event_loop *l, int op, int fd, int events, void *data) {
+    struct epoll_event ev;
+    ev.events = EPOLLET | EPOLLRDHUP;
+    if (events & LOOP_READ) {
+        ev.events |= EPOLLIN;
+    }
+    if (events & LOOP_WRITE) {
+        ev.events |= EPOLLOUT;
+    }
+    ev.data.ptr = data;
+    metric_add(M_LOOP_SYSCALLS, 1);
+    if (epoll_ctl(l->epoll_fd, op, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return 1;
+    }
+    return 0;
+}
+#endif
+
+#ifdef LOOP_HAVE_URING
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_register(struct event_loop *l, unsigned op, void *arg, unsigned n) {
+    metric_add(M_LOOP_SYSCALLS, 1);
+    return (int) syscall(__NR_io_uring_register, l->ring_fd, op, arg, n);
+}
+
+/*
+ * Submit every queued entry and, if wait is set, wait up to timeout_ms
+ * (forever if negative) for a completion.
+ * Return 0 on success, or -1 with errno set; ETIME means the time ran out.
+ */
+static int uring_enter(struct event_loop *l, int wait, int timeout_ms) {
+    __atomic_store_n(l->sq_tail, l->sq_queued, __ATOMIC_RELEASE);
+    unsigned to_submit = l->sq_queued - __atomic_load_n(l->sq_head, __ATOMIC_ACQUIRE);
+    unsigned flags = 0;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    memset(&arg, 0, sizeof(arg));
+    if (wait) {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        if (timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+            arg.ts = (uint64_t) (uintptr_t) &ts;
+        }
+    } else if (to_submit == 0) {
+        return 0;
+    }
+    metric_add(M_LOOP_SYSCALLS, 1);
+    if (syscall(__NR_io_uring_enter, l->ring_fd, to_submit, wait ? 1 : 0, flags, &arg, sizeof(arg)) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Make room for n more submission queue entries, submitting what is
+ * queued if there is not. Return 0 on success, 1 on error.
+ */
+static int uring_reserve(struct event_loop *l, unsigned n) {
+    if (l->sq_entries - (l->sq_queued - __atomic_load_n(l->sq_head, __ATOMIC_ACQUIRE)) >= n) {
+        return 0;
+    }
+    if (uring_enter(l, 0, 0) < 0) {
+        perror("io_uring_enter");
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Return a cleared submission queue entry, submitting what is queued
+ * first if the queue is full. Return NULL on error.
+ */
+static struct io_uring_sqe *uring_get_sqe(struct event_loop *l) {
+    if (uring_reserve(l, 1)) {
+        return NULL;
+    }
+    unsigned i = l->sq_queued & *l->sq_mask;
+    struct io_uring_sqe *sqe = &l->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    l->sq_array[i] = i;
+    l->sq_queued++;
+    return sqe;
+}
+
+static uint64_t uring_tag(struct event_loop *l, int fd, int kind) {
+    return ((uint64_t) l->fds[fd].gen << 32) | ((uint32_t) kind << URING_FD_BITS) | (uint32_t) fd;
+}
+
+/*
+ * Note that fd has events to report with the next wait.
+ */
+static void uring_push_ready(struct event_loop *l, int fd, int events) {
+    struct uring_fd *f = &l->fds[fd];
+    f->ready |= events;
+    if (!f->queued) {
+        f->queued = 1;
+        l->ready_fds[l->num_ready++] = fd;
+    }
+}
+
+/*
+ * Queue a multishot poll of fd for its events. Like epoll's EPOLLET,
+ * io_uring polls are edge-triggered unless asked otherwise.
+ */
+static int uring_arm(struct event_loop *l, int fd) {
+    struct io_uring_sqe *sqe = uring_get_sqe(l);
+    if (sqe == NULL) {
+        return 1;
+    }
+    unsigned mask = EPOLLRDHUP;
+    if (l->fds[fd].events & LOOP_READ) {
+        mask |= EPOLLIN;
+    }
+    if (l->fds[fd].events & LOOP_WRITE) {
+        mask |= EPOLLOUT;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = mask;
+    sqe->user_data = uring_tag(l, fd, URING_POLL);
+    return 0;
+}
+
+/*
+ * Queue the removal of fd's poll. Removals complete with tag 0, which
+ * is never a poll's, and only when they fail if the kernel can skip
+ * the rest.
+ */
+static int uring_disarm(struct event_loop *l, int fd) {
+    struct io_uring_sqe *sqe = uring_get_sqe(l);
+    if (sqe == NULL) {
+        return 1;
+    }
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->addr = uring_tag(l, fd, URING_POLL);
+    sqe->user_data = 0;
+    if (l->features & IORING_FEAT_CQE_SKIP) {
+        sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+    }
+    return 0;
+}
+
+/*
+ * Queue a multishot recv of the stream socket fd into the provided
+ * buffers, or a multishot accept of the listening socket fd.
+ */
+static int uring_take(struct event_loop *l, int fd) {
+    struct io_uring_sqe *sqe = uring_get_sqe(l);
+    if (sqe == NULL) {
+        return 1;
+    }
+    struct uring_fd *f = &l->fds[fd];
+    sqe->fd = fd;
+    if (f->events & LOOP_ACCEPT) {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data = uring_tag(l, fd, URING_ACCEPT);
+    } else {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BGID;
+        sqe->user_data = uring_tag(l, fd, URING_RECV);
+    }
+    f->recving = 1;
+    return 0;
+}
+
+/*
+ * Note that fd's recv or accept ended for want of buffers or of
+ * descriptors, for uring_feed() to try it again once there are some.
+ */
+static void uring_starve(struct event_loop *l, int fd) {
+    struct uring_fd *f = &l->fds[fd];
+    if (!f->starved) {
+        f->starved = 1;
+        l->starved_fds[l->num_starved++] = fd;
+    }
+}
+
+/*
+ * Rearm the recvs that ran out of buffers once half of them are back,
+ * so the first input to arrive does not use them up again, and the
+ * accepts that failed once a descriptor has been let go of.
+ */
+static void uring_feed(struct event_loop *l) {
+    int kept = 0;
+    for (int i = 0; i < l->num_starved; i++) {
+        int fd = l->starved_fds[i];
+        struct uring_fd *f = &l->fds[fd];
+        if (!(f->events & LOOP_READ) || f->recving) {
+            f->starved = 0;     // no longer wanted, or armed again since
+            continue;
+        }
+        if ((f->events & LOOP_ACCEPT) ? !l->fd_freed : l->bufs_held > LOOP_URING_BUFS / 2) {
+            l->starved_fds[kept++] = fd;
+            continue;
+        }
+        f->starved = 0;
+        uring_take(l, fd);
+    }
+    l->num_starved = kept;
+    l->fd_freed = 0;
+}
+
+/*
+ * Hand buffer bid back to the kernel to receive into.
+ */
+static void uring_recycle(struct event_loop *l, int bid) {
+    struct io_uring_buf *b = &l->buf_ring->bufs[l->buf_tail & (LOOP_URING_BUFS - 1)];
+    b->addr = (uint64_t) (uintptr_t) (l->buf_mem + (size_t) bid * LOOP_URING_BUF_SIZE);
+    b->len = LOOP_URING_BUF_SIZE;
+    b->bid = bid;
+    l->buf_tail++;
+    __atomic_store_n(&l->buf_ring->tail, l->buf_tail, __ATOMIC_RELEASE);
+    l->bufs_held--;
+}
+
+static int uring_complete_all(struct event_loop *l);
+
+/*
+ * Cancel every request on fd, or the one tagged tag if it is not 0,
+ * and wait for them to end, taking in their last completions. What is
+ * queued goes in first, so none of it is left to start afterwards.
+ * Return 0 on success, 1 on error.
+ */
+static int uring_cancel(struct event_loop *l, int fd, uint64_t tag) {
+    if (uring_enter(l, 0, 0) < 0) {
+        perror("io_uring_enter");
+        return 1;
+    }
+    struct io_uring_sync_cancel_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    if (tag != 0) {
+        reg.addr = tag;
+    } else {
+        reg.fd = fd;
+        reg.flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    }
+    reg.timeout.tv_sec = -1;
+    reg.timeout.tv_nsec = -1;
+    if (uring_register(l, IORING_REGISTER_SYNC_CANCEL, &reg, 1) < 0 && errno != ENOENT) {
+        perror("io_uring cancel");
+        return 1;
+    }
+    uring_complete_all(l);
+    return 0;
+}
+
+/*
+ * Let go of everything held for fd, and start it on a new generation.
+ */
+static void uring_reset(struct event_loop *l, int fd) {
+    struct uring_fd *f = &l->fds[fd];
+    while (f->in_head >= 0) {
+        int bid = f->in_head;
+        f->in_head = l->bufs[bid].next;
+        uring_recycle(l, bid);
+    }
+    f->in_tail = -1;
+    f->in_bytes = 0;
+    f->in_err = 0;
+    f->in_eof = 0;
+    while (f->accepted_count > 0) {
+        close(f->accepted[f->accepted_head++]);
+        f->accepted_count--;
+    }
+    f->accepted_head = 0;
+    f->recving = 0;
+    f->sending = 0;
+    f->sent = 0;
+    f->send_err = 0;
+    f->detached = 0;
+    f->ready = 0;
+    f->events = 0;
+    f->data = NULL;
+    if (++f->gen == 0) {
+        f->gen = 1;
+    }
+}
+
+/*
+ * Make the per-fd arrays big enough for fd.
+ * Return 0 on success, 1 on error.
+ */
+static int uring_grow(struct event_loop *l, int fd) {
+    if (fd < l->num_fds) {
+        return 0;
+    }
+    int n = l->num_fds ? l->num_fds : 64;
+    while (n <= fd) {
+        n *= 2;
+    }
+    struct uring_fd *fds = realloc(l->fds, n * sizeof(struct uring_fd));
+    if (fds == NULL) {
+        perror("realloc");
+        return 1;
+    }
+    l->fds = fds;
+    memset(fds + l->num_fds, 0, (n - l->num_fds) * sizeof(struct uring_fd));
+    for (int i = l->num_fds; i < n; i++) {
+        fds[i].in_head = -1;
+        fds[i].in_tail = -1;
+    }
+    l->num_fds = n;
+
+    int *ready = realloc(l->ready_fds, n * sizeof(int));
+    if (ready != NULL) {
+        l->ready_fds = ready;
+    }
+    int *starved = ready != NULL ? realloc(l->starved_fds, n * sizeof(int)) : NULL;
+    if (starved == NULL) {
+        // too late to shrink fds back; fds past the lists' room are
+        // refused until the lists can grow
+        perror("realloc");
+        return 1;
+    }
+    l->starved_fds = starved;
+    return 0;
+}
+
+static int uring_set(struct event_loop *l, int fd, int events, void *data) {
+    if (fd < 0 || (unsigned) fd > URING_FD_MASK || uring_grow(l, fd)) {
+        return 1;
+    }
+    struct uring_fd *f = &l->fds[fd];
+    f->data = data;
+
+    if (events & (LOOP_STREAM | LOOP_ACCEPT)) {
+        // the loop receives or accepts for the caller while it wants
+        // to read, and sends whenever it writes
+        f->events = events;
+        f->detached = 0;
+        int kind = (events & LOOP_ACCEPT) ? URING_ACCEPT : URING_RECV;
+        if ((events & LOOP_READ) && !f->recving && !f->in_eof && f->in_err == 0) {
+            return uring_take(l, fd);
+        }
+        if (!(events & LOOP_READ) && f->recving) {
+            // left in the socket, unread input holds the sender back
+            return uring_cancel(l, fd, uring_tag(l, fd, kind));
+        }
+        return 0;
+    }
+
+    if (events == f->events) {
+        return 0;
+    }
+    if (f->events != 0 && uring_disarm(l, fd)) {
+        return 1;
+    }
+    f->events = events;
+    // a new request, whose tag no completion of the old one carries
+    if (++f->gen == 0) {
+        f->gen = 1;
+    }
+    return events != 0 ? uring_arm(l, fd) : 0;
+}
+
+/*
+ * Take in a completion of fd's recv: input read ahead into a provided
+ * buffer, the end of its input, or the recv ending.
+ */
+static void uring_received(struct event_loop *l, int fd, struct io_uring_cqe *cqe) {
+    struct uring_fd *f = &l->fds[fd];
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0) {
+            l->bufs[bid].next = -1;
+            l->bufs[bid].off = 0;
+            l->bufs[bid].len = cqe->res;
+            if (f->in_tail >= 0) {
+                l->bufs[f->in_tail].next = bid;
+            } else {
+                f->in_head = bid;
+            }
+            f->in_tail = bid;
+            f->in_bytes += cqe->res;
+        } else {
+            uring_recycle(l, bid);
+        }
+    }
+
+    int ev = 0;
+    if (cqe->res >= 0) {
+        f->in_eof = cqe->res == 0;
+        ev = LOOP_READ;
+    } else if (cqe->res != -ECANCELED && cqe->res != -ENOBUFS) {
+        f->in_err = -cqe->res;
+        ev = LOOP_READ | LOOP_ERROR;
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        f->recving = 0;
+        if ((f->events & LOOP_READ) && cqe->res > 0) {
+            uring_take(l, fd);      // ended by the kernel, as on overflow
+        } else if ((f->events & LOOP_READ) && cqe->res == -ENOBUFS) {
+            uring_starve(l, fd);
+        }
+    }
+    if (ev != 0) {
+        uring_push_ready(l, fd, ev);
+    }
+}
+
+/*
+ * Take in a completion of one of fd's sends. LOOP_WRITE is reported
+ * once the last of them is done.
+ */
+static void uring_sent(struct event_loop *l, int fd, struct io_uring_cqe *cqe) {
+    struct uring_fd *f = &l->fds[fd];
+    f->sending--;
+    if (cqe->res > 0) {
+        f->sent += cqe->res;
+    } else if (cqe->res < 0 && cqe->res != -ECANCELED && f->send_err == 0) {
+        f->send_err = -cqe->res;
+    }
+    if (f->sending == 0) {
+        uring_push_ready(l, fd, LOOP_WRITE);
+    }
+}
+
+/*
+ * Take in a completion of fd's accept: a new connection, or the accept
+ * failing or ending.
+ */
+static void uring_accepted(struct event_loop *l, int fd, struct io_uring_cqe *cqe) {
+    struct uring_fd *f = &l->fds[fd];
+    if (cqe->res >= 0) {
+        if (f->accepted_head + f->accepted_count == f->accepted_cap) {
+            if (f->accepted_head > 0) {
+                memmove(f->accepted, f->accepted + f->accepted_head, f->accepted_count * sizeof(int));
+                f->accepted_head = 0;
+            } else {
+                int cap = f->accepted_cap ? f->accepted_cap * 2 : 64;
+                int *accepted = realloc(f->accepted, cap * sizeof(int));
+                if (accepted == NULL) {
+                    perror("realloc");
+                    close(cqe->res);
+                    return;
+                }
+                f->accepted = accepted;
+                f->accepted_cap = cap;
+            }
+        }
+        f->accepted[f->accepted_head + f->accepted_count++] = cqe->res;
+        uring_push_ready(l, fd, LOOP_READ);
+    } else if (cqe->res != -ECANCELED) {
+        fprintf(stderr, "io_uring accept: %s\n", strerror(-cqe->res));
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        f->recving = 0;
+        if ((f->events & LOOP_READ) && cqe->res >= 0) {
+            uring_take(l, fd);
+        } else if ((f->events & LOOP_READ) && cqe->res != -ECANCELED) {
+            uring_starve(l, fd);
+        }
+    }
+}
+
+/*
+ * Take in one completion. Events are merged with any fd already has
+ * waiting: unlike epoll_wait, a batch of completions can hold several
+ * for the same descriptor.
+ */
+static void uring_complete(struct event_loop *l, struct io_uring_cqe *cqe) {
+    if (cqe->user_data == 0) {
+        if (cqe->res < 0 && cqe->res != -ENOENT && cqe->res != -EALREADY) {
+            fprintf(stderr, "io_uring poll remove: %s\n", strerror(-cqe->res));
+        }
+        return;
+    }
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        l->bufs_held++;
+    }
+    int fd = (int) (cqe->user_data & URING_FD_MASK);
+    int kind = (int) ((uint32_t) cqe->user_data >> URING_FD_BITS);
+    if (fd >= l->num_fds || (uint32_t) (cqe->user_data >> 32) != l->fds[fd].gen) {
+        // from a request removed or replaced since; what it still
+        // brought in is let go of
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            uring_recycle(l, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        if (kind == URING_ACCEPT && cqe->res >= 0) {
+            close(cqe->res);
+        }
+        return;
+    }
+    if (kind == URING_RECV) {
+        uring_received(l, fd, cqe);
+        return;
+    }
+    if (kind == URING_SEND) {
+        uring_sent(l, fd, cqe);
+        return;
+    }
+    if (kind == URING_ACCEPT) {
+        uring_accepted(l, fd, cqe);
+        return;
+    }
+
+    struct uring_fd *f = &l->fds[fd];
+    if (f->events == 0) {
+        return;
+    }
+    int ev = 0;
+    if (cqe->res < 0) {
+        fprintf(stderr, "io_uring poll: %s\n", strerror(-cqe->res));
+        ev = LOOP_ERROR;
+    } else {
+        if (cqe->res & (EPOLLIN | EPOLLRDHUP)) {
+            ev |= LOOP_READ;
+        }
+        if (cqe->res & EPOLLOUT) {
+            ev |= LOOP_WRITE;
+        }
+        if (cqe->res & (EPOLLERR | EPOLLHUP)) {
+            ev |= LOOP_ERROR;
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            // the kernel ended the poll, as it may when the completion
+            // queue overflows: watch fd again
+            uring_arm(l, fd);
+        }
+    }
+    uring_push_ready(l, fd, ev);
+}
+
+/*
+ * Take in every completion in the ring, without a syscall.
+ * Return how many there were.
+ */
+static int uring_complete_all(struct event_loop *l) {
+    unsigned head = *l->cq_head;
+    unsigned tail = __atomic_load_n(l->cq_tail, __ATOMIC_ACQUIRE);
+    int n = 0;
+    while (head != tail) {
+        uring_complete(l, &l->cqes[head & *l->cq_mask]);
+        head++;
+        n++;
+        // let the kernel reuse the entries as they are taken, since
+        // rearming may submit and complete more
+        __atomic_store_n(l->cq_head, head, __ATOMIC_RELEASE);
+        if (head == tail) {
+            tail = __atomic_load_n(l->cq_tail, __ATOMIC_ACQUIRE);
+        }
+    }
+    return n;
+}
+
+/*
+ * Queue sends of the iovcnt buffers to fd, linked so that each starts
+ * only once the one before has sent everything it had. MSG_WAITALL
+ * keeps a send going until it has, so that a short send fails it and
+ * cancels the rest instead of leaving a gap in the stream.
+ * Return 0 on success, 1 on error.
+ */
+static int uring_send(struct event_loop *l, int fd, const struct iovec *iov, int iovcnt) {
+    struct uring_fd *f = &l->fds[fd];
+    if (uring_reserve(l, (iovcnt + LOOP_URING_IOV - 1) / LOOP_URING_IOV)) {
+        return 1;
+    }
+    for (int i = 0; i < iovcnt; i += LOOP_URING_IOV) {
+        int n = iovcnt - i < LOOP_URING_IOV ? iovcnt - i : LOOP_URING_IOV;
+        struct io_uring_sqe *sqe = uring_get_sqe(l);
+        if (n == 1) {
+            sqe->opcode = IORING_OP_SEND;
+            sqe->addr = (uint64_t) (uintptr_t) iov[i].iov_base;
+            sqe->len = iov[i].iov_len;
+        } else {
+            struct uring_msg *m = &l->msgs[sqe - l->sqes];
+            memset(&m->hdr, 0, sizeof(m->hdr));
+            memcpy(m->iov, iov + i, n * sizeof(struct iovec));
+            m->hdr.msg_iov = m->iov;
+            m->hdr.msg_iovlen = n;
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->addr = (uint64_t) (uintptr_t) &m->hdr;
+            sqe->len = 1;
+        }
+        sqe->fd = fd;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->user_data = uring_tag(l, fd, URING_SEND);
+        if (i + n < iovcnt) {
+            sqe->flags |= IOSQE_IO_LINK;
+        }
+        f->sending++;
+    }
+    return 0;
+}
+
+/*
+ * Copy up to len bytes of the input read ahead from fd into buf,
+ * handing back the buffers emptied.
+ * Return the number of bytes copied.
+ */
+static size_t uring_copy_out(struct event_loop *l, struct uring_fd *f, char *buf, size_t len) {
+    size_t n = 0;
+    while (n < len && f->in_head >= 0) {
+        int bid = f->in_head;
+        struct uring_buf *b = &l->bufs[bid];
+        size_t take = b->len - b->off;
+        if (take > len - n) {
+            take = len - n;
+        }
+        memcpy(buf + n, l->buf_mem + (size_t) bid * LOOP_URING_BUF_SIZE + b->off, take);
+        b->off += take;
+        n += take;
+        if (b->off == b->len) {
+            f->in_head = b->next;
+            if (f->in_head < 0) {
+                f->in_tail = -1;
+            }
+            uring_recycle(l, bid);
+        }
+    }
+    f->in_bytes -= n;
+    return n;
+}
+
+static int uring_create(struct event_loop *l) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    // with SUBMIT_ALL, an entry the kernel refuses fails on its own
+    // rather than holding up those queued after it
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+    p.cq_entries = 4 * LOOP_URING_ENTRIES;
+    int fd = uring_setup(LOOP_URING_ENTRIES, &p);
+    if (fd < 0) {
+        return 1;
+    }
+    l->ring_fd = fd;
+    // waiting with a timeout needs the extended argument, and sendmsg
+    // headers must be copied by the time they are submitted
+    unsigned need = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG | IORING_FEAT_SUBMIT_STABLE;
+    if ((p.features & need) != need) {
+        uring_destroy(l);
+        return 1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    l->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    l->ring = mmap(NULL, l->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        fd, IORING_OFF_SQ_RING);
+    if (l->ring == MAP_FAILED) {
+        perror("mmap");
+        l->ring = NULL;
+        uring_destroy(l);
+        return 1;
+    }
+    l->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    l->sqes = mmap(NULL, l->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        fd, IORING_OFF_SQES);
+    if (l->sqes == MAP_FAILED) {
+        perror("mmap");
+        l->sqes = NULL;
+        uring_destroy(l);
+        return 1;
+    }
+
+    char *ring = l->ring;
+    l->sq_head = (unsigned *) (ring + p.sq_off.head);
+    l->sq_tail = (unsigned *) (ring + p.sq_off.tail);
+    l->sq_mask = (unsigned *) (ring + p.sq_off.ring_mask);
+    l->sq_array = (unsigned *) (ring + p.sq_off.array);
+    l->sq_entries = p.sq_entries;
+    l->sq_queued = *l->sq_tail;
+    l->cq_head = (unsigned *) (ring + p.cq_off.head);
+    l->cq_tail = (unsigned *) (ring + p.cq_off.tail);
+    l->cq_mask = (unsigned *) (ring + p.cq_off.ring_mask);
+    l->cqes = (struct io_uring_cqe *) (ring + p.cq_off.cqes);
+    l->features = p.features;
+
+    // every opcode used must be there; multishot recv came with
+    // synchronous cancellation, which fails with EINVAL before it
+    size_t probe_size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_size);
+    if (probe == NULL) {
+        perror("calloc");
+        uring_destroy(l);
+        return 1;
+    }
+    int ops[] = { IORING_OP_POLL_ADD, IORING_OP_POLL_REMOVE, IORING_OP_RECV, IORING_OP_SEND,
+        IORING_OP_SENDMSG, IORING_OP_ACCEPT };
+    int supported = uring_register(l, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+    for (int i = 0; supported && i < (int) (sizeof(ops) / sizeof(ops[0])); i++) {
+        supported = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    struct io_uring_sync_cancel_reg cancel;
+    memset(&cancel, 0, sizeof(cancel));
+    cancel.addr = UINT64_MAX;
+    if (!supported || (uring_register(l, IORING_REGISTER_SYNC_CANCEL, &cancel, 1) < 0 && errno != ENOENT)) {
+        uring_destroy(l);
+        return 1;
+    }
+
+    // the buffers to receive into, and the ring they are provided on
+    l->msgs = calloc(l->sq_entries, sizeof(struct uring_msg));
+    l->bufs = malloc(LOOP_URING_BUFS * sizeof(struct uring_buf));
+    l->buf_ring_size = LOOP_URING_BUFS * sizeof(struct io_uring_buf);
+    l->buf_ring = mmap(NULL, l->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    l->buf_mem_size = (size_t) LOOP_URING_BUFS * LOOP_URING_BUF_SIZE;
+    l->buf_mem = mmap(NULL, l->buf_mem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (l->buf_ring == MAP_FAILED) {
+        l->buf_ring = NULL;
+    }
+    if (l->buf_mem == MAP_FAILED) {
+        l->buf_mem = NULL;
+    }
+    if (l->msgs == NULL || l->bufs == NULL || l->buf_ring == NULL || l->buf_mem == NULL) {
+        perror("io_uring buffers");
+        uring_destroy(l);
+        return 1;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) l->buf_ring;
+    reg.ring_entries = LOOP_URING_BUFS;
+    reg.bgid = URING_BGID;
+    if (uring_register(l, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        uring_destroy(l);
+        return 1;
+    }
+    l->buf_tail = 0;
+    l->bufs_held = LOOP_URING_BUFS;
+    for (int bid = 0; bid < LOOP_URING_BUFS; bid++) {
+        uring_recycle(l, bid);
+    }
+    return 0;
+}
+
+static void uring_destroy(struct event_loop *l) {
+    // nothing in flight may be left using the callers' buffers
+    struct io_uring_sync_cancel_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+    reg.timeout.tv_sec = -1;
+    reg.timeout.tv_nsec = -1;
+    if (l->ring != NULL) {
+        uring_register(l, IORING_REGISTER_SYNC_CANCEL, &reg, 1);
+    }
+    for (int fd = 0; fd < l->num_fds; fd++) {
+        struct uring_fd *f = &l->fds[fd];
+        for (int i = 0; i < f->accepted_count; i++) {
+            close(f->accepted[f->accepted_head + i]);
+        }
+        free(f->accepted);
+    }
+    if (l->sqes != NULL) {
+        munmap(l->sqes, l->sqes_size);
+    }
+    if (l->ring != NULL) {
+        munmap(l->ring, l->ring_size);
+    }
+    close(l->ring_fd);
+    l->ring_fd = -1;
+    if (l->buf_ring != NULL) {
+        munmap(l->buf_ring, l->buf_ring_size);
+    }
+    if (l->buf_mem != NULL) {
+        munmap(l->buf_mem, l->buf_mem_size);
+    }
+    free(l->bufs);
+    free(l->msgs);
+    free(l->fds);
+    free(l->ready_fds);
+    free(l->starved_fds);
+}
+
+static int uring_wait_events(struct event_loop *l, struct loop_event *events, int max, int timeout_ms) {
+    uring_feed(l);
+    // changes queued since the last wait go in with this one, which
+    // only waits if there is nothing to report yet
+    int ready = l->num_ready > 0 || *l->cq_head != __atomic_load_n(l->cq_tail, __ATOMIC_ACQUIRE);
+    if (uring_enter(l, !ready && timeout_ms != 0, timeout_ms) < 0
+            && errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+        return -1;
+    }
+    uring_complete_all(l);
+
+    int n = 0;
+    int i;
+    for (i = 0; i < l->num_ready && n < max; i++) {
+        struct uring_fd *f = &l->fds[l->ready_fds[i]];
+        f->queued = 0;
+        if (f->ready != 0 && f->events != 0) {
+            events[n].data = f->data;
+            events[n].events = f->ready;
+            n++;
+        }
+        f->ready = 0;
+    }
+    // those not reported go first next time
+    l->num_ready -= i;
+    memmove(l->ready_fds, l->ready_fds + i, l->num_ready * sizeof(int));
+    return n;
+}
+
+/*
+ * Return what the attached loop knows of fd, if the loop reads or
+ * accepts from it itself, or NULL.
+ */
+static struct uring_fd *uring_socket(int fd) {
+    struct event_loop *l = attached;
+    if (l == NULL || l->backend != LOOP_URING || fd < 0 || fd >= l->num_fds) {
+        return NULL;
+    }
+    struct uring_fd *f = &l->fds[fd];
+    return (f->events & (LOOP_STREAM | LOOP_ACCEPT)) || f->detached ? f : NULL;
+}
+#endif
+
+static int select_set(struct event_loop *l, int fd, int events, void *data) {
+    if (fd < 0 || fd >= FD_SETSIZE) {
+        fprintf(stderr, "select: fd %d exceeds FD_SETSIZE\n", fd);
+        return 1;
+    }
+    l->interest[fd] = events;
+    l->data[fd] = data;
+    FD_CLR(fd, &l->read_fds);
+    FD_CLR(fd, &l->write_fds);
+    if (events & LOOP_READ) {
+        FD_SET(fd, &l->read_fds);
+    }
+    if (events & LOOP_WRITE) {
+        FD_SET(fd, &l->write_fds);
+    }
+    if (events && fd > l->max_fd) {
+        l->max_fd = fd;
+    }
+    // shrink max_fd past descriptors that are no longer watched
+    while (l->max_fd >= 0 && l->interest[l->max_fd] == 0) {
+        l->max_fd--;
+    }
+    return 0;
+}
+
+int loop_add(struct event_loop *l, int fd, int events, void *data) {
+#ifdef LOOP_HAVE_URING
+    if (l->backend == LOOP_URING) {
+        return uring_set(l, fd, events, data);
+    }
+#endif
+#ifdef __linux__
+    if (l->backend == LOOP_EPOLL) {
+        return epoll_ctl_events(l, EPOLL_CTL_ADD, fd, events, data);
+    }
+#endif
+    return select_set(l, fd, events, data);
+}
+
+int loop_mod(struct event_loop *l, int fd, int events, void *data) {
+#ifdef LOOP_HAVE_URING
+    if (l->backend == LOOP_URING) {
+        return uring_set(l, fd, events, data);
+    }
+#endif
+#ifdef __linux__
+    if (l->backend == LOOP_EPOLL) {
+        return epoll_ctl_events(l, EPOLL_CTL_MOD, fd, events, data);
+    }
+#endif
+    return select_set(l, fd, events, data);
+}
+
+int loop_del(struct event_loop *l, int fd) {
+#ifdef LOOP_HAVE_URING
+    if (l->backend == LOOP_URING) {
+        if (fd >= 0 && fd < l->num_fds
+                && ((l->fds[fd].events & (LOOP_STREAM | LOOP_ACCEPT)) || l->fds[fd].detached)) {
+            // what is in flight holds the socket open and may be using
+            // the caller's buffers, so it ends before the caller goes on
+            struct uring_fd *f = &l->fds[fd];
+            int r = f->recving || f->sending ? uring_cancel(l, fd, 0) : 0;
+            uring_reset(l, fd);
+            l->fd_freed = 1;
+            return r;
+        }
+        // the poll holds the socket open, so it goes now rather than with
+        // the next wait, for the close that follows to close it
+        if (uring_set(l, fd, 0, NULL) || uring_enter(l, 0, 0) < 0) {
+            perror("io_uring_enter");
+            return 1;
+        }
+        return 0;
+    }
+#endif
+#ifdef __linux__
+    if (l->backend == LOOP_EPOLL) {
+        metric_add(M_LOOP_SYSCALLS, 1);
+        if (epoll_ctl(l->epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+            perror("epoll_ctl");
+            return 1;
+        }
+        return 0;
+    }
+#endif
+    return select_set(l, fd, 0, NULL);
+}
+
+int loop_detach(struct event_loop *l, int fd) {
+#ifdef LOOP_HAVE_URING
+    if (l->backend == LOOP_URING && fd >= 0 && fd < l->num_fds
+            && (l->fds[fd].events & (LOOP_STREAM | LOOP_ACCEPT))) {
+        struct uring_fd *f = &l->fds[fd];
+        int r = f->recving || f->sending ? uring_cancel(l, fd, 0) : 0;
+        f->events = 0;
+        f->ready = 0;
+        f->detached = 1;
+        return r;
+    }
+#endif
+    return 0;
+}
+
+int loop_read_ahead(struct event_loop *l, int fd) {
+#ifdef LOOP_HAVE_URING
+    if (l->backend == LOOP_URING && fd >= 0 && fd < l->num_fds) {
+        return l->fds[fd].in_bytes;
+    }
+#endif
+    return 0;
+}
+
+#ifdef __linux__
+static int epoll_wait_events(struct event_loop *l, struct loop_event *events, int max, int timeout_ms) {
+    struct epoll_event ready[max];
+    metric_add(M_LOOP_SYSCALLS, 1);
+    int n = epoll_wait(l->epoll_fd, ready, max, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        events[i].data = ready[i].data.ptr;
+        events[i].events = 0;
+        if (ready[i].events & (EPOLLIN | EPOLLRDHUP)) {
+            events[i].events |= LOOP_READ;
+        }
+        if (ready[i].events & EPOLLOUT) {
+            events[i].events |= LOOP_WRITE;
+        }
+        if (ready[i].events & (EPOLLERR | EPOLLHUP)) {
+            events[i].events |= LOOP_ERROR;
+        }
+    }
+    return n;
+}
+#endif
+
+static int select_wait_events(struct event_loop *l, struct loop_event *events, int max, int timeout_ms) {
+    fd_set read_fds = l->read_fds;
+    fd_set write_fds = l->write_fds;
+    struct timeval tv;
+    struct timeval *timeout = NULL;
+    if (timeout_ms >= 0) {
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+        timeout = &tv;
+    }
+
+    metric_add(M_LOOP_SYSCALLS, 1);
+    int nready = select(l->max_fd + 1, &read_fds, &write_fds, NULL, timeout);
+    if (nready <= 0) {
+        return nready;
+    }
+
+    int n = 0;
+    for (int fd = 0; fd <= l->max_fd && n < max; fd++) {
+        int ev = 0;
+        if (FD_ISSET(fd, &read_fds)) {
+            ev |= LOOP_READ;
+        }
+        if (FD_ISSET(fd, &write_fds)) {
+            ev |= LOOP_WRITE;
+        }
+        if (ev) {
+            events[n].data = l->data[fd];
+            events[n].events = ev;
+            n++;
+        }
+    }
+    return n;
+}
+
+int loop_wait(struct event_loop *l, struct loop_event *events, int max, int timeout_ms) {
+#ifdef LOOP_HAVE_URING
+    if (l->backend == LOOP_URING) {
+        return uring_wait_events(l, events, max, timeout_ms);
+    }
+#endif
+#ifdef __linux__
+    if (l->backend == LOOP_EPOLL) {
+        return epoll_wait_events(l, events, max, timeout_ms);
+    }
+#endif
+    return select_wait_events(l, events, max, timeout_ms);
+}
+
+const char *loop_backend_name(struct event_loop *l) {
+    return l->backend == LOOP_URING ? "io_uring" : l->backend == LOOP_EPOLL ? "epoll" : "select";
+}
+
+void loop_attach(struct event_loop *l) {
+    attached = l;
+}
+
+int loop_accept(int fd) {
+#ifdef LOOP_HAVE_URING
+    struct uring_fd *f = uring_socket(fd);
+    if (f != NULL && f->accepted_count > 0) {
+        f->accepted_count--;
+        return f->accepted[f->accepted_head++];
+    }
+    if (f != NULL && f->recving) {
+        errno = EAGAIN;
+        return -1;
+    }
+#endif
+    metric_add(M_SOCKET_SYSCALLS, 1);
+    return accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
+ssize_t loop_read(int fd, void *buf, size_t len) {
+#ifdef LOOP_HAVE_URING
+    struct uring_fd *f = uring_socket(fd);
+    if (f != NULL && f->in_head >= 0) {
+        return uring_copy_out(attached, f, buf, len);
+    }
+    if (f != NULL && f->in_err != 0) {
+        errno = f->in_err;
+        return -1;
+    }
+    if (f != NULL && f->in_eof) {
+        return 0;
+    }
+    if (f != NULL && !f->detached) {
+        // more comes in with a completion, reported as LOOP_READ
+        errno = EAGAIN;
+        return -1;
+    }
+#endif
+    metric_add(M_SOCKET_SYSCALLS, 1);
+    return read(fd, buf, len);
+}
+
+ssize_t loop_writev(int fd, const struct iovec *iov, int iovcnt) {
+#ifdef LOOP_HAVE_URING
+    struct uring_fd *f = uring_socket(fd);
+    if (f != NULL && f->sent > 0 && f->sending == 0) {
+        ssize_t sent = f->sent;
+        f->sent = 0;
+        return sent;
+    }
+    if (f != NULL && f->send_err != 0) {
+        errno = f->send_err;
+        return -1;
+    }
+    if (f != NULL && !f->detached) {
+        if (f->sending == 0 && iovcnt > 0 && uring_send(attached, fd, iov, iovcnt)) {
+            return -1;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+#endif
+    metric_add(M_SOCKET_SYSCALLS, 1);
+    return writev(fd, iov, iovcnt);
+}
@@ -0,0 +1,172 @@
+#ifndef LOOP_H
+#define LOOP_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Event loop backends.
+ */
+#define LOOP_SELECT 0   // portable, limited to FD_SETSIZE descriptors
+#define LOOP_EPOLL 1    // edge-triggered, cost per wakeup is O(ready fds)
+#define LOOP_URING 2    // io_uring: sockets are accepted, read and written
+                        // through the ring, other descriptors polled
+
+#ifdef __linux__
+    #define LOOP_DEFAULT LOOP_EPOLL
+#else
+    #define LOOP_DEFAULT LOOP_SELECT
+#endif
+
+// Submission queue entries of an io_uring loop. Changes queued beyond
+// this are submitted early.
+#ifndef LOOP_URING_ENTRIES
+    #define LOOP_URING_ENTRIES 1024
+#endif
+
+// Buffers an io_uring loop provides the kernel to receive into, shared
+// by all of its sockets; a power of two, at most 32768.
+#ifndef LOOP_URING_BUFS
+    #define LOOP_URING_BUFS 1024
+#endif
+#ifndef LOOP_URING_BUF_SIZE
+    #define LOOP_URING_BUF_SIZE 2048
+#endif
+
+// Most buffers gathered into one send by an io_uring loop; a longer
+// write goes in several, linked so they are sent in order.
+#ifndef LOOP_URING_IOV
+    #define LOOP_URING_IOV 8
+#endif
+
+/*
+ * Event flags, used both to register interest and to report readiness.
+ */
+#define LOOP_READ 1
+#define LOOP_WRITE 2
+#define LOOP_ERROR 4    // error or hangup; only ever reported
+#define LOOP_STREAM 8   // only registered: a connected socket, read with
+                        // loop_read() and written with loop_writev()
+#define LOOP_ACCEPT 16  // only registered: a listening socket, accepted
+                        // from with loop_accept()
+
+/*
+ * A ready file descriptor, identified by the data pointer it was
+ * registered with.
+ */
+struct loop_event {
+    void *data;
+    int events;
+};
+
+struct event_loop;
+
+/*
+ * Create an event loop using the given backend. A kernel without the
+ * io_uring support LOOP_URING needs gets an epoll loop instead.
+ * Return NULL on error.
+ */
+struct event_loop *loop_create(int backend);
+
+/*
+ * Release the loop. Registered descriptors are not closed.
+ */
+void loop_destroy(struct event_loop *l);
+
+/*
+ * Register fd for the given events, reporting them with data.
+ * Readiness is edge-triggered: after an event, the caller must read
+ * (or write) until the call would block before it is reported again.
+ * The select backend reports level-triggered, which callers that
+ * drain their sockets cannot tell apart.
+ *
+ * Return 0 on success, 1 on error.
+ */
+int loop_add(struct event_loop *l, int fd, int events, void *data);
+
+/*
+ * Change the events and data registered for fd, or watch it again
+ * after loop_detach(). With io_uring the change takes effect at the
+ * next loop_wait().
+ * Return 0 on success, 1 on error.
+ */
+int loop_mod(struct event_loop *l, int fd, int events, void *data);
+
+/*
+ * Stop watching fd. Must be called before fd is closed. With io_uring,
+ * whatever was read ahead from it is dropped, and sends still in flight
+ * are cancelled.
+ * Return 0 on success, 1 on error.
+ */
+int loop_del(struct event_loop *l, int fd);
+
+/*
+ * Stop watching the LOOP_STREAM or LOOP_ACCEPT socket fd, to have the
+ * last of its output sent, or to hand it over, before loop_del(). With
+ * io_uring, the requests in flight on it are cancelled and waited for.
+ * The connections accepted and input read ahead of the caller are still
+ * handed out, and the bytes sent still counted, by loop_accept(),
+ * loop_read() and loop_writev(), which then go to fd itself. Other
+ * backends hold nothing back, and carry on watching fd.
+ * Return 0 on success, 1 on error.
+ */
+int loop_detach(struct event_loop *l, int fd);
+
+/*
+ * Return how many bytes the loop has read from fd that loop_read() has
+ * not yet handed out. Always 0 unless the loop uses io_uring.
+ */
+int loop_read_ahead(struct event_loop *l, int fd);
+
+/*
+ * Wait up to timeout_ms milliseconds (forever if negative) for events,
+ * storing at most max of them in events.
+ *
+ * Return the number of events stored, or -1 on error (errno is set;
+ * EINTR means a signal arrived).
+ */
+int loop_wait(struct event_loop *l, struct loop_event *events, int max, int timeout_ms);
+
+/*
+ * Return a human-readable name for the loop's backend.
+ */
+const char *loop_backend_name(struct event_loop *l);
+
+/*
+ * Make l the loop that loop_accept(), loop_read() and loop_writev()
+ * use on the calling thread, or none if NULL. Without one, they are
+ * just the system calls.
+ */
+void loop_attach(struct event_loop *l);
+
+/*
+ * Accept a connection on listening socket fd, like accept4() with
+ * SOCK_NONBLOCK and SOCK_CLOEXEC. With io_uring, connections to a
+ * LOOP_ACCEPT socket are accepted ahead, and LOOP_READ reported once
+ * there are some to hand out.
+ * Return the new socket, or -1 with errno set; EAGAIN means there are
+ * none for now.
+ */
+int loop_accept(int fd);
+
+/*
+ * Read up to len bytes from socket fd, like read(). With io_uring, a
+ * LOOP_STREAM socket is read ahead into buffers provided to the kernel,
+ * LOOP_READ reported as input arrives in them, and this copies it out.
+ * Return as read() does.
+ */
+ssize_t loop_read(int fd, void *buf, size_t len);
+
+/*
+ * Write iovcnt buffers to socket fd, like writev(). With io_uring, the
+ * bytes of a LOOP_STREAM socket are sent from the caller's buffers in
+ * the background: this returns -1 with EAGAIN while they are, and
+ * LOOP_WRITE is reported when they are done. The call is then made
+ * again, with the same buffers still first, and returns how many bytes
+ * went. The buffers must be left alone until then, or until fd is
+ * detached or removed.
+ * Return as writev() does.
+ */
+ssize_t loop_writev(int fd, const struct iovec *iov, int iovcnt);
+
+#endif
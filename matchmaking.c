@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "client.h"
+#include "matchmaking.h"
+
+void mm_init(struct matchmaker *mm, int num_buckets) {
+    memset(mm, 0, sizeof(struct matchmaker));
+    if (num_buckets < 1) {
+        num_buckets = 1;
+    } else if (num_buckets > MM_MAX_BUCKETS) {
+        num_buckets = MM_MAX_BUCKETS;
+    }
+    mm->num_buckets = num_buckets;
+}
+
+/*
+ * Return the bucket client c belongs in. Buckets are centred on
+ * RATING_START, and the lowest and highest take every rating beyond them.
+ */
+static int bucket_of(struct matchmaker *mm, struct client_sock *c) {
+    int b = (c->rating - RATING_START) / MM_BUCKET_WIDTH + mm->num_buckets / 2;
+    if (b < 0) {
+        return 0;
+    } else if (b >= mm->num_buckets) {
+        return mm->num_buckets - 1;
+    }
+    return b;
+}
+
+void mm_enqueue(struct matchmaker *mm, struct client_sock *c) {
+    struct mm_queue *q = &mm->buckets[bucket_of(mm, c)];
+    c->bucket = q - mm->buckets;
+    c->queue_next = NULL;
+    c->queue_prev = q->tail;
+    if (q->tail != NULL) {
+        q->tail->queue_next = c;
+    } else {
+        q->head = c;
+    }
+    q->tail = c;
+    q->len++;
+    mm->waiting++;
+}
+
+void mm_remove(struct matchmaker *mm, struct client_sock *c) {
+    if (c->bucket < 0) {
+        return;
+    }
+    struct mm_queue *q = &mm->buckets[c->bucket];
+    if (c->queue_prev != NULL) {
+        c->queue_prev->queue_next = c->queue_next;
+    } else {
+        q->head = c->queue_next;
+    }
+    if (c->queue_next != NULL) {
+        c->queue_next->queue_prev = c->queue_prev;
+    } else {
+        q->tail = c->queue_prev;
+    }
+    c->queue_prev = NULL;
+    c->queue_next = NULL;
+    c->bucket = -1;
+    q->len--;
+    mm->waiting--;
+}
+
+/*
+ * Return 1 if c played against the client with id within its last
+ * RECENT_OPPONENTS matches.
+ */
+static int played_recently(struct client_sock *c, unsigned long id) {
+    for (int i = 0; i < RECENT_OPPONENTS; i++) {
+        if (c->recent[i] == id) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static unsigned long last_opponent(struct client_sock *c) {
+    return c->recent[(c->recent_next + RECENT_OPPONENTS - 1) % RECENT_OPPONENTS];
+}
+
+static void add_recent(struct client_sock *c, unsigned long id) {
+    c->recent[c->recent_next] = id;
+    c->recent_next = (c->recent_next + 1) % RECENT_OPPONENTS;
+}
+
+/*
+ * Pick an opponent for c among the first MM_SCAN queued players from
+ * start on. Prefer one c has not played recently, but settle for any
+ * but its very last opponent.
+ *
+ * Return NULL if there is none.
+ */
+static struct client_sock *pick_opponent(struct client_sock *c, struct client_sock *start) {
+    struct client_sock *fallback = NULL;
+    struct client_sock *i = start;
+    for (int n = 0; i != NULL && n < MM_SCAN; n++, i = i->queue_next) {
+        if (!played_recently(c, i->id)) {
+            return i;
+        }
+        if (fallback == NULL && last_opponent(c) != i->id && last_opponent(i) != c->id) {
+            fallback = i;
+        }
+    }
+    return fallback;
+}
+
+static void pair(struct matchmaker *mm, struct client_sock *a, struct client_sock *b,
+        struct client_sock **p1, struct client_sock **p2) {
+    mm_remove(mm, a);
+    mm_remove(mm, b);
+    add_recent(a, b->id);
+    add_recent(b, a->id);
+    *p1 = a;
+    *p2 = b;
+}
+
+int mm_next_pair(struct matchmaker *mm, struct client_sock **p1, struct client_sock **p2) {
+    if (mm->waiting < 2) {
+        return 0;
+    }
+
+    // First pair players of similar skill
+    for (int b = 0; b < mm->num_buckets; b++) {
+        struct client_sock *head = mm->buckets[b].head;
+        if (head == NULL) {
+            continue;
+        }
+        struct client_sock *opponent = pick_opponent(head, head->queue_next);
+        if (opponent != NULL) {
+            pair(mm, head, opponent, p1, p2);
+            return 1;
+        }
+    }
+
+    // Then let players without a match in their bucket reach up to the
+    // next bucket that has anyone waiting
+    int lower = -1;
+    for (int b = 0; b < mm->num_buckets; b++) {
+        struct client_sock *head = mm->buckets[b].head;
+        if (head == NULL) {
+            continue;
+        }
+        if (lower >= 0) {
+            struct client_sock *opponent = pick_opponent(mm->buckets[lower].head, head);
+            if (opponent != NULL) {
+                pair(mm, mm->buckets[lower].head, opponent, p1, p2);
+                return 1;
+            }
+        }
+        lower = b;
+    }
+    return 0;
+}
+
+void mm_record_result(struct client_sock *winner, struct client_sock *loser) {
+    winner->rating += RATING_STEP;
+    loser->rating -= RATING_STEP;
+}
@@ -0,0 +1,81 @@
+#ifndef MATCHMAKING_H
+#define MATCHMAKING_H
+
+#include "client.h"
+
+#ifndef MM_MAX_BUCKETS
+    #define MM_MAX_BUCKETS 8
+#endif
+
+// How many players behind the head of a queue are considered as its
+// opponent. Bounds the cost of pairing regardless of queue length.
+#ifndef MM_SCAN
+    #define MM_SCAN 8
+#endif
+
+// Rating every player starts with, and how much a win or loss moves it.
+#ifndef RATING_START
+    #define RATING_START 1000
+#endif
+
+#ifndef RATING_STEP
+    #define RATING_STEP 25
+#endif
+
+// Width of the rating range covered by each skill bucket.
+#ifndef MM_BUCKET_WIDTH
+    #define MM_BUCKET_WIDTH 100
+#endif
+
+/*
+ * FIFO of waiting players, linked through their queue_prev/queue_next.
+ */
+struct mm_queue {
+    struct client_sock *head;
+    struct client_sock *tail;
+    int len;
+};
+
+/*
+ * Players waiting in the lobby for an opponent. With skill buckets,
+ * players are queued by rating and paired within their bucket first.
+ */
+struct matchmaker {
+    struct mm_queue buckets[MM_MAX_BUCKETS];
+    int num_buckets;
+    int waiting;    // total number of queued players
+};
+
+/*
+ * Initialize an empty matchmaker with num_buckets skill buckets
+ * (1 to MM_MAX_BUCKETS; 1 disables skill matching).
+ */
+void mm_init(struct matchmaker *mm, int num_buckets);
+
+/*
+ * Put client c at the back of its queue. c must not already be queued.
+ */
+void mm_enqueue(struct matchmaker *mm, struct client_sock *c);
+
+/*
+ * Take client c out of the queue, if it is queued. O(1).
+ */
+void mm_remove(struct matchmaker *mm, struct client_sock *c);
+
+/*
+ * Dequeue the next two players to be paired. The player who has waited
+ * longest is paired with the next player in the same bucket who is not
+ * among its recent opponents. A player is never paired with its last
+ * opponent twice in a row. Players left without an opponent in their
+ * bucket are paired with those in the next non-empty bucket up.
+ *
+ * Return 1 and set *p1 and *p2 if a pair was found, 0 otherwise.
+ */
+int mm_next_pair(struct matchmaker *mm, struct client_sock **p1, struct client_sock **p2);
+
+/*
+ * Update the ratings of the players of a finished match.
+ */
+void mm_record_result(struct client_sock *winner, struct client_sock *loser);
+
+#endif
@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+
+__thread struct metrics *thread_metrics = NULL;
+
+static struct metrics *all_metrics = NULL;
+static int num_metrics = 0;
+
+static int admin_fd = -1;
+static int admin_stop_fd = -1;
+static char admin_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+static pthread_t admin_thread;
+
+static const char *metric_names[NUM_METRICS] = {
+    "battle_connections_accepted_total",
+    "battle_connections_rejected_total",
+    "battle_connections_active",
+    "battle_logins_total",
+    "battle_matches_started_total",
+    "battle_matches_finished_total",
+    "battle_matches_active",
+    "battle_turns_total",
+    "battle_login_timeouts_total",
+    "battle_idle_timeouts_total",
+    "battle_turn_timeouts_total",
+    "battle_bytes_in_total",
+    "battle_bytes_out_total",
+    "battle_loop_iterations_total",
+    "battle_loop_syscalls_total",
+    "battle_socket_syscalls_total",
+    "battle_journal_bytes_total",
+    "battle_journal_dropped_records_total",
+    "battle_spectators",
+    "battle_spectator_updates_coalesced_total",
+    "battle_lobby_members",
+    "battle_lobby_messages_total",
+    "battle_lobby_messages_dropped_total",
+    "battle_players_added_total",
+    "battle_players_not_stored_total",
+    "battle_tourney_players",
+    "battle_tourney_bouts_total",
+    "battle_tourneys_finished_total",
+    "battle_clients_migrated_total",
+    "battle_connection_memory_bytes",
+    "battle_buffer_pool_bytes",
+    "battle_clients_throttled",
+    "battle_client_throttles_total",
+    "battle_flood_disconnects_total",
+};
+
+static const int metric_is_gauge[NUM_METRICS] = {
+    [M_CONNECTIONS_ACTIVE] = 1,
+    [M_MATCHES_ACTIVE] = 1,
+    [M_SPECTATORS] = 1,
+    [M_LOBBY_MEMBERS] = 1,
+    [M_TOURNEY_PLAYERS] = 1,
+    [M_CONNECTION_BYTES] = 1,
+    [M_POOL_BYTES] = 1,
+    [M_THROTTLED] = 1,
+};
+
+static const char *hist_names[NUM_HISTOGRAMS] = {
+    "battle_loop_iteration_seconds",
+    "battle_turn_seconds",
+};
+
+int metrics_init(int num_workers) {
+    all_metrics = aligned_alloc(64, num_workers * sizeof(struct metrics));
+    if (all_metrics == NULL) {
+        perror("aligned_alloc");
+        return 1;
+    }
+    memset(all_metrics, 0, num_workers * sizeof(struct metrics));
+    num_metrics = num_workers;
+    return 0;
+}
+
+void metrics_attach(int worker) {
+    thread_metrics = &all_metrics[worker];
+}
+
+/*
+ * Return the histogram bucket of value: values below HIST_SUB_BUCKETS
+ * get a bucket each, larger ones share one per sub-bucket of their
+ * power of two.
+ */
+static int hist_index(unsigned long value) {
+    if (value < HIST_SUB_BUCKETS) {
+        return value;
+    }
+    int exp = 63 - __builtin_clzl(value);
+    int sub = (value >> (exp - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1);
+    return (exp - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + sub;
+}
+
+/*
+ * Return the smallest value that falls in bucket i.
+ */
+static unsigned long hist_lower(int i) {
+    if (i < HIST_SUB_BUCKETS) {
+        return i;
+    }
+    int exp = i / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+    unsigned long sub = i % HIST_SUB_BUCKETS;
+    return (HIST_SUB_BUCKETS + sub) << (exp - HIST_SUB_BITS);
+}
+
+void hist_record(enum histogram h, unsigned long value) {
+    if (thread_metrics == NULL) {
+        return;
+    }
+    struct hist *hist = &thread_metrics->hists[h];
+    atomic_fetch_add_explicit(&hist->counts[hist_index(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->sum, value, memory_order_relaxed);
+    // only this thread writes max, so a plain compare is enough
+    if (value > atomic_load_explicit(&hist->max, memory_order_relaxed)) {
+        atomic_store_explicit(&hist->max, value, memory_order_relaxed);
+    }
+}
+
+unsigned long metrics_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+int metrics_write(int fd) {
+    FILE *out = fdopen(dup(fd), "w");
+    if (out == NULL) {
+        perror("fdopen");
+        return 1;
+    }
+
+    long totals[NUM_METRICS];
+    for (int m = 0; m < NUM_METRICS; m++) {
+        long total = 0;
+        for (int w = 0; w < num_metrics; w++) {
+            total += atomic_load_explicit(&all_metrics[w].values[m], memory_order_relaxed);
+        }
+        totals[m] = total;
+        fprintf(out, "# TYPE %s %s\n%s %ld\n", metric_names[m],
+            metric_is_gauge[m] ? "gauge" : "counter", metric_names[m], total);
+    }
+    long connections = totals[M_CONNECTIONS_ACTIVE];
+    fprintf(out, "# TYPE battle_bytes_per_connection gauge\nbattle_bytes_per_connection %ld\n",
+        connections > 0 ? totals[M_CONNECTION_BYTES] / connections : 0);
+
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    static unsigned long counts[HIST_BUCKETS];
+    for (int h = 0; h < NUM_HISTOGRAMS; h++) {
+        unsigned long count = 0, sum = 0, max = 0;
+        memset(counts, 0, sizeof(counts));
+        for (int w = 0; w < num_metrics; w++) {
+            struct hist *hist = &all_metrics[w].hists[h];
+            for (int i = 0; i < HIST_BUCKETS; i++) {
+                unsigned long c = atomic_load_explicit(&hist->counts[i], memory_order_relaxed);
+                counts[i] += c;
+                count += c;
+            }
+            sum += atomic_load_explicit(&hist->sum, memory_order_relaxed);
+            unsigned long hmax = atomic_load_explicit(&hist->max, memory_order_relaxed);
+            if (hmax > max) {
+                max = hmax;
+            }
+        }
+
+        fprintf(out, "# TYPE %s summary\n", hist_names[h]);
+        int i = 0;
+        unsigned long seen = 0;
+        for (int q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+            unsigned long rank = (unsigned long) (quantiles[q] * count);
+            while (i < HIST_BUCKETS - 1 && seen + counts[i] <= rank) {
+                seen += counts[i];
+                i++;
+            }
+            double value = count ? hist_lower(i) / 1e9 : 0;
+            fprintf(out, "%s{quantile=\"%g\"} %.9f\n", hist_names[h], quantiles[q], value);
+        }
+        fprintf(out, "%s_sum %.9f\n%s_count %lu\n%s_max %.9f\n", hist_names[h], sum / 1e9,
+            hist_names[h], count, hist_names[h], max / 1e9);
+    }
+
+    int err = ferror(out);
+    if (fclose(out) != 0 || err) {
+        return 1;
+    }
+    return 0;
+}
+
+static void *run_admin(void *arg) {
+    struct pollfd fds[2];
+    fds[0].fd = admin_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = admin_stop_fd;
+    fds[1].events = POLLIN;
+
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("admin: poll");
+            break;
+        }
+        if (fds[1].revents) {
+            break;
+        }
+        int client_fd = accept(admin_fd, NULL, NULL);
+        if (client_fd < 0) {
+            continue;
+        }
+        metrics_write(client_fd);
+        close(client_fd);
+    }
+    return NULL;
+}
+
+int metrics_serve(const char *path, int stop_fd) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "admin socket path too long: %s\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    strcpy(admin_path, path);
+
+    admin_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (admin_fd < 0) {
+        perror("admin socket");
+        return 1;
+    }
+    // a stale socket file from an earlier run would make bind fail
+    unlink(path);
+    if (bind(admin_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(admin_fd, 16) < 0) {
+        perror("admin: bind");
+        close(admin_fd);
+        admin_fd = -1;
+        return 1;
+    }
+
+    admin_stop_fd = stop_fd;
+    int err = pthread_create(&admin_thread, NULL, run_admin, NULL);
+    if (err != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        close(admin_fd);
+        admin_fd = -1;
+        return 1;
+    }
+    return 0;
+}
+
+void metrics_shutdown() {
+    if (admin_fd >= 0) {
+        pthread_join(admin_thread, NULL);
+        close(admin_fd);
+        unlink(admin_path);
+        admin_fd = -1;
+    }
+    free(all_metrics);
+    all_metrics = NULL;
+    num_metrics = 0;
+}
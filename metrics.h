@@ -0,0 +1,132 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+
+/*
+ * Counters and gauges. Gauges go up and down; counters only go up.
+ */
+enum metric {
+    M_CONNECTIONS_ACCEPTED,
+    M_CONNECTIONS_REJECTED,
+    M_CONNECTIONS_ACTIVE,       // gauge
+    M_LOGINS,
+    M_MATCHES_STARTED,
+    M_MATCHES_FINISHED,
+    M_MATCHES_ACTIVE,           // gauge
+    M_TURNS,
+    M_LOGIN_TIMEOUTS,
+    M_IDLE_TIMEOUTS,
+    M_TURN_TIMEOUTS,
+    M_BYTES_IN,
+    M_BYTES_OUT,
+    M_LOOP_ITERATIONS,
+    M_LOOP_SYSCALLS,            // made by the event loop itself, not reads and writes
+    M_SOCKET_SYSCALLS,          // reads, writes and accepts made on sockets directly
+    M_JOURNAL_BYTES,
+    M_JOURNAL_DROPPED,
+    M_SPECTATORS,               // gauge
+    M_SPECTATOR_COALESCED,
+    M_LOBBY_MEMBERS,            // gauge
+    M_LOBBY_MESSAGES,
+    M_LOBBY_DROPPED,
+    M_PLAYERS_ADDED,
+    M_PLAYERS_NOT_STORED,
+    M_TOURNEY_PLAYERS,          // gauge: registered, or still in the running
+    M_TOURNEY_BOUTS,            // played, not decided by walkover
+    M_TOURNEYS_FINISHED,
+    M_CLIENTS_MIGRATED,         // moved to another worker
+    M_CONNECTION_BYTES,         // gauge: client structs, names and buffers in use
+    M_POOL_BYTES,               // gauge: free buffers kept for reuse
+    M_THROTTLED,                // gauge: clients not read from for going over their rate limits
+    M_THROTTLES,
+    M_FLOOD_DISCONNECTS,        // dropped for going over their limits too often
+    NUM_METRICS
+};
+
+/*
+ * Latency histograms, in nanoseconds.
+ */
+enum histogram {
+    H_LOOP_ITERATION,   // handling one batch of events, up to the flush
+    H_TURN,             // handling one line of input from a player
+    NUM_HISTOGRAMS
+};
+
+// Each power of two is split into HIST_SUB_BUCKETS linear buckets, so a
+// recorded value is off by at most 1/HIST_SUB_BUCKETS of itself.
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB_BUCKETS)
+
+struct hist {
+    atomic_ulong counts[HIST_BUCKETS];
+    atomic_ulong sum;
+    atomic_ulong max;
+};
+
+/*
+ * Metrics of one worker. Only the owning worker ever writes them, so
+ * updates are uncontended relaxed atomics; readers sum every worker's.
+ */
+struct metrics {
+    atomic_long values[NUM_METRICS];
+    struct hist hists[NUM_HISTOGRAMS];
+} __attribute__((aligned(64)));
+
+/*
+ * Metrics of the calling worker thread. Set by metrics_attach().
+ */
+extern __thread struct metrics *thread_metrics;
+
+/*
+ * Allocate metrics for num_workers workers.
+ * Return 0 on success, 1 on error.
+ */
+int metrics_init(int num_workers);
+
+/*
+ * Make worker's metrics those the calling thread updates.
+ */
+void metrics_attach(int worker);
+
+/*
+ * Add n to a counter or gauge of the calling thread.
+ */
+static inline void metric_add(enum metric m, long n) {
+    if (thread_metrics != NULL) {
+        atomic_fetch_add_explicit(&thread_metrics->values[m], n, memory_order_relaxed);
+    }
+}
+
+/*
+ * Record a value in a histogram of the calling thread.
+ */
+void hist_record(enum histogram h, unsigned long value);
+
+/*
+ * Return the current time in nanoseconds, for timing histogram values.
+ */
+unsigned long metrics_now();
+
+/*
+ * Write every metric, summed over all workers, to fd in the Prometheus
+ * text format. Return 0 on success, 1 on error.
+ */
+int metrics_write(int fd);
+
+/*
+ * Start a thread serving metrics on a Unix-domain socket at path: each
+ * connection gets one snapshot and is closed. The thread stops when
+ * stop_fd becomes readable.
+ *
+ * Return 0 on success, 1 on error.
+ */
+int metrics_serve(const char *path, int stop_fd);
+
+/*
+ * Stop the admin thread, if any, and free all metrics.
+ */
+void metrics_shutdown();
+
+#endif
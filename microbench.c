@@ -0,0 +1,599 @@
+/*
+ * Microbenchmarks for the framing and I/O helpers.
+ *
+ * Each benchmark runs one helper over a corpus of messages drawn from a
+ * fixed-seed distribution like the server's traffic: mostly one-letter
+ * moves, then chat, names and the odd line near the size limit. Socket
+ * benchmarks go over a socketpair and deliver the stream in fragments
+ * the way TCP does: usually a line at a time, sometimes two lines at
+ * once or a line cut in two.
+ *
+ * Every benchmark is sized to run for about -t milliseconds a round and
+ * run -r rounds; the median round is reported, one line per benchmark:
+ *
+ *     name  ops  ns/op  MB/s  B/op  allocs/op
+ *
+ * MB/s counts message bytes handled; B/op and allocs/op count memory
+ * allocated through malloc and friends, which the makefile wraps. Saved
+ * output can be given back with -c to compare a later run against it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "helpers.h"
+#include "client.h"
+#include "rng.h"
+
+#define CORPUS_SIZE 4096
+#define CORPUS_SEED 0x62656e6368ULL     // "bench"
+
+// Writes to a socketpair before the benchmark drains it. Each small
+// write takes a kernel buffer of its own, charged in full to the socket.
+#define DRAIN_EVERY 64
+
+// Differences in ns/op within this many percent are reported as noise.
+#define NOISE_PERCENT 3.0
+
+/*
+ * Allocation counts, kept by the wrappers below.
+ */
+static long alloc_count;
+static long alloc_bytes;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    alloc_count++;
+    alloc_bytes += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+    alloc_count++;
+    alloc_bytes += nmemb * size;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    alloc_count++;
+    alloc_bytes += size;
+    return __real_realloc(ptr, size);
+}
+
+/*
+ * A message of the corpus, with its network newline.
+ */
+struct message {
+    char text[BUF_SIZE];
+    int len;
+};
+
+static struct message corpus[CORPUS_SIZE];
+
+/*
+ * The corpus laid end to end, and where the stream is cut into the
+ * fragments a reader sees.
+ */
+static char *stream;
+static int stream_len;
+static int *cuts;
+static int num_cuts;
+
+/*
+ * The running benchmark's timer and counters. A benchmark sets up what
+ * it needs, starts the timer, runs its ops and stops the timer before
+ * cleaning up, so only the ops are measured.
+ */
+static long long timer_start_ns;
+static long long timer_ns;
+static long timer_allocs;
+static long timer_alloc_bytes;
+static long bench_bytes;
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void timer_start() {
+    timer_allocs = alloc_count;
+    timer_alloc_bytes = alloc_bytes;
+    timer_start_ns = now_ns();
+}
+
+static void timer_stop() {
+    timer_ns = now_ns() - timer_start_ns;
+    timer_allocs = alloc_count - timer_allocs;
+    timer_alloc_bytes = alloc_bytes - timer_alloc_bytes;
+}
+
+/*
+ * Fill the corpus. Lengths follow the mix of lines players send: 60%
+ * moves, 25% chat, 10% names and 5% long lines near MAX_USER_MSG.
+ */
+static void make_corpus() {
+    struct rng r;
+    rng_seed(&r, CORPUS_SEED);
+    for (int i = 0; i < CORPUS_SIZE; i++) {
+        int kind = rng_below(&r, 100);
+        int len;
+        if (kind < 60) {
+            len = 1;
+        } else if (kind < 85) {
+            len = 10 + rng_below(&r, 51);
+        } else if (kind < 95) {
+            len = 3 + rng_below(&r, MAX_NAME - 2);
+        } else {
+            len = MAX_USER_MSG - 28 + rng_below(&r, 27);
+        }
+        struct message *m = &corpus[i];
+        for (int j = 0; j < len; j++) {
+            m->text[j] = len == 1 ? "aphs"[rng_below(&r, 4)] : 'a' + rng_below(&r, 26);
+        }
+        m->text[len] = '\r';
+        m->text[len + 1] = '\n';
+        m->len = len + 2;
+        stream_len += m->len;
+    }
+
+    // 80% of fragments are one line, 10% two lines, 10% end inside a line
+    stream = malloc(stream_len);
+    cuts = malloc((2 * CORPUS_SIZE + 1) * sizeof(int));
+    int pos = 0;
+    for (int i = 0; i < CORPUS_SIZE; i++) {
+        memcpy(stream + pos, corpus[i].text, corpus[i].len);
+        pos += corpus[i].len;
+    }
+    pos = 0;
+    int line = 0;
+    while (line < CORPUS_SIZE) {
+        int kind = rng_below(&r, 10);
+        if (kind == 8 && line + 1 < CORPUS_SIZE) {
+            pos += corpus[line].len + corpus[line + 1].len;
+            line += 2;
+        } else if (kind == 9 && corpus[line].len > 2) {
+            cuts[num_cuts++] = pos + 1 + rng_below(&r, corpus[line].len - 1);
+            pos += corpus[line].len;
+            line++;
+        } else {
+            pos += corpus[line].len;
+            line++;
+        }
+        cuts[num_cuts++] = pos;
+    }
+}
+
+static void make_socketpair(int sv[2]) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+    if (set_nonblocking(sv[0]) || set_nonblocking(sv[1])) {
+        exit(1);
+    }
+}
+
+static void drain(int fd) {
+    char buf[65536];
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+}
+
+/*
+ * Search single lines for their network newline.
+ */
+static void bench_find_network_newline(long n) {
+    long found = 0;
+    bench_bytes = 0;
+    timer_start();
+    for (long i = 0; i < n; i++) {
+        struct message *m = &corpus[i % CORPUS_SIZE];
+        found += find_network_newline(m->text, m->len);
+        bench_bytes += m->len;
+    }
+    timer_stop();
+    if (found == 0) {
+        fprintf(stderr, "find_network_newline found nothing\n");
+    }
+}
+
+/*
+ * Search lines that have not been terminated yet, as a partial read
+ * leaves them.
+ */
+static void bench_find_network_newline_partial(long n) {
+    long missing = 0;
+    bench_bytes = 0;
+    timer_start();
+    for (long i = 0; i < n; i++) {
+        struct message *m = &corpus[i % CORPUS_SIZE];
+        missing += find_network_newline(m->text, m->len - 2) == -1;
+        bench_bytes += m->len - 2;
+    }
+    timer_stop();
+    if (missing != n) {
+        fprintf(stderr, "find_network_newline found a newline in a partial line\n");
+    }
+}
+
+/*
+ * Take lines one by one out of a buffer filled with as many as fit,
+ * refilling it when it runs dry.
+ */
+static void bench_get_message(long n) {
+    char buf[BUF_SIZE];
+    int inbuf = 0;
+    int next = 0;
+    bench_bytes = 0;
+    timer_start();
+    for (long i = 0; i < n; i++) {
+        while (inbuf + corpus[next].len < BUF_SIZE) {
+            memcpy(buf + inbuf, corpus[next].text, corpus[next].len);
+            inbuf += corpus[next].len;
+            next = (next + 1) % CORPUS_SIZE;
+        }
+        char *msg;
+        if (get_message(&msg, buf, &inbuf) != 0) {
+            fprintf(stderr, "get_message found no line\n");
+            exit(1);
+        }
+        bench_bytes += strlen(msg) + 2;
+        free(msg);
+    }
+    timer_stop();
+}
+
+/*
+ * Deliver the stream over a socketpair, fragment by fragment, reading
+ * each with read_from_socket() and taking out the lines it completes.
+ * An op is a line; the time includes the write() that sends it.
+ */
+static void bench_read_from_socket(long n) {
+    int sv[2];
+    make_socketpair(sv);
+    char buf[BUF_SIZE];
+    int inbuf = 0;
+    int cut = 0;
+    int pos = 0;
+    long lines = 0;
+    bench_bytes = 0;
+    timer_start();
+    while (lines < n) {
+        int end = cuts[cut];
+        if (write(sv[1], stream + pos, end - pos) != end - pos) {
+            perror("write");
+            exit(1);
+        }
+        bench_bytes += end - pos;
+        pos = end;
+        if (++cut == num_cuts) {
+            cut = 0;
+            pos = 0;
+        }
+
+        int r;
+        while ((r = read_from_socket(sv[0], buf, &inbuf)) == 0 || r == 2) {
+            int location;
+            while ((location = find_network_newline(buf, inbuf)) != -1) {
+                memmove(buf, buf + location, inbuf - location);
+                inbuf -= location;
+                lines++;
+            }
+        }
+        if (r != 3) {
+            fprintf(stderr, "read_from_socket returned %d\n", r);
+            exit(1);
+        }
+    }
+    timer_stop();
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/*
+ * The same, through read_to_line_buf() and next_line_view(), which the
+ * server reads with.
+ */
+static void bench_read_to_line_buf(long n) {
+    int sv[2];
+    make_socketpair(sv);
+    struct line_buf b;
+    memset(&b, 0, sizeof(b));
+    // long lines borrow buffers from a pool, as a worker's do
+    struct buf_pool pool;
+    memset(&pool, 0, sizeof(pool));
+    buf_pool_attach(&pool);
+    int cut = 0;
+    int pos = 0;
+    long lines = 0;
+    bench_bytes = 0;
+    timer_start();
+    while (lines < n) {
+        int end = cuts[cut];
+        if (write(sv[1], stream + pos, end - pos) != end - pos) {
+            perror("write");
+            exit(1);
+        }
+        bench_bytes += end - pos;
+        pos = end;
+        if (++cut == num_cuts) {
+            cut = 0;
+            pos = 0;
+        }
+
+        int r;
+        while ((r = read_to_line_buf(sv[0], &b)) == 0 || r == 2) {
+            char *line;
+            int len;
+            while (next_line_view(&b, &line, &len) == 0) {
+                lines++;
+            }
+        }
+        if (r != 3) {
+            fprintf(stderr, "read_to_line_buf returned %d\n", r);
+            exit(1);
+        }
+    }
+    timer_stop();
+    line_buf_clear(&b);
+    buf_pool_attach(NULL);
+    buf_pool_free(&pool);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/*
+ * Write lines to a socketpair one write_to_socket() each.
+ */
+static void bench_write_to_socket(long n) {
+    int sv[2];
+    make_socketpair(sv);
+    int writes = 0;
+    bench_bytes = 0;
+    timer_start();
+    for (long i = 0; i < n; i++) {
+        struct message *m = &corpus[i % CORPUS_SIZE];
+        if (write_to_socket(sv[0], m->text, m->len) != 0) {
+            exit(1);
+        }
+        bench_bytes += m->len;
+        if (++writes == DRAIN_EVERY) {
+            drain(sv[1]);
+            writes = 0;
+        }
+    }
+    timer_stop();
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/*
+ * Queue lines to a client the way the game does, a NULL-terminated
+ * string at a time, and flush its queue every flush_every lines as the
+ * event loop does after each batch of events.
+ */
+static void write_buf_to_client_every(long n, int flush_every) {
+    int sv[2];
+    make_socketpair(sv);
+    struct client_table t;
+    init_clients(&t);
+    buf_pool_attach(&t.pool);
+    struct client_sock *c = addclient(&t, sv[0]);
+    char buf[BUF_SIZE + 1];
+    int writes = 0;
+    bench_bytes = 0;
+    timer_start();
+    for (long i = 0; i < n; i++) {
+        struct message *m = &corpus[i % CORPUS_SIZE];
+        int len = m->len - 2;
+        memcpy(buf, m->text, len);
+        buf[len] = '\0';
+        if (write_buf_to_client(c, buf, len + 1)) {
+            exit(1);
+        }
+        bench_bytes += m->len;
+        if ((i + 1) % flush_every == 0) {
+            if (flush_client(c) != 0) {
+                fprintf(stderr, "flush_client failed\n");
+                exit(1);
+            }
+            if (++writes == DRAIN_EVERY) {
+                drain(sv[1]);
+                writes = 0;
+            }
+        }
+    }
+    timer_stop();
+    buf_pool_attach(NULL);
+    free_clients(&t);
+    close(sv[1]);
+}
+
+// a turn sends each player about four lines
+static void bench_write_buf_to_client(long n) {
+    write_buf_to_client_every(n, 4);
+}
+
+// the lobby can queue many lines before a flush
+static void bench_write_buf_to_client_batched(long n) {
+    write_buf_to_client_every(n, 64);
+}
+
+struct bench {
+    const char *name;
+    void (*run)(long n);
+};
+
+static struct bench benches[] = {
+    { "find_network_newline/line", bench_find_network_newline },
+    { "find_network_newline/partial", bench_find_network_newline_partial },
+    { "get_message/line", bench_get_message },
+    { "read_from_socket/fragmented", bench_read_from_socket },
+    { "read_to_line_buf/fragmented", bench_read_to_line_buf },
+    { "write_to_socket/line", bench_write_to_socket },
+    { "write_buf_to_client/flush4", bench_write_buf_to_client },
+    { "write_buf_to_client/flush64", bench_write_buf_to_client_batched },
+};
+
+#define NUM_BENCHES (int) (sizeof(benches) / sizeof(benches[0]))
+
+struct result {
+    char name[64];
+    long ops;
+    double ns_per_op;
+    double mb_per_sec;
+    double bytes_per_op;
+    double allocs_per_op;
+};
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Size benchmark b to run about target_ms a round, then run it rounds
+ * times and keep the median round.
+ */
+static void run_bench(struct bench *b, int rounds, int target_ms, struct result *res) {
+    long long target = target_ms * 1000000LL;
+    long n = 1;
+    b->run(n);
+    while (timer_ns < target) {
+        // aim a little past the target, but grow at most 100 times a step
+        long next = timer_ns > 0 ? (long) (n * 1.2 * target / timer_ns) : n * 100;
+        n = next > n * 100 ? n * 100 : next > n ? next : n + 1;
+        b->run(n);
+    }
+
+    double ns[rounds];
+    double mb[rounds];
+    for (int i = 0; i < rounds; i++) {
+        b->run(n);
+        ns[i] = (double) timer_ns / n;
+        mb[i] = bench_bytes / (timer_ns / 1e9) / 1e6;
+    }
+    qsort(ns, rounds, sizeof(double), compare_double);
+    qsort(mb, rounds, sizeof(double), compare_double);
+
+    snprintf(res->name, sizeof(res->name), "%s", b->name);
+    res->ops = n;
+    res->ns_per_op = ns[rounds / 2];
+    res->mb_per_sec = mb[rounds / 2];
+    res->bytes_per_op = (double) timer_alloc_bytes / n;
+    res->allocs_per_op = (double) timer_allocs / n;
+}
+
+static void print_result(struct result *r) {
+    printf("%-32s %10ld %12.1f ns/op %10.1f MB/s %8.1f B/op %6.2f allocs/op\n",
+        r->name, r->ops, r->ns_per_op, r->mb_per_sec, r->bytes_per_op, r->allocs_per_op);
+}
+
+/*
+ * Read the results saved in path, in the format print_result() writes.
+ * Return how many were read, or -1 if the file cannot be opened.
+ */
+static int load_baseline(const char *path, struct result *results, int max) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    char line[256];
+    int n = 0;
+    while (n < max && fgets(line, sizeof(line), f) != NULL) {
+        struct result *r = &results[n];
+        if (sscanf(line, "%63s %ld %lf ns/op %lf MB/s %lf B/op %lf allocs/op", r->name, &r->ops,
+                &r->ns_per_op, &r->mb_per_sec, &r->bytes_per_op, &r->allocs_per_op) == 6) {
+            n++;
+        }
+    }
+    fclose(f);
+    return n;
+}
+
+static void print_comparison(struct result *old, struct result *new) {
+    if (old == NULL) {
+        printf("%-32s %12s %12.1f %9s\n", new->name, "-", new->ns_per_op, "new");
+        return;
+    }
+    double delta = 100.0 * (new->ns_per_op - old->ns_per_op) / old->ns_per_op;
+    char verdict[16];
+    if (delta > NOISE_PERCENT) {
+        strcpy(verdict, "slower");
+    } else if (delta < -NOISE_PERCENT) {
+        strcpy(verdict, "faster");
+    } else {
+        strcpy(verdict, "~");
+    }
+    printf("%-32s %12.1f %12.1f %+8.1f%% %-7s %6.2f -> %.2f allocs/op\n", new->name,
+        old->ns_per_op, new->ns_per_op, delta, verdict, old->allocs_per_op, new->allocs_per_op);
+}
+
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-r rounds] [-t round_ms] [-f filter] [-c baseline_file]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int rounds = 5;
+    int target_ms = 100;
+    char *filter = NULL;
+    char *baseline_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:t:f:c:")) != -1) {
+        switch (opt) {
+        case 'r': rounds = atoi(optarg); break;
+        case 't': target_ms = atoi(optarg); break;
+        case 'f': filter = optarg; break;
+        case 'c': baseline_path = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (rounds < 1 || target_ms < 1) {
+        usage(argv[0]);
+    }
+
+    struct result baseline[NUM_BENCHES * 4];
+    int num_baseline = 0;
+    if (baseline_path != NULL) {
+        num_baseline = load_baseline(baseline_path, baseline, NUM_BENCHES * 4);
+        if (num_baseline < 0) {
+            exit(1);
+        }
+        printf("%-32s %12s %12s %9s\n", "benchmark", "old ns/op", "new ns/op", "delta");
+    }
+
+    make_corpus();
+    for (int i = 0; i < NUM_BENCHES; i++) {
+        if (filter != NULL && strstr(benches[i].name, filter) == NULL) {
+            continue;
+        }
+        struct result res;
+        run_bench(&benches[i], rounds, target_ms, &res);
+        if (baseline_path == NULL) {
+            print_result(&res);
+            continue;
+        }
+        struct result *old = NULL;
+        for (int j = 0; j < num_baseline; j++) {
+            if (strcmp(baseline[j].name, res.name) == 0) {
+                old = &baseline[j];
+            }
+        }
+        print_comparison(old, &res);
+    }
+
+    free(stream);
+    free(cuts);
+    return 0;
+}
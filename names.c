@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "names.h"
+
+struct name_slab {
+    struct name_slab *next;
+    struct name names[NAME_SLAB];
+};
+
+/*
+ * The buckets whose index is the stripe's modulo NAME_STRIPES, with the
+ * pool of names they are taken from.
+ */
+struct stripe {
+    pthread_mutex_t lock;
+    struct name *free_list;
+    struct name_slab *slabs;
+};
+
+static struct name *buckets[NAME_BUCKETS];
+static struct stripe stripes[NAME_STRIPES] = {
+    [0 ... NAME_STRIPES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+
+/*
+ * Check s is a valid name while hashing it with FNV-1a, in one pass.
+ * Return its length, or -1 if it is not valid.
+ */
+static int scan_name(const char *s, uint32_t *hash) {
+    uint32_t h = 0x811c9dc5u;
+    int blank = 1;
+    int len = 0;
+    for (; s[len] != '\0'; len++) {
+        unsigned char ch = s[len];
+        if (len == MAX_NAME || ch < ' ' || ch == 0x7f) {
+            return -1;
+        }
+        if (ch != ' ') {
+            blank = 0;
+        }
+        h ^= ch;
+        h *= 0x01000193u;
+    }
+    *hash = h;
+    return blank ? -1 : len;
+}
+
+int name_claim(const char *s, struct name **n) {
+    uint32_t hash;
+    int len = scan_name(s, &hash);
+    if (len < 0) {
+        return NAME_INVALID;
+    }
+    unsigned int b = hash & (NAME_BUCKETS - 1);
+    struct stripe *st = &stripes[b & (NAME_STRIPES - 1)];
+
+    pthread_mutex_lock(&st->lock);
+    for (struct name *p = buckets[b]; p != NULL; p = p->next) {
+        if (p->hash == hash && p->len == len && memcmp(p->text, s, len) == 0) {
+            pthread_mutex_unlock(&st->lock);
+            return NAME_TAKEN;
+        }
+    }
+
+    // Take a name from the pool, topping the pool up with a new slab if empty
+    if (st->free_list == NULL) {
+        struct name_slab *slab = malloc(sizeof(struct name_slab));
+        if (slab == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        slab->next = st->slabs;
+        st->slabs = slab;
+        for (int i = 0; i < NAME_SLAB; i++) {
+            slab->names[i].next = st->free_list;
+            st->free_list = &slab->names[i];
+        }
+    }
+    struct name *p = st->free_list;
+    st->free_list = p->next;
+
+    p->hash = hash;
+    p->len = len;
+    p->worker = -1;
+    p->match = 0;
+    memcpy(p->text, s, len + 1);
+    p->next = buckets[b];
+    buckets[b] = p;
+    pthread_mutex_unlock(&st->lock);
+
+    *n = p;
+    return NAME_OK;
+}
+
+void name_place(struct name *n, int worker, unsigned long match) {
+    if (n == NULL) {
+        return;
+    }
+    // read by name_find() under the stripe lock, which this skips
+    __atomic_store_n(&n->worker, worker, __ATOMIC_RELAXED);
+    __atomic_store_n(&n->match, match, __ATOMIC_RELAXED);
+}
+
+int name_find(const char *s, int *worker, unsigned long *match) {
+    uint32_t hash;
+    int len = scan_name(s, &hash);
+    if (len < 0) {
+        return 0;
+    }
+    unsigned int b = hash & (NAME_BUCKETS - 1);
+    struct stripe *st = &stripes[b & (NAME_STRIPES - 1)];
+
+    int found = 0;
+    pthread_mutex_lock(&st->lock);
+    for (struct name *p = buckets[b]; p != NULL; p = p->next) {
+        if (p->hash == hash && p->len == len && memcmp(p->text, s, len) == 0) {
+            *worker = __atomic_load_n(&p->worker, __ATOMIC_RELAXED);
+            *match = __atomic_load_n(&p->match, __ATOMIC_RELAXED);
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&st->lock);
+    return found;
+}
+
+void name_release(struct name *n) {
+    if (n == NULL) {
+        return;
+    }
+    unsigned int b = n->hash & (NAME_BUCKETS - 1);
+    struct stripe *st = &stripes[b & (NAME_STRIPES - 1)];
+
+    pthread_mutex_lock(&st->lock);
+    struct name **pp = &buckets[b];
+    while (*pp != n) {
+        pp = &(*pp)->next;
+    }
+    *pp = n->next;
+    n->next = st->free_list;
+    st->free_list = n;
+    pthread_mutex_unlock(&st->lock);
+}
+
+void names_free() {
+    for (int i = 0; i < NAME_STRIPES; i++) {
+        struct stripe *st = &stripes[i];
+        while (st->slabs != NULL) {
+            struct name_slab *slab = st->slabs;
+            st->slabs = slab->next;
+            free(slab);
+        }
+        st->free_list = NULL;
+    }
+    memset(buckets, 0, sizeof(buckets));
+}
@@ -0,0 +1,81 @@
+#ifndef NAMES_H
+#define NAMES_H
+
+#include <stdint.h>
+
+#ifndef MAX_NAME
+    #define MAX_NAME 20
+#endif
+
+// Hash buckets of the names online, a power of two. Sized for a full
+// server to leave most buckets with at most one name.
+#ifndef NAME_BUCKETS
+    #define NAME_BUCKETS 65536
+#endif
+
+// Locks the buckets are split between, a power of two no larger than
+// NAME_BUCKETS. Each guards every NAME_STRIPES-th bucket.
+#ifndef NAME_STRIPES
+    #define NAME_STRIPES 64
+#endif
+
+#ifndef NAME_SLAB
+    #define NAME_SLAB 64
+#endif
+
+/*
+ * A user name in use, interned: the one copy of it on the server, with
+ * its length and hash worked out once when it was claimed. No two
+ * clients online hold the same name.
+ */
+struct name {
+    struct name *next;      // next in its bucket, or next free
+    uint32_t hash;
+    int len;
+    int worker;             // worker serving its holder, or -1 until known
+    unsigned long match;    // id of the match its holder plays in, or 0
+    char text[MAX_NAME + 1];
+};
+
+/*
+ * Results of name_claim().
+ */
+#define NAME_OK 0
+#define NAME_INVALID 1      // empty, too long, blank or with control characters
+#define NAME_TAKEN 2        // held by a client online
+
+/*
+ * Validate user name s, and claim it if no client online holds it.
+ * On success, *n is set to the interned name, which is the caller's
+ * until it is released. Safe to call from any thread.
+ *
+ * Return NAME_OK, NAME_INVALID or NAME_TAKEN.
+ */
+int name_claim(const char *s, struct name **n);
+
+/*
+ * Note that the holder of name n is served by the given worker, and
+ * playing in match, or in none if it is 0. Only the thread serving the
+ * holder calls it.
+ */
+void name_place(struct name *n, int worker, unsigned long match);
+
+/*
+ * Look up who holds user name s. Safe to call from any thread.
+ * Return 1 and set *worker and *match to where name_place() last put
+ * the holder if someone online holds it, 0 otherwise.
+ */
+int name_find(const char *s, int *worker, unsigned long *match);
+
+/*
+ * Let go of name n, so another client may claim it. Does nothing if n
+ * is NULL.
+ */
+void name_release(struct name *n);
+
+/*
+ * Free the memory of every name. Only once no thread uses them any more.
+ */
+void names_free();
+
+#endif
@@ -0,0 +1,38 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "proto.h"
+
+int next_frame_view(struct line_buf *b, int *op, char **payload, int *len) {
+    int avail = b->tail - b->head;
+    if (avail < PROTO_HEADER) {
+        return 1;
+    }
+    unsigned char *start = (unsigned char *) line_buf_bytes(b) + b->head;
+    int n = start[0];
+    if (n > PROTO_MAX_PAYLOAD) {
+        return -1;
+    }
+    if (avail < PROTO_HEADER + n) {
+        return 1;
+    }
+
+    *op = start[1];
+    *payload = (char *) start + PROTO_HEADER;
+    *len = n;
+
+    b->head += PROTO_HEADER + n;
+    if (b->head == b->tail) {
+        // As with lines, the bytes of *payload stay put until the next read.
+        b->head = 0;
+        b->tail = 0;
+    }
+    return 0;
+}
+
+int encode_frame(char *buf, int op, const void *payload, int len) {
+    buf[0] = len;
+    buf[1] = op;
+    memcpy(buf + PROTO_HEADER, payload, len);
+    return PROTO_HEADER + len;
+}
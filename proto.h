@@ -0,0 +1,154 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+#include "helpers.h"
+
+/*
+ * Wire protocols. Every client starts out on the text protocol and is
+ * asked for its name. A client that sends PROTO_MAGIC as the very first
+ * byte of its connection speaks the binary protocol from then on; the
+ * name prompt, PROTO_BANNER_LEN bytes of text, is then the only text it
+ * is ever sent.
+ */
+#define PROTO_UNKNOWN 0     // nothing received yet; treated as text
+#define PROTO_TEXT 1
+#define PROTO_BINARY 2
+
+#define PROTO_MAGIC 0xBA
+#define PROTO_BANNER "What is your name? "
+#define PROTO_BANNER_LEN (sizeof(PROTO_BANNER) - 1)
+
+// Sent instead of the name prompt to a client turned away, before the
+// connection is closed.
+#define PROTO_FULL "Server is full, try again later.\r\n"
+#define PROTO_FULL_LEN (sizeof(PROTO_FULL) - 1)
+
+/*
+ * A binary frame is a two-byte header, the payload length and the
+ * opcode, followed by the payload. Frames have to fit in a client's
+ * input buffer.
+ */
+#define PROTO_HEADER 2
+#define PROTO_MAX_PAYLOAD (BUF_SIZE - PROTO_HEADER)
+
+/*
+ * Opcodes. Each one's payload has a fixed layout, given as
+ * client-to-server / server-to-client where the two differ.
+ */
+#define OP_LOGIN 0x01   // user name / empty: name accepted, awaiting an opponent
+#define OP_MOVE 0x02    // move letter / move letter, damage or hitpoints healed
+#define OP_CHAT 0x03    // text for the opponent / text from the opponent
+#define OP_START 0x04   // opponent's user name: a match has started
+#define OP_STATE 0x05   // struct proto_state
+#define OP_RESULT 0x06  // PROTO_WON or PROTO_LOST, then a PROTO_BY_ reason
+#define OP_NOTICE 0x07  // one of the NOTICE_ codes
+#define OP_WATCH 0x08   // user name of a player, or empty for any match /
+                        // both players' user names, each NULL-terminated
+#define OP_UNWATCH 0x09 // empty / empty: no longer watching
+#define OP_WATCH_STATE 0x0a     // struct proto_watch_state
+#define OP_WATCH_RESULT 0x0b    // index of the winner, then a PROTO_BY_ reason
+#define OP_LOBBY 0x0c   // a LOBBY_ event, then its fields (server-to-client only)
+#define OP_TOURNEY 0x0d // TOURNEY_JOIN or TOURNEY_LEAVE / a TOURNEY_ event
+
+/*
+ * Payload of OP_STATE, sent to both players at the start of every turn.
+ */
+struct proto_state {
+    unsigned char your_turn;    // 1 if the receiver is to move
+    signed char hitpoints;
+    unsigned char powermoves;
+    unsigned char heals;
+    signed char opponent_hitpoints;
+};
+
+/*
+ * Payload of OP_WATCH_STATE, sent to spectators at the start of every
+ * turn. Players are in the order OP_WATCH named them.
+ */
+struct proto_watch_state {
+    unsigned char turn;         // index of the player to move
+    signed char hitpoints[2];
+};
+
+#define PROTO_WON 1
+#define PROTO_LOST 0
+
+// How a match was decided.
+#define PROTO_BY_HITPOINTS 0
+#define PROTO_BY_DISCONNECT 1
+#define PROTO_BY_TIMEOUT 2
+
+/*
+ * Lobby events carried by OP_LOBBY. User names are NULL-terminated.
+ * Chat text is cut short where it would not fit in PROTO_MAX_PAYLOAD.
+ */
+#define LOBBY_CHAT 0        // user name, then the text
+#define LOBBY_JOIN 1        // user name
+#define LOBBY_LEAVE 2       // user name
+#define LOBBY_RESULT 3      // winner's user name, loser's, then a PROTO_BY_ reason
+
+/*
+ * Tournament requests carried by OP_TOURNEY.
+ */
+#define TOURNEY_JOIN 1
+#define TOURNEY_LEAVE 2
+
+/*
+ * Tournament events carried by OP_TOURNEY, each a struct proto_tourney
+ * followed, for those that name a player, by the NULL-terminated user
+ * name.
+ */
+#define TOURNEY_REGISTERED 0    // count: players registered so far
+#define TOURNEY_WITHDRAWN 1     // no longer registered or playing
+#define TOURNEY_CLOSED 2        // no tournament open to register for
+#define TOURNEY_STARTED 3       // count: players in the bracket
+#define TOURNEY_BOUT 4          // stage and round; name: opponent. Comes before OP_START
+#define TOURNEY_ROUND 5         // stage and round are over; count: players still in
+#define TOURNEY_OUT 6           // count: place finished in
+#define TOURNEY_CHAMPION 7      // name: winner of the tournament
+
+// Stages of a bracket.
+#define TOURNEY_WINNERS 0   // the winners' bracket, or the only one
+#define TOURNEY_LOSERS 1
+#define TOURNEY_FINAL 2     // grand final of double elimination
+
+struct proto_tourney {
+    unsigned char event;
+    unsigned char stage;
+    unsigned char round;
+    unsigned char count[2];     // big-endian
+};
+
+/*
+ * Things the server tells a client outside of the flow of a match.
+ */
+#define NOTICE_BAD_NAME 1
+#define NOTICE_INVALID_MOVE 2
+#define NOTICE_FULL_HEALTH 3
+#define NOTICE_TURN_TIMEOUT 4       // you lost your turn
+#define NOTICE_OPPONENT_TIMEOUT 5   // your opponent lost their turn
+#define NOTICE_LOGIN_TIMEOUT 6
+#define NOTICE_IDLE_TIMEOUT 7
+#define NOTICE_SAY 8                // prompt for a line of chat; text only
+#define NOTICE_NO_MATCH 9           // nothing to watch
+#define NOTICE_NAME_TAKEN 10        // someone online already has that name
+#define NOTICE_FLOODING 11          // dropped for sending too much, too fast
+#define NOTICE_IN_TOURNEY 12        // the match is on another worker than the tournament
+
+/*
+ * Take the next complete frame out of buffer b, without copying it.
+ * *op is set to its opcode, and *payload and *len to its payload.
+ *
+ * Return 0 on success.
+ * Return 1 if no complete frame is buffered.
+ * Return -1 if the frame could never fit in the buffer.
+ */
+int next_frame_view(struct line_buf *b, int *op, char **payload, int *len);
+
+/*
+ * Encode a frame into buf, which must have room for PROTO_HEADER + len
+ * bytes. Return the length of the frame.
+ */
+int encode_frame(char *buf, int op, const void *payload, int len);
+
+#endif
@@ -0,0 +1,339 @@
+/*
+ * Protocol checks for the battle server.
+ *
+ * Connects to a running server on loopback and checks how it answers
+ * clients that break the protocol, one check at a time. Prints a line
+ * per check and exits 1 if any failed. make check starts a server with
+ * several workers and a tournament open, and runs them against it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "proto.h"
+
+#ifndef SERVER_PORT
+    #define SERVER_PORT 30000
+#endif
+
+// Milliseconds to wait for the server to answer.
+#define CHECK_WAIT 1000
+
+// Clients logged in to check lobby announcements with; enough that
+// some land on every worker of the server make check starts.
+#define CHECK_CROWD 16
+
+/*
+ * Return a new connection to the server that has switched to the
+ * binary protocol and read its name prompt, or -1 on error.
+ */
+int connect_binary() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(SERVER_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+    unsigned char magic = PROTO_MAGIC;
+    char banner[PROTO_BANNER_LEN];
+    int got = 0;
+    if (write(fd, &magic, 1) != 1) {
+        close(fd);
+        return -1;
+    }
+    while (got < PROTO_BANNER_LEN) {
+        int n = read(fd, banner + got, PROTO_BANNER_LEN - got);
+        if (n <= 0) {
+            close(fd);
+            return -1;
+        }
+        got += n;
+    }
+    return fd;
+}
+
+/*
+ * Send a frame of opcode op carrying len bytes of payload.
+ * Return 0 on success, 1 on error.
+ */
+int send_frame(int fd, int op, const char *payload, int len) {
+    char frame[PROTO_HEADER + PROTO_MAX_PAYLOAD];
+    int n = encode_frame(frame, op, payload, len);
+    return write(fd, frame, n) != n;
+}
+
+/*
+ * Read exactly n bytes, waiting at most CHECK_WAIT ms in all.
+ * Return 0 on success, 1 on timeout or error, 2 if the server closed
+ * the connection first.
+ */
+int read_exactly(int fd, char *buf, int n) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int got = 0;
+    while (got < n) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long waited = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        struct pollfd p = { fd, POLLIN, 0 };
+        if (waited >= CHECK_WAIT || poll(&p, 1, CHECK_WAIT - waited) <= 0) {
+            return 1;
+        }
+        int r = read(fd, buf + got, n - got);
+        if (r == 0) {
+            return 2;
+        }
+        if (r < 0) {
+            return 1;
+        }
+        got += r;
+    }
+    return 0;
+}
+
+/*
+ * Read the next frame into payload, which must have room for
+ * PROTO_MAX_PAYLOAD bytes, and set *op and *len to its opcode and
+ * length. Return as read_exactly() does.
+ */
+int read_frame(int fd, int *op, char *payload, int *len) {
+    unsigned char header[PROTO_HEADER];
+    int r = read_exactly(fd, (char *) header, PROTO_HEADER);
+    if (r != 0) {
+        return r;
+    }
+    *len = header[0];
+    *op = header[1];
+    return read_exactly(fd, payload, *len);
+}
+
+/*
+ * Read frames until one of opcode op arrives, copying its payload into
+ * payload, if not NULL. Return 0 if it came, 1 or 2 as read_exactly().
+ */
+int expect_frame(int fd, int want, char *payload, int *len) {
+    char buf[PROTO_MAX_PAYLOAD];
+    int op, n, r;
+    while ((r = read_frame(fd, &op, buf, &n)) == 0) {
+        if (op == want) {
+            if (payload != NULL) {
+                memcpy(payload, buf, n);
+                *len = n;
+            }
+            return 0;
+        }
+    }
+    return r;
+}
+
+/*
+ * Return 1 if the server closes the connection without answering
+ * anything else, 0 otherwise.
+ */
+int expect_closed(int fd) {
+    char buf[PROTO_MAX_PAYLOAD];
+    int op, len, r;
+    while ((r = read_frame(fd, &op, buf, &len)) == 0) {
+        if (op != OP_LOBBY) {
+            return 0;
+        }
+    }
+    return r == 2;
+}
+
+/*
+ * Log in over fd as name. Return 1 if the server accepted the name,
+ * 0 otherwise.
+ */
+int log_in(int fd, const char *name) {
+    char payload[PROTO_MAX_PAYLOAD];
+    int op, len;
+    if (send_frame(fd, OP_LOGIN, name, strlen(name))) {
+        return 0;
+    }
+    while (read_frame(fd, &op, payload, &len) == 0) {
+        if (op == OP_LOGIN) {
+            return len == 0;
+        }
+        if (op == OP_NOTICE) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/*
+ * A move frame before logging in is a protocol error, and must not log
+ * the client in under the move letter.
+ */
+int check_move_before_login() {
+    int fd = connect_binary();
+    if (fd < 0) {
+        return 0;
+    }
+    int ok = send_frame(fd, OP_MOVE, "a", 1) == 0 && expect_closed(fd);
+    close(fd);
+
+    // the letter is still free to log in with
+    fd = connect_binary();
+    if (fd < 0) {
+        return 0;
+    }
+    ok = ok && log_in(fd, "a");
+    close(fd);
+    return ok;
+}
+
+/*
+ * A move frame from the lobby is a protocol error, not lobby chat.
+ */
+int check_move_in_lobby() {
+    int fd = connect_binary();
+    if (fd < 0) {
+        return 0;
+    }
+    int ok = log_in(fd, "lobbymover")
+        && send_frame(fd, OP_MOVE, "a", 1) == 0 && expect_closed(fd);
+    close(fd);
+    return ok;
+}
+
+/*
+ * Logins on every worker are announced to the lobby of every worker.
+ * The listener registers for the tournament, which moves it to the
+ * tournament's worker and keeps it out of matchmaking, so it stays in
+ * the lobby while the others log in across the workers.
+ */
+int check_lobby_across_workers() {
+    int listener = connect_binary();
+    if (listener < 0) {
+        return 0;
+    }
+    char join = TOURNEY_JOIN;
+    char payload[PROTO_MAX_PAYLOAD];
+    int len;
+    if (!log_in(listener, "listener") || send_frame(listener, OP_TOURNEY, &join, 1)
+            || expect_frame(listener, OP_TOURNEY, payload, &len) || payload[0] != TOURNEY_REGISTERED) {
+        close(listener);
+        return 0;
+    }
+
+    int crowd[CHECK_CROWD];
+    int seen[CHECK_CROWD];
+    int ok = 1;
+    for (int i = 0; i < CHECK_CROWD; i++) {
+        char name[MAX_NAME + 1];
+        snprintf(name, sizeof(name), "crowd%d", i);
+        crowd[i] = connect_binary();
+        seen[i] = 0;
+        ok = ok && crowd[i] >= 0 && log_in(crowd[i], name);
+    }
+    int left = CHECK_CROWD;
+    while (ok && left > 0 && expect_frame(listener, OP_LOBBY, payload, &len) == 0) {
+        int i;
+        if (payload[0] == LOBBY_JOIN && sscanf(payload + 1, "crowd%d", &i) == 1
+                && i >= 0 && i < CHECK_CROWD && !seen[i]) {
+            seen[i] = 1;
+            left--;
+        }
+    }
+    for (int i = 0; i < CHECK_CROWD; i++) {
+        if (crowd[i] >= 0) {
+            close(crowd[i]);
+        }
+    }
+    close(listener);
+    return ok && left == 0;
+}
+
+/*
+ * A match can be watched from any worker. Duelists log in until some
+ * are matched; then watchers, enough that some land on other workers
+ * than the match, each log in and ask to watch it in the same write,
+ * before matchmaking can pair them with one another.
+ */
+int check_watch_across_workers() {
+    int duel[CHECK_CROWD];
+    char target[MAX_NAME + 1] = "";
+    int ok = 1;
+    for (int i = 0; i < CHECK_CROWD; i++) {
+        char name[MAX_NAME + 1];
+        snprintf(name, sizeof(name), "duel%d", i);
+        duel[i] = connect_binary();
+        ok = ok && duel[i] >= 0 && log_in(duel[i], name);
+    }
+    for (int i = 0; ok && target[0] == '\0' && i < CHECK_CROWD; i++) {
+        if (expect_frame(duel[i], OP_START, NULL, NULL) == 0) {
+            snprintf(target, sizeof(target), "duel%d", i);
+        }
+    }
+    ok = ok && target[0] != '\0';
+
+    int watchers[CHECK_CROWD];
+    for (int i = 0; i < CHECK_CROWD; i++) {
+        watchers[i] = -1;
+    }
+    for (int i = 0; ok && i < CHECK_CROWD; i++) {
+        char name[MAX_NAME + 1];
+        char frames[2 * (PROTO_HEADER + PROTO_MAX_PAYLOAD)];
+        snprintf(name, sizeof(name), "watcher%d", i);
+        watchers[i] = connect_binary();
+        if (watchers[i] < 0) {
+            ok = 0;
+            break;
+        }
+        int n = encode_frame(frames, OP_LOGIN, name, strlen(name));
+        n += encode_frame(frames + n, OP_WATCH, target, strlen(target));
+        char payload[PROTO_MAX_PAYLOAD];
+        int len;
+        ok = write(watchers[i], frames, n) == n
+            && expect_frame(watchers[i], OP_WATCH, payload, &len) == 0 && len > 0;
+    }
+    for (int i = 0; i < CHECK_CROWD; i++) {
+        if (duel[i] >= 0) {
+            close(duel[i]);
+        }
+        if (watchers[i] >= 0) {
+            close(watchers[i]);
+        }
+    }
+    return ok;
+}
+
+struct check {
+    const char *name;
+    int (*run)();
+};
+
+static const struct check checks[] = {
+    { "move before login", check_move_before_login },
+    { "move in lobby", check_move_in_lobby },
+    { "lobby across workers", check_lobby_across_workers },
+    { "watch across workers", check_watch_across_workers },
+};
+
+int main() {
+    int failed = 0;
+    for (int i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+        int ok = checks[i].run();
+        printf("%-32s %s\n", checks[i].name, ok ? "ok" : "FAILED");
+        failed += !ok;
+        // give the server time to let go of the names just used
+        usleep(50000);
+    }
+    return failed != 0;
+}
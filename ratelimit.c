@@ -0,0 +1,66 @@
+#include "ratelimit.h"
+
+struct rate_limits rate_limits = { RATE_BYTES, RATE_COMMANDS };
+
+void rate_init(struct rate_limit *r, unsigned long now) {
+    r->bytes = rate_limits.bytes * RATE_BURST * 1000;
+    r->commands = rate_limits.commands * RATE_BURST * 1000;
+    r->last_ms = now;
+    r->strikes = 0;
+}
+
+/*
+ * Add to *tokens what limit gives over ms milliseconds, up to a full
+ * bucket. Return 1 if the bucket is full.
+ */
+static int refill(long *tokens, long limit, unsigned long ms) {
+    long full = limit * RATE_BURST * 1000;
+    if (*tokens >= full || ms >= RATE_BURST * 1000UL) {
+        *tokens = full;
+    } else {
+        *tokens += limit * ms;
+        if (*tokens > full) {
+            *tokens = full;
+        }
+    }
+    return *tokens == full;
+}
+
+int rate_charge(struct rate_limit *r, unsigned long now, long bytes, long commands) {
+    unsigned long ms = now - r->last_ms;
+    r->last_ms = now;
+    int full = refill(&r->bytes, rate_limits.bytes, ms);
+    full &= refill(&r->commands, rate_limits.commands, ms);
+    if (full) {
+        r->strikes = 0;
+    }
+    if (rate_limits.bytes > 0) {
+        r->bytes -= bytes * 1000;
+    }
+    if (rate_limits.commands > 0) {
+        r->commands -= commands * 1000;
+    }
+    if (r->bytes >= 0 && r->commands >= 0) {
+        return RATE_OK;
+    }
+    return ++r->strikes > RATE_STRIKES ? RATE_FLOODING : RATE_OVER;
+}
+
+/*
+ * Return the milliseconds until tokens, refilled at limit, reach half a
+ * bucket.
+ */
+static long half_full(long tokens, long limit) {
+    long need = limit * RATE_BURST * 1000 / 2 - tokens;
+    return limit > 0 && need > 0 ? (need + limit - 1) / limit : 0;
+}
+
+int rate_wait(struct rate_limit *r, unsigned long now) {
+    long wait = half_full(r->bytes, rate_limits.bytes);
+    long commands = half_full(r->commands, rate_limits.commands);
+    if (commands > wait) {
+        wait = commands;
+    }
+    long passed = now - r->last_ms;
+    return wait > passed ? wait - passed : 0;
+}
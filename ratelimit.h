@@ -0,0 +1,73 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+// Bytes a second a client may send, on average. 0 for no limit.
+#ifndef RATE_BYTES
+    #define RATE_BYTES 2048
+#endif
+
+// Lines or frames a second a client may send, on average. 0 for no limit.
+#ifndef RATE_COMMANDS
+    #define RATE_COMMANDS 20
+#endif
+
+// Seconds of sending at the limit a client may save up for a burst.
+#ifndef RATE_BURST
+    #define RATE_BURST 2
+#endif
+
+// Times a client may go over its limits before it is disconnected,
+// unless it lets its allowance fill back up in between.
+#ifndef RATE_STRIKES
+    #define RATE_STRIKES 5
+#endif
+
+/*
+ * What each client may send a second, the same for every worker.
+ */
+struct rate_limits {
+    long bytes;
+    long commands;
+};
+
+extern struct rate_limits rate_limits;
+
+/*
+ * Token buckets of one client, one for bytes and one for commands.
+ * Tokens are kept in thousandths, so a bucket refills by its limit for
+ * every millisecond that passes. A bucket may go into debt; the client
+ * is then over its limits, and paused until it has paid that back and
+ * saved up half a burst, so it is not stopped again straight away.
+ */
+struct rate_limit {
+    long bytes;
+    long commands;
+    unsigned long last_ms;  // when the buckets were last refilled
+    int strikes;            // times over the limits since they were last full
+};
+
+/*
+ * Results of rate_charge().
+ */
+#define RATE_OK 0
+#define RATE_OVER 1         // to be paused until back within its limits
+#define RATE_FLOODING 2     // over its limits too many times
+
+/*
+ * Start client buckets r full, at time now from timer_now_ms().
+ */
+void rate_init(struct rate_limit *r, unsigned long now);
+
+/*
+ * Refill r for the time up to now, then take bytes and commands out of
+ * it. Return RATE_OK, RATE_OVER or RATE_FLOODING.
+ */
+int rate_charge(struct rate_limit *r, unsigned long now, long bytes, long commands);
+
+/*
+ * Return the milliseconds after now until both buckets of r are half
+ * full again, for a client over its limits to be let go on with.
+ */
+int rate_wait(struct rate_limit *r, unsigned long now);
+
+#endif
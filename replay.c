@@ -0,0 +1,396 @@
+/*
+ * Reader for match journal segments.
+ *
+ * Maps each segment given on the command line and walks its records in
+ * place. By default it prints totals over every match in them; -m prints
+ * a single match move by move, and -v replays every match from its seed
+ * to check each recorded roll against the one the server must have made.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "proto.h"
+#include "rng.h"
+#include "rules.h"
+
+/*
+ * A match being replayed, with the state the server held for it.
+ */
+struct replay {
+    uint64_t id;        // 0 for an empty slot
+    struct rng rng;
+    char names[2][JR_NAME + 1];
+    struct fighter fighters[2];
+};
+
+/*
+ * Open-addressing table of the matches started but not yet finished.
+ */
+struct replay_table {
+    struct replay *slots;
+    long cap;           // a power of two
+    long count;
+};
+
+struct totals {
+    long records;
+    long matches_started;
+    long matches_finished;
+    long by[3];         // results by PROTO_BY_ reason
+    long first_player_wins;
+    long moves;
+    long move_count[4]; // a, p, h, t
+    long move_amount[4];
+    long power_hits;
+    long match_moves;   // summed over finished matches
+    long longest;
+    long mismatches;
+    long unknown;       // moves and results of matches started before the segments given
+};
+
+static const char move_letters[] = "apht";
+
+static const char *by_names[] = { "hitpoints", "disconnect", "timeout" };
+
+int verify = 0;
+int show_all = 0;
+uint64_t show_id = 0;
+
+static uint64_t hash_id(uint64_t id) {
+    id ^= id >> 33;
+    id *= 0xff51afd7ed558ccdULL;
+    id ^= id >> 33;
+    return id;
+}
+
+static struct replay *table_find(struct replay_table *t, uint64_t id) {
+    for (long i = hash_id(id) & (t->cap - 1); t->slots[i].id != 0; i = (i + 1) & (t->cap - 1)) {
+        if (t->slots[i].id == id) {
+            return &t->slots[i];
+        }
+    }
+    return NULL;
+}
+
+static struct replay *table_insert(struct replay_table *t, uint64_t id);
+
+static void table_grow(struct replay_table *t) {
+    struct replay *old = t->slots;
+    long old_cap = t->cap;
+    t->cap = old_cap ? old_cap * 2 : 1024;
+    t->slots = calloc(t->cap, sizeof(struct replay));
+    if (t->slots == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    t->count = 0;
+    for (long i = 0; i < old_cap; i++) {
+        if (old[i].id != 0) {
+            *table_insert(t, old[i].id) = old[i];
+        }
+    }
+    free(old);
+}
+
+static struct replay *table_insert(struct replay_table *t, uint64_t id) {
+    if ((t->count + 1) * 2 > t->cap) {
+        table_grow(t);
+    }
+    long i = hash_id(id) & (t->cap - 1);
+    while (t->slots[i].id != 0 && t->slots[i].id != id) {
+        i = (i + 1) & (t->cap - 1);
+    }
+    if (t->slots[i].id == 0) {
+        t->count++;
+    }
+    t->slots[i].id = id;
+    return &t->slots[i];
+}
+
+/*
+ * Remove r from the table, shifting back the entries after it so
+ * lookups never need tombstones.
+ */
+static void table_remove(struct replay_table *t, struct replay *r) {
+    long i = r - t->slots;
+    long j = i;
+    while (1) {
+        j = (j + 1) & (t->cap - 1);
+        if (t->slots[j].id == 0) {
+            break;
+        }
+        long home = hash_id(t->slots[j].id) & (t->cap - 1);
+        // move j back into the hole at i unless its home lies in (i, j]
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            t->slots[i] = t->slots[j];
+            i = j;
+        }
+    }
+    t->slots[i].id = 0;
+    t->count--;
+}
+
+static void mismatch(struct totals *tot, struct replay *r, struct jr_header *h, char *what, int recorded, int replayed) {
+    tot->mismatches++;
+    printf("match %lu turn %u: recorded %s %d, replay gives %d\n",
+        (unsigned long) h->match_id, h->turn, what, recorded, replayed);
+}
+
+/*
+ * Roll the starting stats of a match with the rules the server uses.
+ */
+static void replay_start(struct totals *tot, struct replay *r, struct jr_start *rec) {
+    rng_seed(&r->rng, rec->seed);
+    for (int i = 0; i < 2; i++) {
+        struct fighter *f = &r->fighters[i];
+        rules_roll_fighter(&r->rng, f);
+        if (f->hitpoints != rec->hitpoints[i]) {
+            mismatch(tot, r, &rec->h, "hitpoints", rec->hitpoints[i], f->hitpoints);
+        }
+        if (f->powermoves != rec->powermoves[i]) {
+            mismatch(tot, r, &rec->h, "powermoves", rec->powermoves[i], f->powermoves);
+        }
+        if (f->heals != rec->heals[i]) {
+            mismatch(tot, r, &rec->h, "heals", rec->heals[i], f->heals);
+        }
+    }
+}
+
+/*
+ * Roll a move with the rules the server uses. A turn lost to the clock
+ * ('t') draws nothing.
+ */
+static void replay_move(struct totals *tot, struct replay *r, struct jr_move *rec) {
+    int p = rec->h.player & 1;
+    int amount = 0;
+    if (rec->move != 't') {
+        int result = rules_move(&r->rng, &r->fighters[p], &r->fighters[1 - p], rec->move, &amount);
+        if (result != RULES_DONE) {
+            mismatch(tot, r, &rec->h, "move result", RULES_DONE, result);
+            amount = 0;
+        }
+    }
+    if (amount != rec->amount) {
+        mismatch(tot, r, &rec->h, "amount", rec->amount, amount);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (r->fighters[i].hitpoints != rec->hitpoints[i]) {
+            mismatch(tot, r, &rec->h, "hitpoints", rec->hitpoints[i], r->fighters[i].hitpoints);
+        }
+    }
+}
+
+static void print_record(struct replay *r, struct jr_header *h) {
+    if (h->type == JR_START) {
+        struct jr_start *rec = (struct jr_start *) h;
+        time_t secs = rec->time_ms / 1000;
+        char when[32];
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&secs));
+        printf("match %lu at %s, seed %016llx\n", (unsigned long) h->match_id, when,
+            (unsigned long long) rec->seed);
+        for (int i = 0; i < 2; i++) {
+            printf("  %s: %d hitpoints, %d powermoves, %d heals\n", r->names[i],
+                rec->hitpoints[i], rec->powermoves[i], rec->heals[i]);
+        }
+    } else if (h->type == JR_MOVE) {
+        struct jr_move *rec = (struct jr_move *) h;
+        printf("  turn %-3u %-20s %c %-3d -> %d / %d\n", h->turn, r->names[h->player & 1],
+            rec->move, rec->amount, rec->hitpoints[0], rec->hitpoints[1]);
+    } else if (h->type == JR_RESULT) {
+        struct jr_result *rec = (struct jr_result *) h;
+        printf("  %s won by %s after %u moves\n", r->names[rec->winner & 1],
+            by_names[rec->by < 3 ? rec->by : 0], h->turn);
+    }
+}
+
+static int move_index(char move) {
+    const char *p = strchr(move_letters, move);
+    return p != NULL && move != '\0' ? p - move_letters : -1;
+}
+
+/*
+ * Walk every record of one mapped segment.
+ */
+static void scan(const char *path, char *data, size_t len, struct replay_table *t, struct totals *tot) {
+    size_t off = sizeof(struct journal_segment);
+    while (off + sizeof(struct jr_header) <= len) {
+        struct jr_header *h = (struct jr_header *) (data + off);
+        if (h->size < sizeof(struct jr_header) || off + h->size > len) {
+            fprintf(stderr, "%s: truncated record at offset %zu\n", path, off);
+            return;
+        }
+        off += h->size;
+        tot->records++;
+
+        struct replay *r = table_find(t, h->match_id);
+        if (h->type == JR_START) {
+            struct jr_start *rec = (struct jr_start *) h;
+            tot->matches_started++;
+            r = table_insert(t, h->match_id);
+            for (int i = 0; i < 2; i++) {
+                int n = rec->name_len[i] < JR_NAME ? rec->name_len[i] : JR_NAME;
+                memcpy(r->names[i], rec->names[i], n);
+                r->names[i][n] = '\0';
+            }
+            if (verify) {
+                replay_start(tot, r, rec);
+            }
+        } else if (r == NULL) {
+            tot->unknown++;
+            continue;
+        }
+
+        if (show_all || h->match_id == show_id) {
+            print_record(r, h);
+        }
+
+        if (h->type == JR_MOVE) {
+            struct jr_move *rec = (struct jr_move *) h;
+            int i = move_index(rec->move);
+            tot->moves++;
+            if (i >= 0) {
+                tot->move_count[i]++;
+                tot->move_amount[i] += rec->amount;
+            }
+            if (rec->move == 'p' && rec->amount > 0) {
+                tot->power_hits++;
+            }
+            if (verify) {
+                replay_move(tot, r, rec);
+            }
+        } else if (h->type == JR_RESULT) {
+            struct jr_result *rec = (struct jr_result *) h;
+            tot->matches_finished++;
+            if (rec->by < 3) {
+                tot->by[rec->by]++;
+            }
+            if (rec->winner == 0) {
+                tot->first_player_wins++;
+            }
+            tot->match_moves += h->turn;
+            if (h->turn > tot->longest) {
+                tot->longest = h->turn;
+            }
+            table_remove(t, r);
+        }
+    }
+}
+
+/*
+ * Map the segment at path and scan it.
+ * Return 0 on success, 1 on error.
+ */
+static int scan_file(const char *path, struct replay_table *t, struct totals *tot) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror(path);
+        close(fd);
+        return 1;
+    }
+    if (st.st_size < sizeof(struct journal_segment)) {
+        fprintf(stderr, "%s: not a journal segment\n", path);
+        close(fd);
+        return 1;
+    }
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    struct journal_segment *seg = (struct journal_segment *) data;
+    int err = 0;
+    if (seg->magic != JOURNAL_MAGIC || seg->version != JOURNAL_VERSION) {
+        fprintf(stderr, "%s: not a journal segment of version %d\n", path, JOURNAL_VERSION);
+        err = 1;
+    } else {
+        scan(path, data, st.st_size, t, tot);
+    }
+    munmap(data, st.st_size);
+    return err;
+}
+
+static void print_totals(struct totals *tot, double secs) {
+    printf("records          %ld (%.0f per second)\n", tot->records, tot->records / secs);
+    printf("matches          %ld started, %ld finished\n", tot->matches_started, tot->matches_finished);
+    for (int i = 0; i < 3; i++) {
+        printf("  by %-13s %ld\n", by_names[i], tot->by[i]);
+    }
+    if (tot->matches_finished > 0) {
+        printf("first player won %.1f%%\n", 100.0 * tot->first_player_wins / tot->matches_finished);
+        printf("match length     %.1f moves on average, %ld at most\n",
+            (double) tot->match_moves / tot->matches_finished, tot->longest);
+    }
+    printf("moves            %ld\n", tot->moves);
+    for (int i = 0; i < 4; i++) {
+        printf("  %c  %10ld  %5.1f%%  %.2f average\n", move_letters[i], tot->move_count[i],
+            tot->moves ? 100.0 * tot->move_count[i] / tot->moves : 0,
+            tot->move_count[i] ? (double) tot->move_amount[i] / tot->move_count[i] : 0);
+    }
+    if (tot->move_count[1] > 0) {
+        printf("power move hits  %.1f%%\n", 100.0 * tot->power_hits / tot->move_count[1]);
+    }
+    if (tot->unknown > 0) {
+        printf("records of matches started in earlier segments: %ld\n", tot->unknown);
+    }
+    if (verify) {
+        printf("replay           %ld mismatches\n", tot->mismatches);
+    }
+}
+
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-v] [-m match_id | -a] segment...\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "vam:")) != -1) {
+        switch (opt) {
+        case 'v': verify = 1; break;
+        case 'a': show_all = 1; break;
+        case 'm': show_id = strtoull(optarg, NULL, 10); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind == argc) {
+        usage(argv[0]);
+    }
+
+    struct replay_table t = { NULL, 0, 0 };
+    table_grow(&t);
+    struct totals tot;
+    memset(&tot, 0, sizeof(tot));
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int err = 0;
+    for (int i = optind; i < argc; i++) {
+        err |= scan_file(argv[i], &t, &tot);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    if (show_id == 0 && !show_all) {
+        print_totals(&tot, secs > 0 ? secs : 1e-9);
+    } else if (verify) {
+        printf("replay: %ld mismatches\n", tot.mismatches);
+    }
+    free(t.slots);
+    return err || tot.mismatches > 0;
+}
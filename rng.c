@@ -0,0 +1,24 @@
+#include "rng.h"
+
+/*
+ * One step of splitmix64, used to spread a seed over xoshiro's state.
+ */
+static uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+void rng_seed(struct rng *r, uint64_t seed) {
+    // splitmix64 never gives four zeros in a row, which xoshiro can't leave
+    for (int i = 0; i < 4; i++) {
+        r->s[i] = splitmix64(&seed);
+    }
+}
+
+uint64_t rng_derive(uint64_t base, uint64_t id) {
+    uint64_t x = base ^ rng_rotl(id, 32);
+    splitmix64(&x);
+    return splitmix64(&x);
+}
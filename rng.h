@@ -0,0 +1,54 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+/*
+ * xoshiro256** generator. Small and fast, and every match has its own,
+ * so matches share no random state and can be replayed from their seed.
+ */
+struct rng {
+    uint64_t s[4];
+};
+
+/*
+ * Seed r from a single 64-bit value.
+ */
+void rng_seed(struct rng *r, uint64_t seed);
+
+/*
+ * Return the seed of stream id under the server-wide seed base: the
+ * same base and id always give the same seed.
+ */
+uint64_t rng_derive(uint64_t base, uint64_t id);
+
+static inline uint64_t rng_rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+/*
+ * Return the next 64 random bits of r.
+ */
+static inline uint64_t rng_next(struct rng *r) {
+    uint64_t *s = r->s;
+    uint64_t result = rng_rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rng_rotl(s[3], 45);
+    return result;
+}
+
+/*
+ * Return a random number from 0 to n - 1, for small n. Multiplying
+ * instead of taking a remainder avoids a division, and the bias is
+ * below 2^-32 for the n used here.
+ */
+static inline int rng_below(struct rng *r, int n) {
+    return (int) (((rng_next(r) >> 32) * (uint64_t) n) >> 32);
+}
+
+#endif
@@ -0,0 +1,42 @@
+#include "rules.h"
+
+void rules_roll_fighter(struct rng *r, struct fighter *f) {
+    f->hitpoints = RULES_HITPOINTS + rng_below(r, RULES_HITPOINTS_SPREAD);
+    f->max_hitpoints = f->hitpoints;
+    f->powermoves = RULES_POWERMOVES + rng_below(r, RULES_POWERMOVES_SPREAD);
+    f->heals = RULES_HEALS + rng_below(r, RULES_HEALS_SPREAD);
+}
+
+int rules_move(struct rng *r, struct fighter *me, struct fighter *them, char move, int *amount) {
+    if (move == 'a') {
+        *amount = rules_attack(rng_next(r));
+        them->hitpoints -= *amount;
+        return RULES_DONE;
+
+    } else if (move == 'p') {
+        if (me->powermoves <= 0) {
+            return RULES_NO_POWERMOVES;
+        }
+        // whether it hits is drawn before how hard, hit or miss
+        uint64_t x = rng_next(r);
+        uint64_t y = rng_next(r);
+        *amount = rules_power(x, y);
+        them->hitpoints -= *amount;
+        me->powermoves -= 1;
+        return RULES_DONE;
+
+    } else if (move == 'h') {
+        if (me->heals <= 0) {
+            return RULES_NO_HEALS;
+        }
+        int missing = me->max_hitpoints - me->hitpoints;
+        if (missing <= 0) {
+            return RULES_FULL_HEALTH;
+        }
+        *amount = rules_heal(rng_next(r), missing);
+        me->hitpoints += *amount;
+        me->heals -= 1;
+        return RULES_DONE;
+    }
+    return RULES_INVALID;
+}
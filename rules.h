@@ -0,0 +1,134 @@
+#ifndef RULES_H
+#define RULES_H
+
+#include <stdint.h>
+
+#include "rng.h"
+
+/*
+ * Rules of a battle, free of any I/O, shared by the server, the journal
+ * reader and the simulator. Every roll is a pure function of random
+ * bits, so the simulator can feed them its own generators lane by lane
+ * while the server draws them from a match's rng in a fixed order.
+ *
+ * Each number is a compile-time knob, so a rule change can be tried out
+ * in the simulator before it goes anywhere near the server.
+ */
+
+// Starting hitpoints: RULES_HITPOINTS plus up to RULES_HITPOINTS_SPREAD - 1.
+#ifndef RULES_HITPOINTS
+    #define RULES_HITPOINTS 20
+#endif
+
+#ifndef RULES_HITPOINTS_SPREAD
+    #define RULES_HITPOINTS_SPREAD 5
+#endif
+
+// Starting power moves and heals, likewise.
+#ifndef RULES_POWERMOVES
+    #define RULES_POWERMOVES 1
+#endif
+
+#ifndef RULES_POWERMOVES_SPREAD
+    #define RULES_POWERMOVES_SPREAD 4
+#endif
+
+#ifndef RULES_HEALS
+    #define RULES_HEALS 1
+#endif
+
+#ifndef RULES_HEALS_SPREAD
+    #define RULES_HEALS_SPREAD 3
+#endif
+
+// A regular move does 0 to RULES_ATTACK_SPREAD - 1 damage.
+#ifndef RULES_ATTACK_SPREAD
+    #define RULES_ATTACK_SPREAD 6
+#endif
+
+// A power move hits one time in RULES_POWER_ODDS, for RULES_POWER_DAMAGE
+// plus up to RULES_POWER_SPREAD - 1.
+#ifndef RULES_POWER_ODDS
+    #define RULES_POWER_ODDS 3
+#endif
+
+#ifndef RULES_POWER_DAMAGE
+    #define RULES_POWER_DAMAGE 10
+#endif
+
+#ifndef RULES_POWER_SPREAD
+    #define RULES_POWER_SPREAD 10
+#endif
+
+// A heal gives back 1 to RULES_HEAL_MAX hitpoints, never past the
+// starting hitpoints.
+#ifndef RULES_HEAL_MAX
+    #define RULES_HEAL_MAX 10
+#endif
+
+/*
+ * One side of a battle.
+ */
+struct fighter {
+    int hitpoints;
+    int max_hitpoints;  // hitpoints at the start, as far as heals go
+    int powermoves;
+    int heals;
+};
+
+/*
+ * What rules_move() made of a move.
+ */
+#define RULES_DONE 0            // the move was made and used up the turn
+#define RULES_NO_POWERMOVES 1   // no power moves left
+#define RULES_NO_HEALS 2        // no heals left
+#define RULES_FULL_HEALTH 3     // nothing to heal
+#define RULES_INVALID 4         // not a move
+
+/*
+ * Return a number from 0 to n - 1 taken from the random bits x; see
+ * rng_below().
+ */
+static inline int rules_below(uint64_t x, int n) {
+    return (int) (((x >> 32) * (uint64_t) n) >> 32);
+}
+
+/*
+ * Damage of a regular move.
+ */
+static inline int rules_attack(uint64_t x) {
+    return rules_below(x, RULES_ATTACK_SPREAD);
+}
+
+/*
+ * Damage of a power move, 0 for a miss: x decides whether it hits and
+ * y how hard.
+ */
+static inline int rules_power(uint64_t x, uint64_t y) {
+    int hit = rules_below(x, RULES_POWER_ODDS) == 1;
+    int damage = RULES_POWER_DAMAGE + rules_below(y, RULES_POWER_SPREAD);
+    return hit ? damage : 0;
+}
+
+/*
+ * Hitpoints a heal gives back to a fighter missing missing (> 0) of them.
+ */
+static inline int rules_heal(uint64_t x, int missing) {
+    return 1 + rules_below(x, missing < RULES_HEAL_MAX ? missing : RULES_HEAL_MAX);
+}
+
+/*
+ * Roll a fighter's starting hitpoints, power moves and heals from r.
+ */
+void rules_roll_fighter(struct rng *r, struct fighter *f);
+
+/*
+ * Make move ('a', 'p' or 'h') for fighter me against them, drawing the
+ * rolls from r. *amount is set to the damage done or the hitpoints
+ * healed.
+ *
+ * Return RULES_DONE if the move was made, or why it could not be.
+ */
+int rules_move(struct rng *r, struct fighter *me, struct fighter *them, char move, int *amount);
+
+#endif
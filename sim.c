@@ -0,0 +1,375 @@
+/*
+ * Battle simulator.
+ *
+ * Plays bot against bot with the server's rules and no I/O, on every
+ * core, and reports how the rules play out: win rate of the player who
+ * moves first, match length and how often each move is used. Rule knobs
+ * in rules.h can be changed on the command line (-DRULES_...) to try a
+ * change out before it goes near the server.
+ *
+ * Each thread keeps a batch of matches side by side as a struct of
+ * arrays and advances every one of them by a turn in the same loop, with
+ * no branches, so that the compiler can vectorize it. A lane whose match
+ * is over is refilled with the next match. Every match is seeded from its
+ * number the way the server seeds matches from their id, so the totals
+ * only depend on the seed, whatever the number of threads.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "rng.h"
+#include "rules.h"
+
+// Matches advanced side by side by each thread.
+#ifndef SIM_LANES
+    #define SIM_LANES 1024
+#endif
+
+// Longest match length counted on its own; longer ones share the last bucket.
+#define SIM_MAX_TURNS 256
+
+#define MOVE_ATTACK 0
+#define MOVE_POWER 1
+#define MOVE_HEAL 2
+
+#define POLICY_RANDOM 0     // any move on the menu, like loadgen's bots
+#define POLICY_SMART 1      // heal when hurt, power moves first
+
+/*
+ * A batch of matches, one per lane. Side 0 moves first.
+ */
+struct batch {
+    uint64_t s[4][SIM_LANES];               // each lane's rng
+    int32_t hitpoints[2][SIM_LANES];
+    int32_t max_hitpoints[2][SIM_LANES];
+    int32_t powermoves[2][SIM_LANES];
+    int32_t heals[2][SIM_LANES];
+    int32_t turns[SIM_LANES];               // turns taken so far
+    int32_t active[SIM_LANES];              // 0 once there is no match left to play
+};
+
+struct totals {
+    long matches;
+    long first_wins;
+    long moves[3];
+    long power_hits;
+    long power_damage;
+    long attack_damage;
+    long healed;
+    long turns[SIM_MAX_TURNS + 1];
+};
+
+struct sim_thread {
+    pthread_t thread;
+    uint64_t seed;
+    int policy;
+    long first;         // number of the first match this thread plays
+    long count;
+    struct totals tot;
+};
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * rng_next() on lane state held in locals, so the loop keeps it in
+ * registers.
+ */
+static inline uint64_t lane_next(uint64_t *s0, uint64_t *s1, uint64_t *s2, uint64_t *s3) {
+    uint64_t result = rng_rotl(*s1 * 5, 7) * 9;
+    uint64_t t = *s1 << 17;
+    *s2 ^= *s0;
+    *s3 ^= *s1;
+    *s1 ^= *s2;
+    *s0 ^= *s3;
+    *s2 ^= t;
+    *s3 = rng_rotl(*s3, 45);
+    return result;
+}
+
+/*
+ * Start match number n in lane i, rolling both fighters the way
+ * start_match() does.
+ */
+static void fill_lane(struct batch *b, int i, uint64_t seed, long n) {
+    struct rng r;
+    rng_seed(&r, rng_derive(seed, n));
+    for (int side = 0; side < 2; side++) {
+        struct fighter f;
+        rules_roll_fighter(&r, &f);
+        b->hitpoints[side][i] = f.hitpoints;
+        b->max_hitpoints[side][i] = f.max_hitpoints;
+        b->powermoves[side][i] = f.powermoves;
+        b->heals[side][i] = f.heals;
+    }
+    for (int k = 0; k < 4; k++) {
+        b->s[k][i] = r.s[k];
+    }
+    b->turns[i] = 0;
+    b->active[i] = 1;
+}
+
+/*
+ * Return a where mask is all ones and b where it is zero.
+ */
+static inline int32_t pick(int32_t mask, int32_t a, int32_t b) {
+    return (a & mask) | (b & ~mask);
+}
+
+/*
+ * Take one turn in every lane. Every outcome is computed and the one of
+ * the chosen move selected, so there is no branch to keep the loop from
+ * being vectorized. Lanes with no match left still take turns but are
+ * not counted.
+ */
+static inline void step(struct batch *b, struct totals *tot, int policy) {
+    // one turn of a batch fits in 32 bits, and sums that wide vectorize best
+    int32_t attacks = 0, powers = 0, heals = 0;
+    int32_t power_hits = 0, power_damage = 0, attack_damage = 0, healed = 0;
+
+    for (int i = 0; i < SIM_LANES; i++) {
+        uint64_t s0 = b->s[0][i], s1 = b->s[1][i], s2 = b->s[2][i], s3 = b->s[3][i];
+        uint64_t choice = lane_next(&s0, &s1, &s2, &s3);
+        uint64_t x = lane_next(&s0, &s1, &s2, &s3);
+        uint64_t y = lane_next(&s0, &s1, &s2, &s3);
+        b->s[0][i] = s0;
+        b->s[1][i] = s1;
+        b->s[2][i] = s2;
+        b->s[3][i] = s3;
+
+        // p is the side to move, and them all ones when it is side 1
+        int32_t p = b->turns[i] & 1;
+        int32_t them = -p;
+        int32_t hp0 = b->hitpoints[0][i], hp1 = b->hitpoints[1][i];
+        int32_t pm0 = b->powermoves[0][i], pm1 = b->powermoves[1][i];
+        int32_t heals0 = b->heals[0][i], heals1 = b->heals[1][i];
+        int32_t my_hp = pick(them, hp1, hp0);
+        int32_t missing = pick(them, b->max_hitpoints[1][i], b->max_hitpoints[0][i]) - my_hp;
+        int32_t can_power = pick(them, pm1, pm0) > 0;
+        int32_t can_heal = (pick(them, heals1, heals0) > 0) & (missing > 0);
+
+        // the random bots pick one of the moves on offer, in menu order
+        int32_t k = rules_below(choice, 1 + can_power + can_heal);
+        int32_t random_move = k == 0 ? MOVE_ATTACK : (k == 1) & can_power ? MOVE_POWER : MOVE_HEAL;
+        int32_t smart_move = can_heal & (missing >= RULES_HEAL_MAX) ? MOVE_HEAL
+            : can_power ? MOVE_POWER : MOVE_ATTACK;
+        int32_t move = policy == POLICY_SMART ? smart_move : random_move;
+
+        int32_t attack = rules_attack(x);
+        int32_t power = rules_power(x, y);
+        int32_t heal = rules_heal(x, missing > 0 ? missing : 1);
+        int32_t used_attack = move == MOVE_ATTACK;
+        int32_t used_power = move == MOVE_POWER;
+        int32_t used_heal = move == MOVE_HEAL;
+        int32_t damage = used_attack * attack + used_power * power;
+        int32_t gain = used_heal * heal;
+
+        b->hitpoints[0][i] = hp0 + pick(them, -damage, gain);
+        b->hitpoints[1][i] = hp1 + pick(them, gain, -damage);
+        b->powermoves[0][i] = pm0 - (used_power & ~them);
+        b->powermoves[1][i] = pm1 - (used_power & them);
+        b->heals[0][i] = heals0 - (used_heal & ~them);
+        b->heals[1][i] = heals1 - (used_heal & them);
+        b->turns[i] += 1;
+
+        int32_t on = b->active[i];
+        attacks += on & used_attack;
+        powers += on & used_power;
+        heals += on & used_heal;
+        power_hits += on & used_power & (power > 0);
+        power_damage += (on & used_power) * power;
+        attack_damage += (on & used_attack) * attack;
+        healed += on * gain;
+    }
+
+    tot->moves[MOVE_ATTACK] += attacks;
+    tot->moves[MOVE_POWER] += powers;
+    tot->moves[MOVE_HEAL] += heals;
+    tot->power_hits += power_hits;
+    tot->power_damage += power_damage;
+    tot->attack_damage += attack_damage;
+    tot->healed += healed;
+}
+
+/*
+ * Count the matches that the last turn ended and start new ones in their
+ * lanes. Return the number of lanes still playing.
+ */
+static int refill(struct batch *b, struct totals *tot, struct sim_thread *t, long *next) {
+    int playing = 0;
+    for (int i = 0; i < SIM_LANES; i++) {
+        if (!b->active[i]) {
+            continue;
+        }
+        if (b->hitpoints[0][i] > 0 && b->hitpoints[1][i] > 0) {
+            playing++;
+            continue;
+        }
+        // only the player who moved can have taken the other below zero
+        int winner = (b->turns[i] - 1) & 1;
+        int turns = b->turns[i] < SIM_MAX_TURNS ? b->turns[i] : SIM_MAX_TURNS;
+        tot->matches++;
+        tot->first_wins += winner == 0;
+        tot->turns[turns]++;
+        if (*next < t->first + t->count) {
+            fill_lane(b, i, t->seed, (*next)++);
+            playing++;
+        } else {
+            b->active[i] = 0;
+        }
+    }
+    return playing;
+}
+
+static void *run_thread(void *arg) {
+    struct sim_thread *t = arg;
+    struct batch *b = aligned_alloc(64, sizeof(struct batch));
+    if (b == NULL) {
+        perror("aligned_alloc");
+        exit(1);
+    }
+    memset(b, 0, sizeof(struct batch));
+
+    long next = t->first;
+    int playing = 0;
+    for (int i = 0; i < SIM_LANES && next < t->first + t->count; i++) {
+        fill_lane(b, i, t->seed, next++);
+        playing++;
+    }
+    while (playing > 0) {
+        if (t->policy == POLICY_SMART) {
+            step(b, &t->tot, POLICY_SMART);
+        } else {
+            step(b, &t->tot, POLICY_RANDOM);
+        }
+        playing = refill(b, &t->tot, t, &next);
+    }
+    free(b);
+    return NULL;
+}
+
+/*
+ * Return the smallest match length at or above fraction q of the matches.
+ */
+static int turns_quantile(struct totals *tot, double q) {
+    long want = (long) (q * tot->matches);
+    long seen = 0;
+    for (int i = 0; i <= SIM_MAX_TURNS; i++) {
+        seen += tot->turns[i];
+        if (seen > want) {
+            return i;
+        }
+    }
+    return SIM_MAX_TURNS;
+}
+
+static void print_totals(struct totals *tot, double secs, int num_threads, char *policy) {
+    long total_moves = tot->moves[MOVE_ATTACK] + tot->moves[MOVE_POWER] + tot->moves[MOVE_HEAL];
+    long total_turns = 0;
+    int longest = 0;
+    for (int i = 0; i <= SIM_MAX_TURNS; i++) {
+        total_turns += (long) i * tot->turns[i];
+        if (tot->turns[i] > 0) {
+            longest = i;
+        }
+    }
+    double matches = tot->matches > 0 ? tot->matches : 1;
+    double moves = total_moves > 0 ? total_moves : 1;
+
+    printf("matches          %ld in %.3fs, %.0f matches/sec (%d threads, %s bots)\n",
+        tot->matches, secs, tot->matches / secs, num_threads, policy);
+    printf("first mover wins %.2f%%\n", 100.0 * tot->first_wins / matches);
+    printf("turns            mean %.2f, p50 %d, p99 %d, max %d%s\n", total_turns / matches,
+        turns_quantile(tot, 0.5), turns_quantile(tot, 0.99), longest, longest == SIM_MAX_TURNS ? "+" : "");
+    printf("attacks          %ld (%.1f%%), %.2f damage each\n", tot->moves[MOVE_ATTACK],
+        100.0 * tot->moves[MOVE_ATTACK] / moves,
+        tot->moves[MOVE_ATTACK] ? (double) tot->attack_damage / tot->moves[MOVE_ATTACK] : 0);
+    printf("power moves      %ld (%.1f%%), %.1f%% hit, %.2f damage each hit\n", tot->moves[MOVE_POWER],
+        100.0 * tot->moves[MOVE_POWER] / moves,
+        tot->moves[MOVE_POWER] ? 100.0 * tot->power_hits / tot->moves[MOVE_POWER] : 0,
+        tot->power_hits ? (double) tot->power_damage / tot->power_hits : 0);
+    printf("heals            %ld (%.1f%%), %.2f hitpoints each\n", tot->moves[MOVE_HEAL],
+        100.0 * tot->moves[MOVE_HEAL] / moves,
+        tot->moves[MOVE_HEAL] ? (double) tot->healed / tot->moves[MOVE_HEAL] : 0);
+}
+
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-n matches] [-t threads] [-s seed] [-p random|smart]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    long num_matches = 10000000;
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t seed = 1;
+    char *policy = "random";
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:s:p:")) != -1) {
+        switch (opt) {
+        case 'n': num_matches = atol(optarg); break;
+        case 't': num_threads = atoi(optarg); break;
+        case 's': seed = strtoull(optarg, NULL, 0); break;
+        case 'p': policy = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (strcmp(policy, "random") != 0 && strcmp(policy, "smart") != 0) {
+        usage(argv[0]);
+    }
+    if (num_matches < 1 || num_threads < 1) {
+        usage(argv[0]);
+    }
+
+    struct sim_thread *threads = calloc(num_threads, sizeof(struct sim_thread));
+    if (threads == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    long long start = now_ns();
+    long first = 0;
+    for (int i = 0; i < num_threads; i++) {
+        struct sim_thread *t = &threads[i];
+        t->seed = seed;
+        t->policy = strcmp(policy, "smart") == 0 ? POLICY_SMART : POLICY_RANDOM;
+        t->first = first;
+        t->count = num_matches / num_threads + (i < num_matches % num_threads);
+        first += t->count;
+        if (pthread_create(&t->thread, NULL, run_thread, t) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    struct totals total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < num_threads; i++) {
+        struct totals *tot = &threads[i].tot;
+        pthread_join(threads[i].thread, NULL);
+        total.matches += tot->matches;
+        total.first_wins += tot->first_wins;
+        for (int k = 0; k < 3; k++) {
+            total.moves[k] += tot->moves[k];
+        }
+        total.power_hits += tot->power_hits;
+        total.power_damage += tot->power_damage;
+        total.attack_damage += tot->attack_damage;
+        total.healed += tot->healed;
+        for (int k = 0; k <= SIM_MAX_TURNS; k++) {
+            total.turns[k] += tot->turns[k];
+        }
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    print_totals(&total, elapsed, num_threads, policy);
+    free(threads);
+    return 0;
+}
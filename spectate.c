@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spectate.h"
+#include "metrics.h"
+#include "proto.h"
+
+static int backed_up(struct client_sock *c) {
+    return c->want_write || c->out.pending > SPECTATOR_BACKLOG;
+}
+
+/*
+ * Queue update b to spectator c, or hold it back in place of any
+ * update already held back if c is not keeping up. Updates carry the
+ * whole state, so skipping one loses nothing the next does not repeat.
+ */
+static void deliver(struct client_sock *c, struct shared_buf *b) {
+    if (backed_up(c)) {
+        if (c->watch_pending != NULL) {
+            shared_release(c->watch_pending);
+            metric_add(M_SPECTATOR_COALESCED, 1);
+        }
+        shared_retain(b);
+        c->watch_pending = b;
+        return;
+    }
+    if (out_append_shared(&c->out, b) == 0) {
+        mark_dirty(c);
+    }
+}
+
+/*
+ * Queue a text and a binary encoding of the same update to every
+ * spectator of m, each spectator getting the one of its protocol.
+ */
+static void fan_out(struct match *m, const char *text, int text_len, const char *frame, int frame_len) {
+    struct shared_buf *text_buf = NULL;
+    struct shared_buf *frame_buf = NULL;
+    for (struct client_sock *c = m->spectators; c != NULL; c = c->watch_next) {
+        struct shared_buf **b = c->proto == PROTO_BINARY ? &frame_buf : &text_buf;
+        if (*b == NULL) {
+            *b = c->proto == PROTO_BINARY ? shared_new(frame, frame_len) : shared_new(text, text_len);
+            if (*b == NULL) {
+                continue;
+            }
+        }
+        deliver(c, *b);
+    }
+    if (text_buf != NULL) {
+        shared_release(text_buf);
+    }
+    if (frame_buf != NULL) {
+        shared_release(frame_buf);
+    }
+}
+
+/*
+ * Encode the state of m for spectators.
+ * Return the length of the text, and set *frame_len to that of the frame.
+ */
+static int encode_state(struct match *m, char *text, int size, char *frame, int *frame_len) {
+    struct proto_watch_state state = { m->turn, { m->fighters[0].hitpoints, m->fighters[1].hitpoints } };
+    *frame_len = encode_frame(frame, OP_WATCH_STATE, &state, sizeof(state));
+    return snprintf(text, size, "[watch] %s %d hp, %s %d hp; %s to move\n",
+        m->players[0]->name->text, m->fighters[0].hitpoints, m->players[1]->name->text, m->fighters[1].hitpoints,
+        m->players[m->turn]->name->text);
+}
+
+void spectate_join(struct match *m, struct client_sock *c) {
+    c->watch_prev = NULL;
+    c->watch_next = m->spectators;
+    if (m->spectators != NULL) {
+        m->spectators->watch_prev = c;
+    }
+    m->spectators = c;
+    m->num_spectators++;
+    c->watching = m;
+    metric_add(M_SPECTATORS, 1);
+}
+
+void spectate_start(struct match *m, struct client_sock *c) {
+    if (c->watching == m) {
+        return;
+    }
+    spectate_stop(c);
+    spectate_join(m, c);
+
+    char text[BUF_SIZE + 2 * MAX_NAME];
+    char frame[PROTO_HEADER + PROTO_MAX_PAYLOAD];
+    int frame_len;
+    int text_len = encode_state(m, text, sizeof(text), frame, &frame_len);
+    if (c->proto == PROTO_BINARY) {
+        char names[2 * (MAX_NAME + 1)];
+        int n0 = m->players[0]->name->len + 1;
+        int n1 = m->players[1]->name->len + 1;
+        memcpy(names, m->players[0]->name->text, n0);
+        memcpy(names + n0, m->players[1]->name->text, n1);
+        write_frame_to_client(c, OP_WATCH, names, n0 + n1);
+        out_append(&c->out, frame, frame_len);
+    } else {
+        char msg[BUF_SIZE + 2 * MAX_NAME];
+        snprintf(msg, sizeof(msg), "Now watching %s vs %s.\n", m->players[0]->name->text, m->players[1]->name->text);
+        write_buf_to_client(c, msg, strlen(msg));
+        out_append(&c->out, text, text_len);
+    }
+}
+
+void spectate_stop(struct client_sock *c) {
+    if (c->watch_pending != NULL) {
+        // possibly the result of a match that has already ended
+        shared_release(c->watch_pending);
+        c->watch_pending = NULL;
+    }
+    struct match *m = c->watching;
+    if (m == NULL) {
+        return;
+    }
+    if (c->watch_prev != NULL) {
+        c->watch_prev->watch_next = c->watch_next;
+    } else {
+        m->spectators = c->watch_next;
+    }
+    if (c->watch_next != NULL) {
+        c->watch_next->watch_prev = c->watch_prev;
+    }
+    m->num_spectators--;
+    c->watching = NULL;
+    metric_add(M_SPECTATORS, -1);
+}
+
+void spectate_update(struct match *m) {
+    if (m->spectators == NULL) {
+        return;
+    }
+    char text[BUF_SIZE + 2 * MAX_NAME];
+    char frame[PROTO_HEADER + PROTO_MAX_PAYLOAD];
+    int frame_len;
+    int text_len = encode_state(m, text, sizeof(text), frame, &frame_len);
+    fan_out(m, text, text_len, frame, frame_len);
+}
+
+void spectate_end(struct match *m, int winner, int by) {
+    if (m->spectators == NULL) {
+        return;
+    }
+    char *won = m->players[winner]->name->text;
+    char *lost = m->players[1 - winner]->name->text;
+    char text[BUF_SIZE + 2 * MAX_NAME];
+    int text_len;
+    if (by == PROTO_BY_DISCONNECT) {
+        text_len = snprintf(text, sizeof(text), "[watch] %s dropped; %s wins.\n", lost, won);
+    } else if (by == PROTO_BY_TIMEOUT) {
+        text_len = snprintf(text, sizeof(text), "[watch] %s ran out of time; %s wins.\n", lost, won);
+    } else {
+        text_len = snprintf(text, sizeof(text), "[watch] %s beat %s.\n", won, lost);
+    }
+    char frame[PROTO_HEADER + 2];
+    unsigned char result[2] = { winner, by };
+    int frame_len = encode_frame(frame, OP_WATCH_RESULT, result, sizeof(result));
+    fan_out(m, text, text_len, frame, frame_len);
+
+    // The result may still be held back; it goes out when the spectator
+    // catches up, as it has nothing else to say.
+    struct client_sock *c = m->spectators;
+    while (c != NULL) {
+        struct client_sock *next = c->watch_next;
+        c->watching = NULL;
+        c = next;
+    }
+    metric_add(M_SPECTATORS, -m->num_spectators);
+    m->spectators = NULL;
+    m->num_spectators = 0;
+}
+
+void spectate_catch_up(struct client_sock *c) {
+    if (c->watch_pending == NULL || backed_up(c)) {
+        return;
+    }
+    if (out_append_shared(&c->out, c->watch_pending) == 0) {
+        mark_dirty(c);
+    }
+    shared_release(c->watch_pending);
+    c->watch_pending = NULL;
+}
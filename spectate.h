@@ -0,0 +1,49 @@
+#ifndef SPECTATE_H
+#define SPECTATE_H
+
+#include "client.h"
+#include "game.h"
+
+// Output a spectator may have waiting before its updates are held back.
+// Only the latest held-back update is kept, and sent once it catches up.
+#ifndef SPECTATOR_BACKLOG
+    #define SPECTATOR_BACKLOG 4096
+#endif
+
+/*
+ * Make client c a spectator of match m, instead of any match it was
+ * watching, and send it the players and the state of the match.
+ */
+void spectate_start(struct match *m, struct client_sock *c);
+
+/*
+ * Add client c, which is not spectating, to the spectators of match m
+ * without sending it anything.
+ */
+void spectate_join(struct match *m, struct client_sock *c);
+
+/*
+ * Stop client c spectating, if it is, dropping any update held back
+ * for it.
+ */
+void spectate_stop(struct client_sock *c);
+
+/*
+ * Send every spectator of m the state of the match at the start of a
+ * turn. The update is encoded once per protocol and the same buffer is
+ * queued to every spectator.
+ */
+void spectate_update(struct match *m);
+
+/*
+ * Send every spectator of m the result of the match, and stop them
+ * spectating it.
+ */
+void spectate_end(struct match *m, int winner, int by);
+
+/*
+ * Queue the update held back for client c, if its output has drained.
+ */
+void spectate_catch_up(struct client_sock *c);
+
+#endif
@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stats.h"
+#include "game.h"
+#include "matchmaking.h"
+#include "metrics.h"
+#include "proto.h"
+
+static struct stats_file *file = NULL;
+static struct player_stats *slots = NULL;
+static size_t map_size = 0;
+static uint64_t mask = 0;
+static uint64_t used = 0;      // slots in use; only changed under insert_lock
+
+// Lookups probe without it; adding a player takes it.
+static pthread_mutex_t insert_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * FNV-1a, with 0 kept free to mark an empty slot.
+ */
+static uint64_t hash_name(const char *name) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (; *name != '\0'; name++) {
+        h ^= (unsigned char) *name;
+        h *= 0x100000001b3ULL;
+    }
+    return h != 0 ? h : 1;
+}
+
+static int damaged(const struct player_stats *s) {
+    return memchr(s->name, '\0', STATS_NAME) == NULL || hash_name(s->name) != s->hash;
+}
+
+/*
+ * Slot i has just been cleared. Put back every record probed past it,
+ * as an empty slot ends a probe and they would no longer be found,
+ * dropping any of them that is damaged too.
+ */
+static void reseat_after(uint64_t i) {
+    for (uint64_t j = (i + 1) & mask; slots[j].hash != 0; j = (j + 1) & mask) {
+        struct player_stats r = slots[j];
+        memset(&slots[j], 0, sizeof(r));
+        if (damaged(&r)) {
+            fprintf(stderr, "stats: clearing damaged slot %llu\n", (unsigned long long) j);
+            continue;
+        }
+        uint64_t k = r.hash & mask;
+        while (slots[k].hash != 0) {
+            k = (k + 1) & mask;
+        }
+        slots[k] = r;
+    }
+}
+
+/*
+ * Clear any slots a crash left half written, then count those in use.
+ */
+static void check_slots() {
+    for (uint64_t i = 0; i <= mask; i++) {
+        struct player_stats *s = &slots[i];
+        if (s->hash != 0 && damaged(s)) {
+            fprintf(stderr, "stats: clearing damaged slot %llu\n", (unsigned long long) i);
+            memset(s, 0, sizeof(*s));
+            reseat_after(i);
+        }
+    }
+    for (uint64_t i = 0; i <= mask; i++) {
+        if (slots[i].hash != 0) {
+            used++;
+        }
+    }
+}
+
+int stats_open(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("stats: open");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("stats: fstat");
+        close(fd);
+        return 1;
+    }
+
+    uint64_t capacity = STATS_CAPACITY;
+    struct stats_file hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    if (st.st_size >= sizeof(hdr) && pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        perror("stats: pread");
+        close(fd);
+        return 1;
+    }
+    if (hdr.magic == 0) {
+        // new store; the magic goes in last, so a crash while setting
+        // it up leaves a file that is set up again next time
+        map_size = sizeof(struct stats_file) + capacity * sizeof(struct player_stats);
+        if (ftruncate(fd, map_size) < 0) {
+            perror("stats: ftruncate");
+            close(fd);
+            return 1;
+        }
+    } else {
+        if (hdr.magic != STATS_MAGIC
+                || hdr.version != STATS_VERSION || hdr.slot_size != sizeof(struct player_stats)
+                || hdr.capacity == 0 || (hdr.capacity & (hdr.capacity - 1)) != 0
+                || st.st_size < sizeof(hdr) + hdr.capacity * sizeof(struct player_stats)) {
+            fprintf(stderr, "stats: %s is not a player store\n", path);
+            close(fd);
+            return 1;
+        }
+        capacity = hdr.capacity;
+        map_size = sizeof(struct stats_file) + capacity * sizeof(struct player_stats);
+    }
+
+    void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("stats: mmap");
+        return 1;
+    }
+    file = map;
+    slots = (struct player_stats *) (file + 1);
+    mask = capacity - 1;
+    used = 0;
+
+    if (file->magic == 0) {
+        file->capacity = capacity;
+        file->slot_size = sizeof(struct player_stats);
+        file->version = STATS_VERSION;
+        msync(file, sizeof(*file), MS_SYNC);
+        file->magic = STATS_MAGIC;
+    } else {
+        check_slots();
+    }
+    printf("Player store: %llu of %llu slots in use\n",
+        (unsigned long long) used, (unsigned long long) capacity);
+    return 0;
+}
+
+/*
+ * Return the slot of name, whose hash is h, or NULL and set *free_slot
+ * to the free slot that ended the probe.
+ */
+static struct player_stats *find(uint64_t h, const char *name, uint64_t *free_slot) {
+    for (uint64_t i = h & mask; ; i = (i + 1) & mask) {
+        struct player_stats *s = &slots[i];
+        uint64_t sh = __atomic_load_n(&s->hash, __ATOMIC_ACQUIRE);
+        if (sh == 0) {
+            *free_slot = i;
+            return NULL;
+        }
+        if (sh == h && strcmp(s->name, name) == 0) {
+            return s;
+        }
+    }
+}
+
+struct player_stats *stats_lookup(const char *name) {
+    if (slots == NULL || strlen(name) >= STATS_NAME) {
+        return NULL;
+    }
+    uint64_t h = hash_name(name);
+    uint64_t i;
+    struct player_stats *s = find(h, name, &i);
+    if (s != NULL) {
+        return s;
+    }
+
+    pthread_mutex_lock(&insert_lock);
+    // another worker may have added them since
+    s = find(h, name, &i);
+    if (s == NULL && used * 100 < (mask + 1) * STATS_MAX_LOAD) {
+        s = &slots[i];
+        strcpy(s->name, name);
+        s->wins = 0;
+        s->losses = 0;
+        s->rating = RATING_START;
+        s->disconnects = 0;
+        s->damage_dealt = 0;
+        s->damage_taken = 0;
+        // the slot is seen as in use only once the rest of it is written
+        __atomic_store_n(&s->hash, h, __ATOMIC_RELEASE);
+        used++;
+        metric_add(M_PLAYERS_ADDED, 1);
+    } else if (s == NULL) {
+        metric_add(M_PLAYERS_NOT_STORED, 1);
+    }
+    pthread_mutex_unlock(&insert_lock);
+    return s;
+}
+
+void stats_record(struct match *m, int winner, int by) {
+    struct player_stats *won = m->players[winner]->stats;
+    struct player_stats *lost = m->players[1 - winner]->stats;
+    // A player is online only once, so only this worker writes their
+    // slot; the updates are atomic so that the worker they next log in
+    // on never reads a torn value.
+    if (won != NULL) {
+        __atomic_fetch_add(&won->wins, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&won->damage_dealt, m->damage[winner], __ATOMIC_RELAXED);
+        __atomic_fetch_add(&won->damage_taken, m->damage[1 - winner], __ATOMIC_RELAXED);
+        __atomic_store_n(&won->rating, m->players[winner]->rating, __ATOMIC_RELAXED);
+    }
+    if (lost != NULL) {
+        __atomic_fetch_add(&lost->losses, 1, __ATOMIC_RELAXED);
+        if (by == PROTO_BY_DISCONNECT) {
+            __atomic_fetch_add(&lost->disconnects, 1, __ATOMIC_RELAXED);
+        }
+        __atomic_fetch_add(&lost->damage_dealt, m->damage[1 - winner], __ATOMIC_RELAXED);
+        __atomic_fetch_add(&lost->damage_taken, m->damage[winner], __ATOMIC_RELAXED);
+        __atomic_store_n(&lost->rating, m->players[1 - winner]->rating, __ATOMIC_RELAXED);
+    }
+}
+
+void stats_close() {
+    if (file == NULL) {
+        return;
+    }
+    msync(file, map_size, MS_SYNC);
+    munmap(file, map_size);
+    file = NULL;
+    slots = NULL;
+}
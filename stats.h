@@ -0,0 +1,82 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+/*
+ * Player store: lifetime statistics of every player who ever logged in,
+ * kept in one memory-mapped file and updated in place. The file is a
+ * stats_file header followed by an open-addressing hash table of
+ * player_stats slots, probed linearly from the hash of the user name.
+ * A slot is one cache line, so finding a player usually costs one or
+ * two cache misses.
+ */
+#define STATS_MAGIC 0x54415453      // "STAT"
+#define STATS_VERSION 1
+
+// Slots in a newly created store; a power of two. The file is created
+// sparse, so slots take no disk space until they are used.
+#ifndef STATS_CAPACITY
+    #define STATS_CAPACITY (1 << 20)
+#endif
+
+// Percentage of slots that may be used before new players are no
+// longer added, to keep probe sequences short.
+#ifndef STATS_MAX_LOAD
+    #define STATS_MAX_LOAD 90
+#endif
+
+#define STATS_NAME 24
+
+struct stats_file {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;
+    uint32_t slot_size;
+    uint8_t pad[44];
+};
+
+/*
+ * One player's slot. A slot is in use once hash is set, which is done
+ * last when a player is added, so a slot torn by a crash reads as free.
+ */
+struct player_stats {
+    uint64_t hash;          // of name, never 0; 0 if the slot is free
+    char name[STATS_NAME];  // NULL-terminated
+    uint32_t wins;
+    uint32_t losses;
+    int32_t rating;
+    uint32_t disconnects;   // matches lost by leaving them
+    uint64_t damage_dealt;
+    uint64_t damage_taken;
+};
+
+struct match;
+
+/*
+ * Map the store at path, creating it if it does not exist. Slots whose
+ * hash does not match their name are cleared, and the records after
+ * them moved so their probes still reach them.
+ * Return 0 on success, 1 on error.
+ */
+int stats_open(const char *path);
+
+/*
+ * Return the slot of player name, adding the player if they are new.
+ * Safe to call from any worker. Return NULL without a store, or if the
+ * store is too full to add the player.
+ */
+struct player_stats *stats_lookup(const char *name);
+
+/*
+ * Add the result of match m, won by player winner, to the stats of
+ * both players.
+ */
+void stats_record(struct match *m, int winner, int by);
+
+/*
+ * Write the store out and unmap it.
+ */
+void stats_close();
+
+#endif
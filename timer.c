@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "timer.h"
+
+#define TIMER_EXPIRED_LEVEL TIMER_LEVELS
+#define TIMER_MAX_TICKS ((1UL << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1)
+
+unsigned long timer_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+void timer_wheel_init(struct timer_wheel *w, unsigned long now_ms) {
+    memset(w, 0, sizeof(struct timer_wheel));
+    w->now = now_ms / TIMER_TICK_MS;
+}
+
+void timer_init(struct timer *t, void *data) {
+    t->prev = NULL;
+    t->next = NULL;
+    t->level = -1;
+    t->slot = 0;
+    t->kind = 0;
+    t->data = data;
+}
+
+static void push(struct timer **head, struct timer *t) {
+    t->prev = NULL;
+    t->next = *head;
+    if (*head != NULL) {
+        (*head)->prev = t;
+    }
+    *head = t;
+}
+
+static void unlink_timer(struct timer **head, struct timer *t) {
+    if (t->prev != NULL) {
+        t->prev->next = t->next;
+    } else {
+        *head = t->next;
+    }
+    if (t->next != NULL) {
+        t->next->prev = t->prev;
+    }
+    t->prev = NULL;
+    t->next = NULL;
+}
+
+/*
+ * Put t in the lowest level whose slots reach its expiry: the level
+ * at which it is less than one revolution of slots away.
+ */
+static void place(struct timer_wheel *w, struct timer *t) {
+    int level = 0;
+    while (level < TIMER_LEVELS - 1
+            && (t->expires >> (TIMER_SLOT_BITS * level)) - (w->now >> (TIMER_SLOT_BITS * level)) >= TIMER_SLOTS) {
+        level++;
+    }
+    int slot = (t->expires >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1);
+    t->level = level;
+    t->slot = slot;
+    push(&w->slots[level][slot], t);
+    w->occupied[level] |= 1ULL << slot;
+}
+
+void timer_arm(struct timer_wheel *w, struct timer *t, int kind, unsigned long ms) {
+    timer_cancel(w, t);
+    // round up so a timer never fires early, and always fire on a later tick
+    unsigned long ticks = (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (ticks == 0) {
+        ticks = 1;
+    } else if (ticks > TIMER_MAX_TICKS) {
+        ticks = TIMER_MAX_TICKS;
+    }
+    t->kind = kind;
+    t->expires = w->now + ticks;
+    place(w, t);
+    w->count++;
+}
+
+unsigned long timer_remaining(struct timer_wheel *w, struct timer *t) {
+    if (t->level < 0 || t->level == TIMER_EXPIRED_LEVEL || t->expires <= w->now) {
+        return 0;
+    }
+    return (t->expires - w->now) * TIMER_TICK_MS;
+}
+
+void timer_cancel(struct timer_wheel *w, struct timer *t) {
+    if (t->level < 0) {
+        return;
+    }
+    if (t->level == TIMER_EXPIRED_LEVEL) {
+        unlink_timer(&w->expired, t);
+    } else {
+        unlink_timer(&w->slots[t->level][t->slot], t);
+        if (w->slots[t->level][t->slot] == NULL) {
+            w->occupied[t->level] &= ~(1ULL << t->slot);
+        }
+        w->count--;
+    }
+    t->level = -1;
+}
+
+/*
+ * Move every timer in the given slot to where it belongs now.
+ */
+static void cascade(struct timer_wheel *w, int level, int slot) {
+    struct timer *t = w->slots[level][slot];
+    w->slots[level][slot] = NULL;
+    w->occupied[level] &= ~(1ULL << slot);
+    while (t != NULL) {
+        struct timer *next = t->next;
+        place(w, t);
+        t = next;
+    }
+}
+
+void timer_advance(struct timer_wheel *w, unsigned long now_ms) {
+    unsigned long target = now_ms / TIMER_TICK_MS;
+    while (w->now < target) {
+        if (w->count == 0) {
+            w->now = target;
+            break;
+        }
+        if (w->occupied[0] == 0) {
+            // Nothing is due before level 0 next wraps around
+            unsigned long wrap = (w->now | (TIMER_SLOTS - 1)) + 1;
+            if (wrap > target) {
+                w->now = target;
+                break;
+            }
+            w->now = wrap - 1;
+        }
+
+        w->now++;
+        int slot = w->now & (TIMER_SLOTS - 1);
+        for (int level = 1; level < TIMER_LEVELS && slot == 0; level++) {
+            slot = (w->now >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1);
+            cascade(w, level, slot);
+        }
+
+        slot = w->now & (TIMER_SLOTS - 1);
+        struct timer *t = w->slots[0][slot];
+        w->slots[0][slot] = NULL;
+        w->occupied[0] &= ~(1ULL << slot);
+        while (t != NULL) {
+            struct timer *next = t->next;
+            t->level = TIMER_EXPIRED_LEVEL;
+            push(&w->expired, t);
+            w->count--;
+            t = next;
+        }
+    }
+}
+
+struct timer *timer_next_expired(struct timer_wheel *w) {
+    struct timer *t = w->expired;
+    if (t != NULL) {
+        unlink_timer(&w->expired, t);
+        t->level = -1;
+    }
+    return t;
+}
+
+int timer_next_timeout(struct timer_wheel *w) {
+    if (w->expired != NULL) {
+        return 0;
+    }
+    if (w->count == 0) {
+        return -1;
+    }
+    int now_slot = w->now & (TIMER_SLOTS - 1);
+    unsigned long ticks;
+    if (w->occupied[0] != 0) {
+        // distance to the next occupied level 0 slot after now
+        int shift = (now_slot + 1) & (TIMER_SLOTS - 1);
+        uint64_t rotated = (w->occupied[0] >> shift) | (shift ? w->occupied[0] << (TIMER_SLOTS - shift) : 0);
+        ticks = __builtin_ctzll(rotated) + 1;
+    } else {
+        ticks = TIMER_SLOTS - now_slot;
+    }
+    // measured from the start of the current tick, so this may wake a
+    // little early; the loop then simply waits again
+    return ticks * TIMER_TICK_MS;
+}
@@ -0,0 +1,93 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+// Resolution of the wheel.
+#ifndef TIMER_TICK_MS
+    #define TIMER_TICK_MS 10
+#endif
+
+// Each level has 64 slots; four levels cover 2^24 ticks (about 46 hours
+// at 10ms). Later deadlines are clamped to that.
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS 4
+
+/*
+ * A timer, embedded in whatever it times. Not armed when level is -1.
+ */
+struct timer {
+    struct timer *prev;
+    struct timer *next;
+    unsigned long expires;  // tick it is due on
+    int level;              // wheel level, TIMER_LEVELS when expired, or -1
+    int slot;
+    int kind;               // what the owner should do when it fires
+    void *data;             // the owner
+};
+
+/*
+ * Hierarchical timer wheel. Arming and cancelling a timer is O(1);
+ * timers due in the next 64 ticks sit in level 0, and later ones are
+ * moved down a level each time the level below wraps around.
+ */
+struct timer_wheel {
+    unsigned long now;      // current tick
+    int count;              // armed timers, not counting expired ones
+    uint64_t occupied[TIMER_LEVELS];    // bitmap of non-empty slots
+    struct timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+    struct timer *expired;  // due timers not yet taken by the owner
+};
+
+/*
+ * Return the current time of the monotonic clock in milliseconds.
+ */
+unsigned long timer_now_ms();
+
+/*
+ * Initialize an empty timer wheel starting at time now_ms.
+ */
+void timer_wheel_init(struct timer_wheel *w, unsigned long now_ms);
+
+/*
+ * Initialize a timer that is not armed, owned by data.
+ */
+void timer_init(struct timer *t, void *data);
+
+/*
+ * Arm timer t of the given kind to fire after ms milliseconds,
+ * re-arming it if it is already armed.
+ */
+void timer_arm(struct timer_wheel *w, struct timer *t, int kind, unsigned long ms);
+
+/*
+ * Disarm timer t, if it is armed or expired but not yet taken.
+ */
+void timer_cancel(struct timer_wheel *w, struct timer *t);
+
+/*
+ * Return the milliseconds left before timer t is due, or 0 if it is
+ * due already or not armed.
+ */
+unsigned long timer_remaining(struct timer_wheel *w, struct timer *t);
+
+/*
+ * Move the wheel on to time now_ms, collecting every timer that has
+ * come due. Take them with timer_next_expired().
+ */
+void timer_advance(struct timer_wheel *w, unsigned long now_ms);
+
+/*
+ * Return the next due timer collected by timer_advance(), disarmed,
+ * or NULL if there are none left.
+ */
+struct timer *timer_next_expired(struct timer_wheel *w);
+
+/*
+ * Return how many milliseconds an event loop may sleep before the wheel
+ * needs advancing, or -1 if no timer is armed.
+ */
+int timer_next_timeout(struct timer_wheel *w);
+
+#endif
@@ -0,0 +1,558 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tourney.h"
+#include "game.h"
+#include "metrics.h"
+#include "proto.h"
+#include "timer.h"
+
+static __thread struct tourney *thread_tourney = NULL;
+
+// Fills the places of the bracket nobody registered for. Its client is
+// NULL, so like a player who has gone, it loses every bout it reaches.
+static struct entrant bye;
+
+void tourney_attach(struct tourney *t, struct matchmaker *mm) {
+    thread_tourney = t;
+    if (t != NULL) {
+        t->mm = mm;
+    }
+}
+
+int tourney_init(struct tourney *t, int size, int format) {
+    memset(t, 0, sizeof(*t));
+    t->size = size;
+    t->format = format;
+    t->state = TOURNEY_OPEN;
+    t->entrants = malloc(size * sizeof(struct entrant));
+    if (t->entrants == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    return 0;
+}
+
+static void free_bracket(struct tourney *t) {
+    free(t->bouts);
+    free(t->rounds);
+    free(t->ready);
+    t->bouts = NULL;
+    t->rounds = NULL;
+    t->ready = NULL;
+    t->num_bouts = 0;
+    t->num_rounds = 0;
+    t->num_ready = 0;
+}
+
+void tourney_free(struct tourney *t) {
+    free_bracket(t);
+    free(t->entrants);
+    t->entrants = NULL;
+}
+
+/*
+ * Write the name of round r, as players are told it, into buf.
+ */
+static void round_name(struct tourney *t, struct round *r, char *buf, int len) {
+    if (r->stage == TOURNEY_FINAL) {
+        snprintf(buf, len, "The grand final");
+    } else if (t->format == TOURNEY_SINGLE && r->bouts == 1) {
+        snprintf(buf, len, "The final");
+    } else if (t->format == TOURNEY_SINGLE) {
+        snprintf(buf, len, "Round %d", r->number);
+    } else {
+        snprintf(buf, len, "%s round %d", r->stage == TOURNEY_WINNERS ? "Winners'" : "Losers'", r->number);
+    }
+}
+
+/*
+ * Tell client c about a tournament event, in its protocol. Events
+ * about a round give it as r, and those naming a player give name.
+ */
+static void notify(struct client_sock *c, int event, struct round *r, int count, const char *name) {
+    struct tourney *t = thread_tourney;
+    if (c->proto == PROTO_BINARY) {
+        char payload[sizeof(struct proto_tourney) + MAX_NAME + 1];
+        struct proto_tourney *p = (struct proto_tourney *) payload;
+        p->event = event;
+        p->stage = r != NULL ? r->stage : 0;
+        p->round = r != NULL ? r->number : 0;
+        p->count[0] = count >> 8;
+        p->count[1] = count & 0xff;
+        int len = sizeof(struct proto_tourney);
+        if (name != NULL) {
+            int n = strlen(name) + 1;
+            memcpy(payload + len, name, n);
+            len += n;
+        }
+        write_frame_to_client(c, OP_TOURNEY, payload, len);
+        return;
+    }
+
+    char round[32] = "";
+    if (r != NULL) {
+        round_name(t, r, round, sizeof(round));
+    }
+    char msg[BUF_SIZE + MAX_NAME];
+    switch (event) {
+    case TOURNEY_REGISTERED:
+        snprintf(msg, sizeof(msg), "[tournament] You are registered, %d of %d players so far.\n", count, t->size);
+        break;
+    case TOURNEY_WITHDRAWN:
+        snprintf(msg, sizeof(msg), "[tournament] You are not in the tournament.\n");
+        break;
+    case TOURNEY_CLOSED:
+        snprintf(msg, sizeof(msg), "[tournament] There is no tournament open to join.\n");
+        break;
+    case TOURNEY_STARTED:
+        snprintf(msg, sizeof(msg), "[tournament] The tournament has begun, with %d players.\n", count);
+        break;
+    case TOURNEY_BOUT:
+        snprintf(msg, sizeof(msg), "[tournament] %s: you play %s.\n", round, name);
+        break;
+    case TOURNEY_ROUND:
+        snprintf(msg, sizeof(msg), "[tournament] %s is over, %d player%s left.\n", round, count,
+            count == 1 ? "" : "s");
+        break;
+    case TOURNEY_OUT:
+        snprintf(msg, sizeof(msg), "[tournament] You are out, in place %d.\n", count);
+        break;
+    case TOURNEY_CHAMPION:
+        snprintf(msg, sizeof(msg), "[tournament] %s wins the tournament!\n", name);
+        break;
+    default:
+        return;
+    }
+    write_buf_to_client(c, msg, strlen(msg));
+}
+
+/*
+ * Append a round of the given number of bouts to the bracket.
+ * Return the index of its first bout.
+ */
+static int add_round(struct tourney *t, int stage, int number, int bouts) {
+    struct round *r = &t->rounds[t->num_rounds];
+    r->stage = stage;
+    r->number = number;
+    r->bouts = bouts;
+    r->done = 0;
+    r->played = 0;
+    int first = t->num_bouts;
+    for (int i = 0; i < bouts; i++) {
+        struct bout *b = &t->bouts[t->num_bouts++];
+        b->sides[0] = NULL;
+        b->sides[1] = NULL;
+        b->winner_to = -1;
+        b->loser_to = -1;
+        b->round = t->num_rounds;
+        b->state = BOUT_PENDING;
+    }
+    t->num_rounds++;
+    return first;
+}
+
+/*
+ * Lay out the bouts of a bracket with slots places, a power of two.
+ * The first slots / 2 bouts are the first round, in seeding order.
+ * Return 0 on success, 1 on error.
+ */
+static int build(struct tourney *t, int slots) {
+    int k = 0;
+    while ((1 << k) < slots) {
+        k++;
+    }
+    t->bouts = malloc(2 * slots * sizeof(struct bout));
+    t->rounds = malloc((3 * k + 1) * sizeof(struct round));
+    t->ready = malloc(2 * slots * sizeof(int));
+    if (t->bouts == NULL || t->rounds == NULL || t->ready == NULL) {
+        perror("malloc");
+        free_bracket(t);
+        return 1;
+    }
+
+    // winners' round r has slots >> r bouts, each feeding half of one
+    // in the next
+    int wb[k + 1];
+    for (int r = 1; r <= k; r++) {
+        wb[r] = add_round(t, TOURNEY_WINNERS, r, slots >> r);
+    }
+    for (int r = 1; r < k; r++) {
+        for (int j = 0; j < slots >> r; j++) {
+            t->bouts[wb[r] + j].winner_to = (wb[r + 1] + j / 2) * 2 + j % 2;
+        }
+    }
+    if (t->format == TOURNEY_SINGLE) {
+        return 0;
+    }
+
+    // The losers of winners' round 1 play each other. After that, the
+    // losers' bracket alternates between taking in the losers of the
+    // next winners' round and halving itself, until one player is left
+    // to meet the winners' champion in the grand final.
+    int number = 1;
+    int last = -1;      // latest losers' round
+    if (k > 1) {
+        last = add_round(t, TOURNEY_LOSERS, number++, slots >> 2);
+        for (int j = 0; j < slots >> 1; j++) {
+            t->bouts[wb[1] + j].loser_to = (last + j / 2) * 2 + j % 2;
+        }
+    }
+    for (int r = 2; r <= k; r++) {
+        int n = slots >> r;
+        int drop = add_round(t, TOURNEY_LOSERS, number++, n);
+        for (int j = 0; j < n; j++) {
+            t->bouts[last + j].winner_to = (drop + j) * 2;
+            // in reverse, so players who met once do not meet again soon
+            t->bouts[wb[r] + j].loser_to = (drop + n - 1 - j) * 2 + 1;
+        }
+        last = drop;
+        if (r < k) {
+            int half = add_round(t, TOURNEY_LOSERS, number++, n / 2);
+            for (int j = 0; j < n; j++) {
+                t->bouts[drop + j].winner_to = (half + j / 2) * 2 + j % 2;
+            }
+            last = half;
+        }
+    }
+    int final = add_round(t, TOURNEY_FINAL, 1, 1);
+    t->bouts[wb[k]].winner_to = final * 2;
+    if (k == 1) {
+        t->bouts[wb[1]].loser_to = final * 2 + 1;
+    } else {
+        t->bouts[last].winner_to = final * 2 + 1;
+    }
+    return 0;
+}
+
+static void fill(struct tourney *t, int to, struct entrant *e);
+
+/*
+ * Entrant e has lost its last bout.
+ */
+static void eliminate(struct tourney *t, struct entrant *e) {
+    e->bout = -1;
+    e->out = 1;
+    int place = t->remaining--;
+    // a player still here lost a match, and goes back to matchmaking
+    // when it ends
+    if (e->client != NULL) {
+        notify(e->client, TOURNEY_OUT, NULL, place, NULL);
+        metric_add(M_TOURNEY_PLAYERS, -1);
+    }
+}
+
+/*
+ * Entrant e has won the tournament. Tell everyone who took part and is
+ * still here, and let them go.
+ */
+static void crown(struct tourney *t, struct entrant *e) {
+    printf("Tournament won by %s.\n", e->name);
+    for (int i = 0; i < t->count; i++) {
+        struct client_sock *c = t->entrants[i].client;
+        if (c == NULL) {
+            continue;
+        }
+        notify(c, TOURNEY_CHAMPION, NULL, 0, e->name);
+        c->entrant = NULL;
+        if (!t->entrants[i].out) {
+            metric_add(M_TOURNEY_PLAYERS, -1);
+            // won the final by walkover while waiting for it
+            if (c->state == STATE_WAITING) {
+                mm_enqueue(t->mm, c);
+            }
+        }
+    }
+    t->state = TOURNEY_OVER;
+    metric_add(M_TOURNEYS_FINISHED, 1);
+}
+
+/*
+ * Tell every entrant still in that round r is over.
+ */
+static void report_round(struct tourney *t, struct round *r) {
+    for (int i = 0; i < t->count; i++) {
+        struct entrant *e = &t->entrants[i];
+        if (e->client != NULL && !e->out) {
+            notify(e->client, TOURNEY_ROUND, r, t->remaining, NULL);
+        }
+    }
+}
+
+/*
+ * Bout b has been won by its side w, in a match if played is set and
+ * by walkover otherwise. Send its players on.
+ */
+static void decide(struct tourney *t, struct bout *b, int w, int played) {
+    struct entrant *winner = b->sides[w];
+    struct entrant *loser = b->sides[1 - w];
+    struct round *r = &t->rounds[b->round];
+    b->state = BOUT_DONE;
+    r->done++;
+    r->played += played;
+    if (played) {
+        metric_add(M_TOURNEY_BOUTS, 1);
+    }
+
+    if (b->loser_to >= 0) {
+        fill(t, b->loser_to, loser);
+    } else if (loser != &bye) {
+        eliminate(t, loser);
+    }
+    // rounds decided entirely by byes are not worth a mention
+    if (r->done == r->bouts && r->played > 0) {
+        report_round(t, r);
+    }
+    if (b->winner_to >= 0) {
+        fill(t, b->winner_to, winner);
+    } else {
+        crown(t, winner);
+    }
+}
+
+/*
+ * Return 1 if entrant e cannot play: a bye, or a player who has gone.
+ */
+static int absent(struct entrant *e) {
+    return e->client == NULL;
+}
+
+/*
+ * Put entrant e on side to % 2 of bout to / 2. Once both sides are
+ * known, the bout is ready to play, or decided by walkover if either
+ * player is absent.
+ */
+static void fill(struct tourney *t, int to, struct entrant *e) {
+    struct bout *b = &t->bouts[to / 2];
+    b->sides[to % 2] = e;
+    if (e != &bye) {
+        e->bout = to / 2;
+    }
+    if (b->sides[0] == NULL || b->sides[1] == NULL) {
+        return;
+    }
+    if (absent(b->sides[0]) || absent(b->sides[1])) {
+        decide(t, b, absent(b->sides[0]) ? 1 : 0, 0);
+        return;
+    }
+    b->state = BOUT_READY;
+    t->ready[t->num_ready++] = to / 2;
+}
+
+/*
+ * Order entrants by rating, best first, then by registration.
+ */
+static int by_rating(const void *a, const void *b) {
+    const struct entrant *x = *(struct entrant * const *) a;
+    const struct entrant *y = *(struct entrant * const *) b;
+    if (x->rating != y->rating) {
+        return y->rating - x->rating;
+    }
+    return x < y ? -1 : 1;
+}
+
+/*
+ * Let every registrant go back to matchmaking, and open registration
+ * afresh.
+ */
+static void cancel(struct tourney *t) {
+    for (int i = 0; i < t->count; i++) {
+        struct client_sock *c = t->entrants[i].client;
+        c->entrant = NULL;
+        mm_enqueue(t->mm, c);
+        notify(c, TOURNEY_WITHDRAWN, NULL, 0, NULL);
+        metric_add(M_TOURNEY_PLAYERS, -1);
+    }
+    t->count = 0;
+}
+
+/*
+ * Seed the registrants into a bracket and start the tournament.
+ */
+static void start(struct tourney *t) {
+    int slots = 2;
+    while (slots < t->count) {
+        slots *= 2;
+    }
+    struct entrant **seeds = malloc(slots * sizeof(struct entrant *));
+    int *order = malloc(slots * sizeof(int));
+    if (seeds == NULL || order == NULL) {
+        perror("malloc");
+    }
+    if (seeds == NULL || order == NULL || build(t, slots)) {
+        free(seeds);
+        free(order);
+        cancel(t);
+        return;
+    }
+    printf("Tournament started with %d players.\n", t->count);
+
+    // the best seeds get the byes, and meet each other as late as can be
+    for (int i = 0; i < slots; i++) {
+        seeds[i] = i < t->count ? &t->entrants[i] : &bye;
+    }
+    qsort(seeds, t->count, sizeof(struct entrant *), by_rating);
+    order[0] = 0;
+    for (int n = 1; n < slots; n *= 2) {
+        for (int i = n - 1; i >= 0; i--) {
+            order[2 * i] = order[i];
+            order[2 * i + 1] = 2 * n - 1 - order[i];
+        }
+    }
+
+    t->state = TOURNEY_RUNNING;
+    t->remaining = t->count;
+    for (int i = 0; i < t->count; i++) {
+        notify(t->entrants[i].client, TOURNEY_STARTED, NULL, t->count, NULL);
+    }
+    for (int i = 0; i < slots; i++) {
+        fill(t, i, seeds[order[i]]);
+    }
+    free(seeds);
+    free(order);
+}
+
+void tourney_register(struct client_sock *c) {
+    struct tourney *t = thread_tourney;
+    if (t != NULL && tourney_playing(c)) {
+        if (t->state == TOURNEY_OPEN) {
+            notify(c, TOURNEY_REGISTERED, NULL, t->count, NULL);
+        }
+        return;
+    }
+    if (t == NULL || t->state != TOURNEY_OPEN) {
+        notify(c, TOURNEY_CLOSED, NULL, 0, NULL);
+        return;
+    }
+    struct entrant *e = &t->entrants[t->count++];
+    e->client = c;
+    memcpy(e->name, c->name->text, c->name->len + 1);
+    e->rating = c->rating;
+    e->bout = -1;
+    e->out = 0;
+    c->entrant = e;
+    mm_remove(t->mm, c);
+    if (t->count == 1) {
+        t->opened_ms = timer_now_ms();
+    }
+    metric_add(M_TOURNEY_PLAYERS, 1);
+    notify(c, TOURNEY_REGISTERED, NULL, t->count, NULL);
+    if (t->count == t->size) {
+        start(t);
+    }
+}
+
+/*
+ * Take client c's entrant out of the tournament. Before the start, its
+ * place is given up altogether; after, it loses its bouts by walkover.
+ */
+static void leave(struct tourney *t, struct client_sock *c) {
+    struct entrant *e = c->entrant;
+    c->entrant = NULL;
+    if (!e->out) {
+        metric_add(M_TOURNEY_PLAYERS, -1);
+    }
+    if (t->state == TOURNEY_OPEN) {
+        struct entrant *last = &t->entrants[--t->count];
+        if (e != last) {
+            *e = *last;
+            e->client->entrant = e;
+        }
+        return;
+    }
+    e->client = NULL;
+}
+
+void tourney_withdraw(struct client_sock *c) {
+    struct tourney *t = thread_tourney;
+    if (c->entrant != NULL) {
+        int playing = !c->entrant->out;
+        leave(t, c);
+        if (playing) {
+            mm_enqueue(t->mm, c);
+        }
+    }
+    notify(c, TOURNEY_WITHDRAWN, NULL, 0, NULL);
+}
+
+void tourney_drop(struct client_sock *c) {
+    if (c->entrant != NULL) {
+        leave(thread_tourney, c);
+    }
+}
+
+void tourney_result(struct match *m, int winner) {
+    struct tourney *t = thread_tourney;
+    struct entrant *e0 = m->players[0]->entrant;
+    struct entrant *e1 = m->players[1]->entrant;
+    if (t == NULL || t->state != TOURNEY_RUNNING || e0 == NULL || e1 == NULL
+            || e0->bout < 0 || e0->bout != e1->bout) {
+        return;
+    }
+    struct bout *b = &t->bouts[e0->bout];
+    if (b->state != BOUT_PLAYING) {
+        return;
+    }
+    decide(t, b, b->sides[0] == m->players[winner]->entrant ? 0 : 1, 1);
+}
+
+int tourney_playing(struct client_sock *c) {
+    return c->entrant != NULL && !c->entrant->out;
+}
+
+void tourney_tick(unsigned long now) {
+    struct tourney *t = thread_tourney;
+    if (t == NULL) {
+        return;
+    }
+    // the bracket outlives the last bout until everything that led up
+    // to crowning the champion has returned
+    if (t->state == TOURNEY_OVER) {
+        free_bracket(t);
+        t->count = 0;
+        t->state = TOURNEY_OPEN;
+    } else if (t->state == TOURNEY_OPEN && t->count >= 2
+            && now - t->opened_ms >= TOURNEY_WINDOW * 1000UL) {
+        start(t);
+    }
+}
+
+int tourney_timeout(unsigned long now) {
+    struct tourney *t = thread_tourney;
+    if (t == NULL || (t->state == TOURNEY_OPEN && t->count < 2) || t->state == TOURNEY_RUNNING) {
+        return -1;
+    }
+    unsigned long due = t->state == TOURNEY_OPEN ? t->opened_ms + TOURNEY_WINDOW * 1000UL : now;
+    return due > now ? due - now : 0;
+}
+
+int tourney_next_pair(struct client_sock **p1, struct client_sock **p2) {
+    struct tourney *t = thread_tourney;
+    while (t != NULL && t->state == TOURNEY_RUNNING && t->num_ready > 0) {
+        struct bout *b = &t->bouts[t->ready[--t->num_ready]];
+        if (b->state != BOUT_READY) {
+            continue;
+        }
+        // a player may have gone since the bout became ready
+        if (absent(b->sides[0]) || absent(b->sides[1])) {
+            decide(t, b, absent(b->sides[0]) ? 1 : 0, 0);
+            continue;
+        }
+        b->state = BOUT_PLAYING;
+        *p1 = b->sides[0]->client;
+        *p2 = b->sides[1]->client;
+        struct round *r = &t->rounds[b->round];
+        notify(*p1, TOURNEY_BOUT, r, 0, b->sides[1]->name);
+        notify(*p2, TOURNEY_BOUT, r, 0, b->sides[0]->name);
+        return 1;
+    }
+    return 0;
+}
+
+void tourney_unpair(struct client_sock *p1, struct client_sock *p2) {
+    struct tourney *t = thread_tourney;
+    int i = p1->entrant->bout;
+    t->bouts[i].state = BOUT_READY;
+    t->ready[t->num_ready++] = i;
+}
@@ -0,0 +1,174 @@
+#ifndef TOURNEY_H
+#define TOURNEY_H
+
+#include "client.h"
+#include "matchmaking.h"
+
+// Most players a tournament may be opened for.
+#ifndef TOURNEY_MAX_PLAYERS
+    #define TOURNEY_MAX_PLAYERS 4096
+#endif
+
+// Seconds registration stays open after the first player registers,
+// if the tournament does not fill up before then.
+#ifndef TOURNEY_WINDOW
+    #define TOURNEY_WINDOW 60
+#endif
+
+/*
+ * Bracket formats.
+ */
+#define TOURNEY_SINGLE 0    // out after one loss
+#define TOURNEY_DOUBLE 1    // out after two; losers drop into a losers' bracket
+
+/*
+ * Tournament states.
+ */
+#define TOURNEY_OPEN 0      // taking registrations
+#define TOURNEY_RUNNING 1   // bracket seeded, bouts being played
+#define TOURNEY_OVER 2      // champion crowned, registration opens next tick
+
+/*
+ * A player in the tournament. Entrants who withdraw or disconnect keep
+ * their place in the bracket, and lose every bout they reach by
+ * walkover.
+ */
+struct entrant {
+    struct client_sock *client;     // NULL once gone
+    char name[MAX_NAME + 1];
+    int rating;         // at registration, for seeding
+    int bout;           // bout being played or waited for, -1 if none
+    int out;            // has lost its last bout
+};
+
+/*
+ * Bout states.
+ */
+#define BOUT_PENDING 0      // waiting for one or both of its sides
+#define BOUT_READY 1        // both sides known and present, to be started
+#define BOUT_PLAYING 2
+#define BOUT_DONE 3
+
+/*
+ * One match of the bracket. The bracket is a graph of bouts: each
+ * sends its winner, and in double elimination its loser, on to a side
+ * of a later bout, given as that bout's index * 2 + the side.
+ */
+struct bout {
+    struct entrant *sides[2];   // NULL until known
+    int winner_to;      // -1 for the final
+    int loser_to;       // -1 if the loser is out
+    int round;          // index into the tournament's rounds
+    int state;
+};
+
+/*
+ * A set of bouts reported on together. Bouts of a round are played as
+ * soon as their sides are known, not all at once.
+ */
+struct round {
+    int stage;          // TOURNEY_WINNERS, TOURNEY_LOSERS or TOURNEY_FINAL
+    int number;         // within its stage, from 1
+    int bouts;
+    int done;
+    int played;         // not decided by walkover
+};
+
+/*
+ * A tournament, open for registrations until it has size players or
+ * TOURNEY_WINDOW seconds have passed since the first one registered.
+ * The bracket is then seeded by rating, and bouts are started as soon
+ * as both their players are known, so the whole event takes about as
+ * many match lengths as the bracket has rounds. Once a champion is
+ * crowned, the next tournament opens.
+ */
+struct tourney {
+    int size;
+    int format;
+    int state;
+    struct entrant *entrants;   // size of them
+    int count;
+    unsigned long opened_ms;    // when the first player registered
+    struct bout *bouts;
+    int num_bouts;
+    struct round *rounds;
+    int num_rounds;
+    int *ready;         // stack of BOUT_READY bouts
+    int num_ready;
+    int remaining;      // entrants not yet out
+    struct matchmaker *mm;      // where players go once out of it
+};
+
+/*
+ * Initialize tournament t for size players in the given format.
+ * Return 0 on success, 1 on error.
+ */
+int tourney_init(struct tourney *t, int size, int format);
+
+/*
+ * Free the memory of tournament t.
+ */
+void tourney_free(struct tourney *t);
+
+/*
+ * Make t the tournament the calling thread hosts, its players leaving
+ * it for matchmaker mm. Tournament functions do nothing until it is
+ * set, apart from telling clients there is no tournament to join.
+ */
+void tourney_attach(struct tourney *t, struct matchmaker *mm);
+
+/*
+ * Register lobby client c for the open tournament, taking it out of
+ * matchmaking, or tell it there is none open.
+ */
+void tourney_register(struct client_sock *c);
+
+/*
+ * Take client c out of the tournament, back into matchmaking, if it is
+ * in it, and tell it so.
+ */
+void tourney_withdraw(struct client_sock *c);
+
+/*
+ * Client c has disconnected. Give up its place, if it has one.
+ */
+void tourney_drop(struct client_sock *c);
+
+/*
+ * Player winner has won match m. If it was a bout, advance its players.
+ */
+void tourney_result(struct match *m, int winner);
+
+/*
+ * Return 1 if client c has bouts still to play, so does not go back
+ * into matchmaking after a match.
+ */
+int tourney_playing(struct client_sock *c);
+
+/*
+ * Seed the bracket and start the tournament if registration is over
+ * by now, a time from timer_now_ms().
+ */
+void tourney_tick(unsigned long now);
+
+/*
+ * Return the milliseconds from now until registration closes, or -1
+ * if the tournament is not waiting for that.
+ */
+int tourney_timeout(unsigned long now);
+
+/*
+ * Take the next bout ready to be played and tell its players who they
+ * face; *p1 and *p2 are set to them, for start_match().
+ *
+ * Return 1 if there was one, 0 otherwise.
+ */
+int tourney_next_pair(struct client_sock **p1, struct client_sock **p2);
+
+/*
+ * Put the bout of p1 and p2, taken by tourney_next_pair(), back to be
+ * started again later.
+ */
+void tourney_unpair(struct client_sock *p1, struct client_sock *p2);
+
+#endif
@@ -0,0 +1,655 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "upgrade.h"
+#include "game.h"
+#include "metrics.h"
+#include "spectate.h"
+#include "stats.h"
+
+/*
+ * Messages of a hand-over, each sent as one SOCK_SEQPACKET record.
+ * For every worker the old server sends UP_WORKER, then an UP_MATCH
+ * per match, then an UP_CLIENT per client followed by UP_OUTPUT
+ * messages carrying its queued output. UP_DONE ends the hand-over.
+ * The new server answers UP_ACK once it has restored everything, and
+ * the old server then lets go of it all and closes the connection. An
+ * old server that gives up waiting sends UP_ABORT instead, and keeps
+ * serving.
+ */
+#define UP_HELLO 1
+#define UP_WORKER 2     // with the listening socket
+#define UP_MATCH 3
+#define UP_CLIENT 4     // with the client's socket
+#define UP_OUTPUT 5
+#define UP_DONE 6
+#define UP_ACK 7
+#define UP_ABORT 8
+
+struct up_hello {
+    int type;
+    uint32_t magic;
+    uint32_t version;
+    int num_workers;
+    uint64_t seed;
+    unsigned long next_match_id;
+    unsigned long next_client_id;
+};
+
+struct up_worker {
+    int type;
+    int worker;
+};
+
+struct up_match {
+    int type;
+    int worker;
+    unsigned long id;
+    uint64_t seed;
+    struct rng rng;
+    struct fighter fighters[2];
+    int missed[2];
+    int damage[2];
+    int moves;
+    int turn;
+    int menu;
+};
+
+struct up_client {
+    int type;
+    int worker;
+    unsigned long id;
+    int state;
+    int proto;
+    char username[MAX_NAME + 1];
+    char in[BUF_SIZE];          // input not yet handled
+    int in_len;
+    int rating;
+    unsigned long recent[RECENT_OPPONENTS];
+    int recent_next;
+    int timer_kind;             // -1 if no timer is armed
+    unsigned long timer_ms;     // left before it is due
+    unsigned long match;        // id of the match played in, or 0
+    int player;                 // index in that match's players
+    unsigned long watching;     // id of the match watched, or 0
+    int out_len;                // bytes of output following in UP_OUTPUT
+};
+
+struct up_output {
+    int type;
+    int len;
+    char data[UPGRADE_CHUNK];
+};
+
+union up_msg {
+    int type;
+    struct up_hello hello;
+    struct up_worker worker;
+    struct up_match match;
+    struct up_client client;
+    struct up_output output;
+};
+
+static int listen_fd = -1;
+static char listen_path[108];
+
+/*
+ * Fill in addr for the socket at path.
+ * Return 0 on success, 1 if path is too long.
+ */
+static int make_addr(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "upgrade socket path too long: %s\n", path);
+        return 1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int upgrade_listen(const char *path) {
+    struct sockaddr_un addr;
+    if (make_addr(&addr, path)) {
+        return -1;
+    }
+    listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        perror("upgrade socket");
+        return -1;
+    }
+    // whatever was there is a server that has handed over, or is gone
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listen_fd, 1) < 0) {
+        perror("upgrade: bind");
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+    strcpy(listen_path, path);
+    return listen_fd;
+}
+
+void upgrade_close() {
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(listen_path);
+        listen_fd = -1;
+    }
+}
+
+int upgrade_connect(const char *path) {
+    struct sockaddr_un addr;
+    if (make_addr(&addr, path)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("upgrade socket");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Send len bytes of msg as one message, with socket fd attached
+ * unless it is -1.
+ * Return 0 on success, 1 on error.
+ */
+static int send_msg(int conn, const void *msg, int len, int fd) {
+    struct iovec iov = { (void *) msg, len };
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+
+    char control[CMSG_SPACE(sizeof(int))];
+    if (fd >= 0) {
+        memset(control, 0, sizeof(control));
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+    }
+
+    while (sendmsg(conn, &mh, MSG_NOSIGNAL) < 0) {
+        if (errno != EINTR) {
+            perror("upgrade: sendmsg");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Receive one message into msg, and the socket attached to it into *fd,
+ * or -1 if there is none.
+ * Return the length of the message, 0 at the end of the connection,
+ * or -1 on error.
+ */
+static int recv_msg(int conn, union up_msg *msg, int *fd) {
+    struct iovec iov = { msg, sizeof(*msg) };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+
+    *fd = -1;
+    ssize_t n;
+    while ((n = recvmsg(conn, &mh, MSG_CMSG_CLOEXEC)) < 0) {
+        if (errno != EINTR) {
+            perror("upgrade: recvmsg");
+            return -1;
+        }
+    }
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+    if (cm != NULL && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+        memcpy(fd, CMSG_DATA(cm), sizeof(int));
+    }
+    if (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+        fprintf(stderr, "upgrade: message truncated\n");
+        if (*fd >= 0) {
+            close(*fd);
+        }
+        return -1;
+    }
+    return n;
+}
+
+static int send_match(int conn, int worker, struct match *m) {
+    struct up_match msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = UP_MATCH;
+    msg.worker = worker;
+    msg.id = m->id;
+    msg.seed = m->seed;
+    msg.rng = m->rng;
+    for (int i = 0; i < 2; i++) {
+        msg.fighters[i] = m->fighters[i];
+        msg.missed[i] = m->missed[i];
+        msg.damage[i] = m->damage[i];
+    }
+    msg.moves = m->moves;
+    msg.turn = m->turn;
+    msg.menu = m->menu;
+    return send_msg(conn, &msg, sizeof(msg), -1);
+}
+
+/*
+ * Send client c, and all of its queued output.
+ */
+static int send_client(int conn, struct worker *w, struct client_sock *c) {
+    struct up_client msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = UP_CLIENT;
+    msg.worker = w->id;
+    msg.id = c->id;
+    msg.state = c->state;
+    msg.proto = c->proto;
+    if (c->name != NULL) {
+        memcpy(msg.username, c->name->text, c->name->len + 1);
+    }
+    msg.in_len = c->in.tail - c->in.head;
+    memcpy(msg.in, line_buf_bytes(&c->in) + c->in.head, msg.in_len);
+    msg.rating = c->rating;
+    memcpy(msg.recent, c->recent, sizeof(msg.recent));
+    msg.recent_next = c->recent_next;
+    msg.timer_kind = c->timer.level >= 0 ? c->timer.kind : -1;
+    msg.timer_ms = timer_remaining(&w->timers, &c->timer);
+    if (c->match != NULL) {
+        msg.match = c->match->id;
+        msg.player = c->match->players[0] == c ? 0 : 1;
+    }
+    if (c->watching != NULL) {
+        msg.watching = c->watching->id;
+    }
+    msg.out_len = c->out.pending;
+    if (send_msg(conn, &msg, sizeof(msg), c->sock_fd)) {
+        return 1;
+    }
+
+    struct up_output out;
+    out.type = UP_OUTPUT;
+    out.len = 0;
+    for (struct out_chunk *ch = c->out.head; ch != NULL; ch = ch->next) {
+        const char *data = ch->shared != NULL ? ch->shared->data : ch->data;
+        for (int off = ch->off; off < ch->len; ) {
+            int n = ch->len - off;
+            if (n > UPGRADE_CHUNK - out.len) {
+                n = UPGRADE_CHUNK - out.len;
+            }
+            memcpy(out.data + out.len, data + off, n);
+            out.len += n;
+            off += n;
+            if (out.len == UPGRADE_CHUNK) {
+                if (send_msg(conn, &out, sizeof(out), -1)) {
+                    return 1;
+                }
+                out.len = 0;
+            }
+        }
+    }
+    if (out.len > 0) {
+        return send_msg(conn, &out, offsetof(struct up_output, data) + out.len, -1);
+    }
+    return 0;
+}
+
+/*
+ * Wait up to UPGRADE_ACK_WAIT seconds for the new server to confirm
+ * it has restored everything.
+ * Return 0 if it did, 1 otherwise.
+ */
+static int wait_ack(int conn) {
+    struct pollfd p = { conn, POLLIN, 0 };
+    int r;
+    while ((r = poll(&p, 1, UPGRADE_ACK_WAIT * 1000)) < 0 && errno == EINTR) {
+    }
+    if (r <= 0) {
+        fprintf(stderr, "upgrade: the new server did not confirm in time\n");
+        return 1;
+    }
+    union up_msg msg;
+    int fd;
+    int n = recv_msg(conn, &msg, &fd);
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (n != sizeof(int) || msg.type != UP_ACK) {
+        fprintf(stderr, "upgrade: the new server could not restore everything\n");
+        return 1;
+    }
+    return 0;
+}
+
+int upgrade_send(int conn, struct worker *workers, int num_workers, uint64_t seed) {
+    struct up_hello hello;
+    memset(&hello, 0, sizeof(hello));
+    hello.type = UP_HELLO;
+    hello.magic = UPGRADE_MAGIC;
+    hello.version = UPGRADE_VERSION;
+    hello.num_workers = num_workers;
+    hello.seed = seed;
+    hello.next_match_id = game_next_id();
+    hello.next_client_id = client_next_id();
+    if (send_msg(conn, &hello, sizeof(hello), -1)) {
+        return 1;
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        struct worker *w = &workers[i];
+        struct up_worker msg = { UP_WORKER, i };
+        if (send_msg(conn, &msg, sizeof(msg), w->s.sock_fd)) {
+            return 1;
+        }
+        // every match once, through its first player
+        for (int j = 0; j < w->clients.count; j++) {
+            struct client_sock *c = w->clients.clients[j];
+            if (c->match != NULL && c->match->players[0] == c && send_match(conn, i, c->match)) {
+                return 1;
+            }
+        }
+        for (int j = 0; j < w->clients.count; j++) {
+            if (send_client(conn, w, w->clients.clients[j])) {
+                return 1;
+            }
+        }
+    }
+
+    int done = UP_DONE;
+    if (send_msg(conn, &done, sizeof(done), -1)) {
+        return 1;
+    }
+    if (wait_ack(conn)) {
+        // whatever it has restored so far, it must not serve
+        int abort = UP_ABORT;
+        send(conn, &abort, sizeof(abort), MSG_NOSIGNAL);
+        return 1;
+    }
+    printf("Handed over to the new server.\n");
+    return 0;
+}
+
+int upgrade_receive_hello(int conn, int *num_workers, uint64_t *seed) {
+    union up_msg msg;
+    int fd;
+    int n = recv_msg(conn, &msg, &fd);
+    if (n != sizeof(struct up_hello) || msg.type != UP_HELLO
+            || msg.hello.magic != UPGRADE_MAGIC || msg.hello.version != UPGRADE_VERSION
+            || msg.hello.num_workers <= 0) {
+        fprintf(stderr, "upgrade: the running server does not speak this version\n");
+        return 1;
+    }
+    *num_workers = msg.hello.num_workers;
+    *seed = msg.hello.seed;
+    game_resume(msg.hello.next_match_id);
+    client_resume(msg.hello.next_client_id);
+    return 0;
+}
+
+/*
+ * Matches of the worker being received, until their players arrive.
+ */
+struct up_matches {
+    struct match **by_id;   // sorted by id once the clients start
+    int count;
+    int cap;
+    int sorted;
+};
+
+static int compare_ids(const void *a, const void *b) {
+    unsigned long x = (*(struct match **) a)->id;
+    unsigned long y = (*(struct match **) b)->id;
+    return x < y ? -1 : x > y;
+}
+
+static struct match *find_received(struct up_matches *ms, unsigned long id) {
+    if (!ms->sorted) {
+        qsort(ms->by_id, ms->count, sizeof(struct match *), compare_ids);
+        ms->sorted = 1;
+    }
+    int lo = 0, hi = ms->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ms->by_id[mid]->id < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < ms->count && ms->by_id[lo]->id == id ? ms->by_id[lo] : NULL;
+}
+
+/*
+ * Check every match received for a worker has both players, index them
+ * on it, and start on the next worker's.
+ * Return 0 on success, 1 if a match is missing a player.
+ */
+static int end_worker(struct up_matches *ms) {
+    for (int i = 0; i < ms->count; i++) {
+        struct match *m = ms->by_id[i];
+        if (m->players[0] == NULL || m->players[1] == NULL) {
+            fprintf(stderr, "upgrade: match %lu is missing a player\n", m->id);
+            return 1;
+        }
+    }
+    for (int i = 0; i < ms->count; i++) {
+        game_add(ms->by_id[i]);
+    }
+    ms->count = 0;
+    ms->sorted = 0;
+    return 0;
+}
+
+static struct match *receive_match(struct up_matches *ms, struct up_match *msg) {
+    struct match *m = calloc(1, sizeof(struct match));
+    if (m == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    if (ms->count == ms->cap) {
+        int cap = ms->cap > 0 ? ms->cap * 2 : 64;
+        struct match **grown = realloc(ms->by_id, cap * sizeof(struct match *));
+        if (grown == NULL) {
+            perror("realloc");
+            free(m);
+            return NULL;
+        }
+        ms->by_id = grown;
+        ms->cap = cap;
+    }
+    ms->by_id[ms->count++] = m;
+    ms->sorted = 0;
+
+    m->id = msg->id;
+    m->seed = msg->seed;
+    m->rng = msg->rng;
+    for (int i = 0; i < 2; i++) {
+        m->fighters[i] = msg->fighters[i];
+        m->missed[i] = msg->missed[i];
+        m->damage[i] = msg->damage[i];
+    }
+    m->moves = msg->moves;
+    m->turn = msg->turn;
+    m->menu = msg->menu;
+    metric_add(M_MATCHES_ACTIVE, 1);
+    return m;
+}
+
+/*
+ * Add the client described by msg, on socket fd, to worker w. The
+ * client owns fd from then on, whether or not it could be restored.
+ * Return the client, or NULL on error.
+ */
+static struct client_sock *receive_client(struct worker *w, struct up_matches *ms, struct up_client *msg, int fd) {
+    struct client_sock *c = addclient(&w->clients, fd);
+    if (loop_add(w->loop, fd, LOOP_STREAM | LOOP_READ, c)) {
+        remove_client(&w->clients, c);
+        close(fd);
+        return NULL;
+    }
+    metric_add(M_CONNECTIONS_ACTIVE, 1);
+    c->id = msg->id;
+    c->state = msg->state;
+    c->proto = msg->proto;
+    if (msg->in_len < 0 || msg->in_len > BUF_SIZE || line_buf_set(&c->in, msg->in, msg->in_len)) {
+        fprintf(stderr, "upgrade: cannot restore input of client %lu\n", msg->id);
+        return NULL;
+    }
+    c->rating = msg->rating;
+    memcpy(c->recent, msg->recent, sizeof(c->recent));
+    c->recent_next = msg->recent_next;
+    if (c->state != STATE_NAME) {
+        msg->username[MAX_NAME] = '\0';
+        if (set_username(c, msg->username)) {
+            fprintf(stderr, "upgrade: cannot restore user name %s\n", msg->username);
+            return NULL;
+        }
+        name_place(c->name, w->id, 0);
+        c->stats = stats_lookup(c->name->text);
+    }
+    if (msg->timer_kind >= 0) {
+        timer_arm(&w->timers, &c->timer, msg->timer_kind, msg->timer_ms);
+    }
+
+    if (c->state == STATE_PLAYING) {
+        struct match *m = find_received(ms, msg->match);
+        if (m == NULL || msg->player < 0 || msg->player > 1 || m->players[msg->player] != NULL) {
+            fprintf(stderr, "upgrade: player of unknown match %lu\n", msg->match);
+            return NULL;
+        }
+        m->players[msg->player] = c;
+        c->match = m;
+    } else if (c->state == STATE_WAITING) {
+        mm_enqueue(&w->mm, c);
+        lobby_enter(c);
+        struct match *m = msg->watching != 0 ? find_received(ms, msg->watching) : NULL;
+        if (m != NULL) {
+            spectate_join(m, c);
+        }
+    }
+    return c;
+}
+
+int upgrade_receive(int conn, struct worker *workers, int num_workers) {
+    struct up_matches ms = { NULL, 0, 0, 0 };
+    struct worker *w = NULL;
+    struct client_sock *output_to = NULL;   // client UP_OUTPUT is for
+    int output_left = 0;
+    int clients = 0;
+    int matches = 0;
+    int err = 1;
+
+    union up_msg msg;
+    int fd = -1, n;
+    while ((n = recv_msg(conn, &msg, &fd)) > 0) {
+        if (msg.type == UP_DONE) {
+            err = end_worker(&ms);
+            break;
+        }
+
+        if (msg.type == UP_WORKER) {
+            if (n != sizeof(msg.worker) || fd < 0 || msg.worker.worker < 0
+                    || msg.worker.worker >= num_workers || (w != NULL && end_worker(&ms))) {
+                break;
+            }
+            w = &workers[msg.worker.worker];
+            w->s.sock_fd = fd;
+            if (loop_add(w->loop, fd, LOOP_READ | LOOP_ACCEPT, &w->s)) {
+                break;
+            }
+            // what is restored is counted in, and seen by, this worker
+            metrics_attach(w->id);
+            lobby_attach(&w->lobby);
+            game_attach(&w->matches, w->id);
+            continue;
+        }
+
+        if (w == NULL) {
+            break;
+        }
+        if (msg.type == UP_MATCH && n == sizeof(msg.match)) {
+            if (receive_match(&ms, &msg.match) == NULL) {
+                break;
+            }
+            matches++;
+
+        } else if (msg.type == UP_CLIENT && n == sizeof(msg.client) && fd >= 0 && output_left == 0) {
+            output_to = receive_client(w, &ms, &msg.client, fd);
+            fd = -1;
+            if (output_to == NULL) {
+                break;
+            }
+            output_left = msg.client.out_len;
+            clients++;
+
+        } else if (msg.type == UP_OUTPUT && msg.output.len > 0 && msg.output.len <= output_left
+                && n == offsetof(struct up_output, data) + msg.output.len) {
+            if (out_append(&output_to->out, msg.output.data, msg.output.len)) {
+                break;
+            }
+            mark_dirty(output_to);
+            output_left -= msg.output.len;
+
+        } else {
+            break;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    if (fd >= 0 && err) {
+        close(fd);
+    }
+    free(ms.by_id);
+
+    if (err) {
+        fprintf(stderr, "upgrade: hand-over from the running server failed\n");
+        return 1;
+    }
+    printf("Took over %d clients and %d matches.\n", clients, matches);
+    return 0;
+}
+
+int upgrade_ack(int conn) {
+    int ack = UP_ACK;
+    return send_msg(conn, &ack, sizeof(ack), -1);
+}
+
+int upgrade_finish(int conn) {
+    // the old server closes its end once it has let go of everything
+    union up_msg msg;
+    int fd, n;
+    int aborted = 0;
+    while ((n = recv_msg(conn, &msg, &fd)) > 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (n == sizeof(int) && msg.type == UP_ABORT) {
+            aborted = 1;
+        }
+    }
+    close(conn);
+    if (aborted || n < 0) {
+        fprintf(stderr, "upgrade: the running server is serving on\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,84 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <stdint.h>
+
+#include "worker.h"
+
+/*
+ * Hot upgrade. A running server listens on a Unix socket; a newly
+ * started server that connects to it is handed the listening sockets
+ * and every client's socket over SCM_RIGHTS, together with the state of
+ * every client and match, and carries on serving them. Once the new
+ * server confirms it has restored everything, the old server exits,
+ * without any connection having been closed. If it does not within
+ * UPGRADE_ACK_WAIT seconds, the old server carries on serving instead
+ * and tells it so.
+ */
+#define UPGRADE_MAGIC 0x52475055    // "UPGR"
+#define UPGRADE_VERSION 4
+
+// Most output bytes carried by one message.
+#ifndef UPGRADE_CHUNK
+    #define UPGRADE_CHUNK 16384
+#endif
+
+// Seconds the old server waits for the new one to confirm it has
+// restored everything handed over.
+#ifndef UPGRADE_ACK_WAIT
+    #define UPGRADE_ACK_WAIT 10
+#endif
+
+/*
+ * Listen for a new server on the Unix socket at path.
+ * Return the listening socket, or -1 on error.
+ */
+int upgrade_listen(const char *path);
+
+/*
+ * Stop listening for a new server, and remove the socket file.
+ */
+void upgrade_close();
+
+/*
+ * Connect to a running server listening at path, asking it to hand over.
+ * Return the connection, or -1 if no server is listening there.
+ */
+int upgrade_connect(const char *path);
+
+/*
+ * Hand everything the stopped workers own over connection conn, and
+ * wait for the new server to confirm it has restored it all.
+ * Return 0 on success, 1 if the new server could not be given it all
+ * or did not confirm, in which case it has been told to give up.
+ */
+int upgrade_send(int conn, struct worker *workers, int num_workers, uint64_t seed);
+
+/*
+ * Receive the first message of a hand-over on conn: the number of
+ * workers to run and the server seed. The ids of new matches and
+ * clients carry on from the old server's.
+ * Return 0 on success, 1 on error.
+ */
+int upgrade_receive_hello(int conn, int *num_workers, uint64_t *seed);
+
+/*
+ * Receive the rest of a hand-over into workers, which have been set up
+ * with no listening socket: their listeners, clients and matches.
+ * Return 0 on success, 1 on error.
+ */
+int upgrade_receive(int conn, struct worker *workers, int num_workers);
+
+/*
+ * Tell the old server on conn that everything it handed over has been
+ * restored. Return 0 on success, 1 on error.
+ */
+int upgrade_ack(int conn);
+
+/*
+ * Wait for the old server to have shut down, and close conn.
+ * Return 0 once it has, 1 if it has gone back to serving instead.
+ */
+int upgrade_finish(int conn);
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <pthread.h>
+
+#include "helpers.h"
+#include "client.h"
+#include "matchmaking.h"
+#include "loop.h"
+#include "timer.h"
+#include "lobby.h"
+#include "game.h"
+
+/*
+ * A client on its way from one worker to another, with what it cannot
+ * leave behind. Its socket is not registered with either worker's loop
+ * while it is in transit.
+ */
+struct migrant {
+    struct migrant *next;
+    int reason;             // MIGRATE_ reason it is moving
+    unsigned long watch;    // for MIGRATE_WATCH, the match, or 0 for any
+    int fd;
+    unsigned long id;
+    int proto;
+    struct name *name;      // held by the migrant until it arrives
+    struct line_buf in;
+    struct rate_limit rate;
+    struct player_stats *stats;
+    int rating;
+    unsigned long recent[RECENT_OPPONENTS];
+    int recent_next;
+    int out_len;
+    char out[];             // output not yet sent
+};
+
+/*
+ * One worker thread. Each worker listens on its own SO_REUSEPORT socket
+ * and owns its clients, matches and event loop outright, so workers
+ * never share state or take locks to serve their clients. A client only
+ * ever changes worker to join a tournament, which is hosted by one, or
+ * to watch a match played on another, and lobby messages are the only
+ * output posted between workers.
+ */
+struct worker {
+    int id;
+    pthread_t thread;
+    struct listen_sock s;
+    struct client_table clients;
+    struct matchmaker mm;
+    struct event_loop *loop;
+    struct timer_wheel timers;
+    struct match_index matches;
+    struct lobby lobby;
+    // Clients other workers have handed over, and the pipe written to
+    // wake this one up for them or for lobby posts. With the lobby's
+    // posts, the only state workers share.
+    pthread_mutex_t inbox_lock;
+    struct migrant *inbox;
+    int inbox_pipe[2];
+    int exit_status;
+};
+
+#endif